@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+// The bit of the ISR which indicates a used buffer notification for one of the queues.
+#define VIRTIO_PCI_ISR_QUEUE 0x01
+
 // The bit of the ISR which indicates a device configuration change.
 #define VIRTIO_PCI_ISR_CONFIG 0x02
 
@@ -4,7 +4,7 @@
 
 #include <acpi/acpi.h>
 #include "pci.h"
-#include "pit.h"
+#include "clock.h"
 #include "debug.h"
 #include "memory.h"
 #include "lowlevel.h"
@@ -253,6 +253,7 @@ ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE Type, ACPI_OSD_EXEC_CALLBACK Functio
     info->Function = Function;
     info->Context = Context;
     SchTask* task = SchCreateTask("AcpiExec", 64*1024, AcpiTaskWrapper, info);
+    SchSetPriority(task, SCH_PRIORITY_HIGH); // GPE/notify handlers are deferred interrupt work
     DbgPrintf("AcpiOsExecute(%u, %p, %p) => task %u\n", Type, Function, Context, task->id);
     return AE_OK;
 }
@@ -271,12 +272,19 @@ void AcpiOsWaitEventsComplete()
 void AcpiOsSleep(UINT64 Milliseconds)
 {
     DbgPrintf("AcpiOsSleep(%llu millisecs)\n", Milliseconds);
-    SchSleep(Milliseconds);
+    // SchDelay also works before the scheduler runs, it takes microseconds so long sleeps are split up
+    while (Milliseconds > 0)
+    {
+        UINT32 chunk = Milliseconds > 1000000 ? 1000000 : (UINT32)Milliseconds;
+        SchDelay(chunk * 1000);
+        Milliseconds -= chunk;
+    }
 }
 
 void AcpiOsStall(UINT32 Microseconds)
 {
     DbgPrintf("AcpiOsStall(%u microsecs)\n", Microseconds);
+    // ACPICA stalls while holding its locks and from the SCI path, this has to busy-wait
     SchStall(Microseconds);
 }
 
@@ -382,7 +390,7 @@ ACPI_STATUS AcpiOsWritePciConfiguration(ACPI_PCI_ID *PciId, UINT32 Reg, UINT64 V
  */
 UINT64 AcpiOsGetTimer()
 {
-    return PitTicksToMs(PitCurrentTick) * 10000; // number of 100 nanosecs
+    return ClockGetNs() / 100; // number of 100 nanosecs
 }
 
 ACPI_STATUS AcpiOsSignal(UINT32 Function, void *Info)
@@ -1,4 +1,5 @@
 #include "pic.h"
+#include "tsc.h"
 #include "apic.h"
 #include "debug.h"
 #include "memory.h"
@@ -9,9 +10,11 @@
 
 #define CPUID_GETFEATURES 1
 #define CPUID_FEAT_EDX_APIC (1 << 9)
+#define CPUID_FEAT_ECX_TSC_DEADLINE (1 << 24)
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_MSR_BSP 0x100 // Indicates if the processor is the bootstrap processor (BSP)
 #define IA32_APIC_BASE_MSR_ENABLE 0x800 // Enables or disables the local APIC
+#define IA32_TSC_DEADLINE_MSR 0x6E0
 
 #define APIC_REG_ID         0x020 // Local APIC ID
 #define APIC_REG_VER        0x030 // Local APIC Version
@@ -22,10 +25,20 @@
 #define APIC_REG_TIMER_INIT 0x380 // Timer initial count Register
 #define APIC_REG_TIMER_CURR 0x390 // Timer current count Register
 #define APIC_REG_TIMER_DIV  0x3E0 // Timer divide Register
-#define APIC_TIMER_LVT_PERIODIC (1 << 17)
+#define APIC_TIMER_LVT_ONESHOT      (0 << 17)
+#define APIC_TIMER_LVT_PERIODIC     (1 << 17)
+#define APIC_TIMER_LVT_TSC_DEADLINE (2 << 17)
+#define APIC_TIMER_LVT_MASKED       (1 << 16)
+
+#define APIC_TIMER_MODE_STOPPED  0
+#define APIC_TIMER_MODE_PERIODIC 1
+#define APIC_TIMER_MODE_ONESHOT  2
 
 uint32_t ApicFrequency = 0;
 static volatile uint8_t* ApicBase = NULL;
+static bool ApicHasTscDeadline = false;
+static int ApicTimerMode = APIC_TIMER_MODE_STOPPED;
+static uint32_t ApicTimerPeriod = 0;
 
 static bool ApicCpuHasLocalApic()
 {
@@ -34,6 +47,13 @@ static bool ApicCpuHasLocalApic()
     return (edx & CPUID_FEAT_EDX_APIC) != 0;
 }
 
+static bool ApicCpuHasTscDeadline()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid2(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    return (ecx & CPUID_FEAT_ECX_TSC_DEADLINE) != 0;
+}
+
 static uintptr_t ApicGetApicBase()
 {
    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
@@ -90,22 +110,84 @@ bool ApicInitialize()
     IntSetPicMode(INT_PIC_MODE_APIC);
     TmPrintfDbg("Switched from 8259 PICs to local APIC\n");
 
-    // Enable local APIC timer
-    ApicWriteRegister(APIC_REG_LVT_TIMER, INTXX_APIC_TIMER);
+    // The timer is calibrated together with the TSC (see TscInitialize) and started afterwards
+    ApicHasTscDeadline = ApicCpuHasTscDeadline();
+    TmPrintfVrb("Local APIC TSC-deadline mode: %s\n", ApicHasTscDeadline ? "yes" : "no");
+    return true;
+}
+
+bool ApicIsAvailable()
+{
+    return ApicBase != NULL;
+}
 
-    // Calibrate timer
+void ApicTimerStartCount()
+{
+    // Free running count down with the interrupt masked, used for calibration
+    ApicWriteRegister(APIC_REG_LVT_TIMER, INTXX_APIC_TIMER | APIC_TIMER_LVT_ONESHOT | APIC_TIMER_LVT_MASKED);
     ApicWriteRegister(APIC_REG_TIMER_INIT, UINT32_MAX);
-    SchStall(500 * 1000);
-    uint32_t rawHz = (UINT32_MAX - ApicReadRegister(APIC_REG_TIMER_CURR)) * 2;
-    uint32_t rawKhz = rawHz / 1000;
-    uint32_t roundKhz = ((rawKhz + 50) / 100) * 100;
-    ApicFrequency = roundKhz * 1000;
-    TmPrintfDbg("Local APIC timer frequency: %u Hz (%u KHz raw=%u, %u Hz)\n", ApicFrequency, roundKhz, rawKhz, rawHz);
-
-    // Enable 100Hz timer
+    ApicTimerMode = APIC_TIMER_MODE_ONESHOT;
+}
+
+uint32_t ApicTimerReadCount()
+{
+    return UINT32_MAX - ApicReadRegister(APIC_REG_TIMER_CURR);
+}
+
+void ApicTimerStartPeriodic(uint32_t frequency)
+{
+    uint32_t period = ApicFrequency / frequency;
+    if (ApicTimerMode == APIC_TIMER_MODE_PERIODIC && ApicTimerPeriod == period)
+        return;
+    if (ApicTimerMode == APIC_TIMER_MODE_ONESHOT && ApicHasTscDeadline)
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+
     ApicWriteRegister(APIC_REG_LVT_TIMER, INTXX_APIC_TIMER | APIC_TIMER_LVT_PERIODIC);
-    ApicWriteRegister(APIC_REG_TIMER_INIT, (ApicFrequency / 1000) * 10);
-    return true;
+    ApicWriteRegister(APIC_REG_TIMER_INIT, period);
+    ApicTimerMode = APIC_TIMER_MODE_PERIODIC;
+    ApicTimerPeriod = period;
+}
+
+void ApicTimerStartOneShot(uint64_t tscDeadline)
+{
+    if (ApicHasTscDeadline)
+    {
+        if (ApicTimerMode != APIC_TIMER_MODE_ONESHOT)
+        {
+            ApicWriteRegister(APIC_REG_LVT_TIMER, INTXX_APIC_TIMER | APIC_TIMER_LVT_TSC_DEADLINE);
+            asm volatile("mfence": : :"memory"); // LVT write must be visible before arming the deadline
+        }
+
+        // A deadline of 0 disarms the timer, a deadline in the past fires immediately
+        wrmsr(IA32_TSC_DEADLINE_MSR, tscDeadline != 0 ? tscDeadline : 1);
+    }
+    else
+    {
+        // Convert to APIC timer ticks. Cap the delay at one second so the conversion can't overflow,
+        // the scheduler just re-arms the timer if it wakes up early.
+        uint64_t now = rdtsc();
+        uint64_t delta = tscDeadline > now ? tscDeadline - now : 0;
+        if (delta > TscFrequency)
+            delta = TscFrequency;
+        uint64_t count = delta * ApicFrequency / TscFrequency;
+        if (count == 0)
+            count = 1;
+
+        ApicWriteRegister(APIC_REG_LVT_TIMER, INTXX_APIC_TIMER | APIC_TIMER_LVT_ONESHOT);
+        ApicWriteRegister(APIC_REG_TIMER_INIT, (uint32_t)count);
+    }
+    ApicTimerMode = APIC_TIMER_MODE_ONESHOT;
+}
+
+void ApicTimerStop()
+{
+    if (ApicTimerMode == APIC_TIMER_MODE_STOPPED)
+        return;
+    if (ApicTimerMode == APIC_TIMER_MODE_ONESHOT && ApicHasTscDeadline)
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    else
+        ApicWriteRegister(APIC_REG_TIMER_INIT, 0);
+    ApicTimerMode = APIC_TIMER_MODE_STOPPED;
 }
 
 void ApicSetTPR(uint8_t tpr)
@@ -118,6 +200,11 @@ uint8_t ApicGetTPR()
     return (uint8_t)ApicReadRegister(APIC_REG_TPR);
 }
 
+uint8_t ApicGetId()
+{
+    return (uint8_t)(ApicReadRegister(APIC_REG_ID) >> 24);
+}
+
 void ApicSendEOI(uint8_t interrupt)
 {
     ApicWriteRegister(APIC_REG_EOI, 0);
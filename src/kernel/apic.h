@@ -7,8 +7,16 @@
 extern uint32_t ApicFrequency;
 
 bool ApicInitialize();
+bool ApicIsAvailable();
 void ApicSetTPR(uint8_t tpr);
 uint8_t ApicGetTPR();
+uint8_t ApicGetId();
 void ApicSendEOI(uint8_t interrupt);
 
+void ApicTimerStartPeriodic(uint32_t frequency);
+void ApicTimerStartOneShot(uint64_t tscDeadline);
+void ApicTimerStop();
+void ApicTimerStartCount();
+uint32_t ApicTimerReadCount();
+
 #endif
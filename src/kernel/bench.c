@@ -0,0 +1,381 @@
+#include "tsc.h"
+#include "bench.h"
+#include "debug.h"
+#include "bitmap.h"
+#include "memory.h"
+#include "minheap.h"
+#include "lowlevel.h"
+#include "textmode.h"
+#include "interrupts.h"
+
+// --------------------------------------------------------------------------------
+// In-kernel micro benchmarks. These are run from kmain when the kernel is built
+// with KERNEL_BENCHMARKS defined, and print their results in TSC cycles.
+// --------------------------------------------------------------------------------
+
+static uint32_t BenchRandomState = 0x12345678;
+
+static uint32_t BenchRandom()
+{
+    BenchRandomState = BenchRandomState * 1103515245 + 12345;
+    return BenchRandomState >> 8;
+}
+
+static void BenchSleepQueue()
+{
+    static const size_t sizes[] = {16, 128, 1024, 4096};
+    const size_t rounds = 1000;
+
+    TmPrintf("Sleep queue: cycles per tick (insert + expire one sleeper) by number of sleepers\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t count = sizes[s];
+        MinHeap heap;
+        MinHeapInitialize(&heap);
+        MinHeapEntry* entries = kalloc(sizeof(MinHeapEntry) * (count + 1));
+
+        // Populate with sleepers far in the future (ticks 1000...)
+        for (size_t i = 0; i < count; i++)
+        {
+            MinHeapEntryInitialize(&entries[i]);
+            MinHeapInsert(&heap, &entries[i], 1000 + BenchRandom() % 100000);
+        }
+
+        // Each simulated tick puts one short sleeper to sleep and wakes it
+        MinHeapEntry* sleeper = &entries[count];
+        MinHeapEntryInitialize(sleeper);
+        uint32_t irqLock = IntEnterCriticalSection();
+        uint64_t beg = rdtsc();
+        for (size_t tick = 0; tick < rounds; tick++)
+        {
+            MinHeapInsert(&heap, sleeper, tick % 1000);
+            MinHeapEntry* first;
+            while ((first = MinHeapPeek(&heap)) != NULL && first->Key <= tick % 1000)
+                MinHeapPop(&heap);
+        }
+        uint64_t end = rdtsc();
+        IntLeaveCriticalSection(irqLock);
+
+        TmPrintf("  %5u sleepers: %6llu cycles/tick\n", count, (end - beg) / rounds);
+
+        kfree(heap.Entries);
+        kfree(entries);
+    }
+}
+
+// The bit-at-a-time bitmap engine that was replaced, kept here as the baseline
+static void BenchBitmapLegacySetBits(Bitmap* bmp, size_t offset, size_t length, bool val)
+{
+    for (size_t bit = offset; bit < offset + length; bit++)
+        BitmapSetBit(bmp, bit, val);
+}
+
+static size_t BenchBitmapLegacyFindFirstRegion(Bitmap* bmp, size_t offset, size_t length, bool val)
+{
+    size_t bit = offset;
+    size_t end = bmp->Size;
+    size_t lim = end - length + 1;
+    while (bit < lim)
+    {
+        if (BitmapGetBit(bmp, bit++) == val)
+        {
+            size_t len = 1;
+            while (len < length && bit < end && BitmapGetBit(bmp, bit++) == val)
+                len++;
+            if (len == length)
+                return bit - len;
+            bit--;
+        }
+    }
+    return BITMAP_INVALID_OFFSET;
+}
+
+static size_t BenchBitmapLegacyCountSetBits(Bitmap* bmp)
+{
+    size_t result = 0;
+    for (size_t bit = 0; bit < bmp->Size; bit++)
+        if (BitmapGetBit(bmp, bit))
+            result++;
+    return result;
+}
+
+#define BENCH_PHYS_SLOTS 64
+#define BENCH_PHYS_OPS   4096
+#define BENCH_PHYS_PAGES 32768
+
+static size_t BenchPhysSize(uint32_t random)
+{
+    // Mostly single pages (page tables, DMA headers), some stacks and queues of odd sizes
+    switch (random % 8)
+    {
+    case 0: return 1 + random % 64;
+    case 1: case 2: return 1 + random % 8;
+    default: return 1;
+    }
+}
+
+static size_t BenchBitmapLongestRun(Bitmap* bmp)
+{
+    size_t longest = 0;
+    size_t run = 0;
+    for (size_t bit = 0; bit < bmp->Size; bit++)
+    {
+        run = BitmapGetBit(bmp, bit) ? run + 1 : 0;
+        if (run > longest)
+            longest = run;
+    }
+    return longest;
+}
+
+static void BenchPhysAlloc()
+{
+    // The same random alloc/free sequence is run against the buddy allocator and against a scratch bitmap using the
+    // bit-at-a-time first-fit search PhysAlloc used before. Both run with interrupts disabled. The bitmap numbers
+    // don't include the region list updates it also did.
+    kphys_t* slots = kcalloc(sizeof(kphys_t) * BENCH_PHYS_SLOTS);
+    size_t* sizes = kcalloc(sizeof(size_t) * BENCH_PHYS_SLOTS);
+    Bitmap* bmp = kalloc(BitmapCalcSize(BENCH_PHYS_PAGES));
+    BitmapInitialize(bmp, BENCH_PHYS_PAGES);
+    BitmapSetBits(bmp, 0, BENCH_PHYS_PAGES, true);
+
+    TmPrintf("Physical page allocator: %u random alloc/free operations, up to %u live allocations\n", BENCH_PHYS_OPS, BENCH_PHYS_SLOTS);
+
+    BenchRandomState = 0x12345678;
+    uint32_t irqLock = IntEnterCriticalSection();
+    uint64_t beg = rdtsc();
+    for (size_t op = 0; op < BENCH_PHYS_OPS; op++)
+    {
+        uint32_t random = BenchRandom();
+        size_t slot = random % BENCH_PHYS_SLOTS;
+        if (slots[slot] != 0)
+        {
+            PhysFree(slots[slot]);
+            slots[slot] = 0;
+        }
+        else
+            slots[slot] = PhysAlloc(BenchPhysSize(random >> 6), PHYS_REGION_TYPE_KERNEL_HEAP, "bench");
+    }
+    uint64_t end = rdtsc();
+    IntLeaveCriticalSection(irqLock);
+
+    PhysStats stats;
+    PhysGetStats(&stats);
+    size_t largest = 0;
+    for (size_t order = 0; order < PHYS_BUDDY_ORDERS; order++)
+        if (stats.FreeBlocks[order] != 0)
+            largest = (size_t)1 << order;
+    TmPrintf("  buddy:  %6llu cycles/op, largest free block %u of %u free pages\n", (end - beg) / BENCH_PHYS_OPS, largest, stats.FreePages);
+
+    for (size_t slot = 0; slot < BENCH_PHYS_SLOTS; slot++)
+        if (slots[slot] != 0)
+            PhysFree(slots[slot]);
+
+    BenchRandomState = 0x12345678;
+    irqLock = IntEnterCriticalSection();
+    beg = rdtsc();
+    for (size_t op = 0; op < BENCH_PHYS_OPS; op++)
+    {
+        uint32_t random = BenchRandom();
+        size_t slot = random % BENCH_PHYS_SLOTS;
+        if (sizes[slot] != 0)
+        {
+            BenchBitmapLegacySetBits(bmp, slots[slot], sizes[slot], true);
+            sizes[slot] = 0;
+        }
+        else
+        {
+            size_t size = BenchPhysSize(random >> 6);
+            size_t off = BenchBitmapLegacyFindFirstRegion(bmp, 0, size, true);
+            DbgAssert(off != BITMAP_INVALID_OFFSET);
+            BenchBitmapLegacySetBits(bmp, off, size, false);
+            slots[slot] = off;
+            sizes[slot] = size;
+        }
+    }
+    end = rdtsc();
+    IntLeaveCriticalSection(irqLock);
+
+    TmPrintf("  bitmap: %6llu cycles/op, largest free run %u of %u free pages\n", (end - beg) / BENCH_PHYS_OPS,
+             BenchBitmapLongestRun(bmp), BitmapCountSetBits(bmp));
+
+    kfree(bmp);
+    kfree(sizes);
+    kfree(slots);
+}
+
+static void BenchBitmap()
+{
+    // A page bitmap covering 4 GiB. Free memory is fragmented by a used page every 64 pages, except for a single
+    // unfragmented 16 MiB run near the top that the region search has to find.
+    const size_t bits = 1024 * 1024;
+    const size_t heapPages = 4096;
+    const size_t heapOffset = bits - 2 * heapPages;
+    Bitmap* bmp = kalloc(BitmapCalcSize(bits));
+    BitmapInitialize(bmp, bits);
+    uint64_t legacy, fast, beg;
+    size_t legacyResult, fastResult;
+
+    TmPrintf("Bitmap: cycles on a 4 GiB page bitmap, legacy bit-at-a-time vs. word-at-a-time\n");
+
+    uint32_t irqLock = IntEnterCriticalSection();
+    beg = rdtsc();
+    BenchBitmapLegacySetBits(bmp, 0, bits, true);
+    legacy = rdtsc() - beg;
+    beg = rdtsc();
+    BitmapSetBits(bmp, 0, bits, true);
+    fast = rdtsc() - beg;
+    TmPrintf("  set 4 GiB:         %10llu / %10llu\n", legacy, fast);
+
+    for (size_t bit = 0; bit < bits; bit += 64)
+        BitmapSetBit(bmp, bit, false);
+    BitmapSetBits(bmp, heapOffset, heapPages, true);
+    BitmapSetBit(bmp, heapOffset - 1, false);
+
+    beg = rdtsc();
+    BenchBitmapLegacySetBits(bmp, heapOffset, heapPages, false);
+    BenchBitmapLegacySetBits(bmp, heapOffset, heapPages, true);
+    legacy = rdtsc() - beg;
+    beg = rdtsc();
+    BitmapSetBits(bmp, heapOffset, heapPages, false);
+    BitmapSetBits(bmp, heapOffset, heapPages, true);
+    fast = rdtsc() - beg;
+    TmPrintf("  mark 16 MiB twice: %10llu / %10llu\n", legacy, fast);
+
+    beg = rdtsc();
+    legacyResult = BenchBitmapLegacyFindFirstRegion(bmp, 0, heapPages, true);
+    legacy = rdtsc() - beg;
+    beg = rdtsc();
+    fastResult = BitmapFindFirstRegion(bmp, 0, heapPages, true);
+    fast = rdtsc() - beg;
+    DbgAssert(legacyResult == fastResult && fastResult == heapOffset);
+    TmPrintf("  find 16 MiB run:   %10llu / %10llu\n", legacy, fast);
+
+    beg = rdtsc();
+    legacyResult = BenchBitmapLegacyCountSetBits(bmp);
+    legacy = rdtsc() - beg;
+    beg = rdtsc();
+    fastResult = BitmapCountSetBits(bmp);
+    fast = rdtsc() - beg;
+    DbgAssert(legacyResult == fastResult);
+    TmPrintf("  count set bits:    %10llu / %10llu\n", legacy, fast);
+    IntLeaveCriticalSection(irqLock);
+
+    kfree(bmp);
+}
+
+static void BenchPhysSinglePage()
+{
+    // Single page alloc/free pairs are served from the per-CPU page cache, bursts larger than the cache go through
+    // its refill and drain paths
+    const size_t rounds = 1024;
+    const size_t burst = 256;
+    kphys_t* pages = kalloc(sizeof(kphys_t) * burst);
+
+    TmPrintf("Physical single pages: cycles per alloc + free\n");
+
+    uint64_t beg = rdtsc();
+    for (size_t i = 0; i < rounds; i++)
+        PhysFree(PhysAlloc(1, PHYS_REGION_TYPE_KERNEL_HEAP, "bench"));
+    uint64_t end = rdtsc();
+    TmPrintf("  steady state:     %6llu\n", (end - beg) / rounds);
+
+    beg = rdtsc();
+    for (size_t i = 0; i < burst; i++)
+        pages[i] = PhysAlloc(1, PHYS_REGION_TYPE_KERNEL_HEAP, "bench");
+    for (size_t i = 0; i < burst; i++)
+        PhysFree(pages[i]);
+    end = rdtsc();
+    TmPrintf("  burst of %3u:     %6llu\n", burst, (end - beg) / burst);
+
+    kfree(pages);
+}
+
+static void BenchVirtAlloc()
+{
+    // Fragment the kernel address space with one-page holes, then allocate two pages at a time so that every
+    // request has to skip all the holes
+    const size_t regions = 1024;
+    const size_t rounds = 256;
+    void** virts = kalloc(sizeof(void*) * regions);
+
+    for (size_t i = 0; i < regions; i++)
+        virts[i] = VirtAlloc(0, 1, VIRT_PROT_READONLY, VIRT_REGION_TYPE_SCRATCH, "bench");
+    for (size_t i = 0; i < regions; i += 2)
+        VirtFree(virts[i]);
+
+    TmPrintf("Virtual regions: cycles per alloc + free with %u holes\n", regions / 2);
+
+    uint64_t beg = rdtsc();
+    for (size_t i = 0; i < rounds; i++)
+        VirtFree(VirtAlloc(0, 2, VIRT_PROT_READONLY, VIRT_REGION_TYPE_SCRATCH, "bench"));
+    uint64_t end = rdtsc();
+    TmPrintf("  two pages:        %6llu\n", (end - beg) / rounds);
+
+    // 1 MiB, the size of a large stack, is above the TLB flush threshold
+    beg = rdtsc();
+    for (size_t i = 0; i < rounds; i++)
+        VirtFree(VirtAlloc(0, 256, VIRT_PROT_READONLY, VIRT_REGION_TYPE_SCRATCH, "bench"));
+    end = rdtsc();
+    TmPrintf("  256 pages:        %6llu\n", (end - beg) / rounds);
+
+    for (size_t i = 1; i < regions; i += 2)
+        VirtFree(virts[i]);
+    kfree(virts);
+}
+
+#define BENCH_CR4_PGE (1 << 7)
+
+static uint64_t BenchVirtSpaceSwitchRun(VirtSpace** spaces, volatile uint8_t* kernel, size_t pages, size_t rounds)
+{
+    uint64_t beg = rdtsc();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        VirtSpaceActivate(spaces[i & 1]);
+        for (size_t page = 0; page < pages; page++)
+            (void)kernel[page * KPAGE_SIZE];
+    }
+    uint64_t end = rdtsc();
+    VirtSpaceActivate(NULL);
+    return (end - beg) / rounds;
+}
+
+static void BenchVirtSpaceSwitch()
+{
+    // Switch back and forth between two address spaces and touch a few kernel pages after each switch. Without
+    // global pages every switch also throws away the kernel's TLB entries, which then have to be walked again.
+    const size_t rounds = 1024;
+    const size_t pages = 64;
+    VirtSpace* spaces[2] = { VirtSpaceCreate(), VirtSpaceCreate() };
+    kphys_t phys = PhysAlloc(pages, PHYS_REGION_TYPE_KERNEL_HEAP, "bench");
+    volatile uint8_t* kernel = VirtAlloc(phys, pages, VIRT_PROT_READONLY, VIRT_REGION_TYPE_SCRATCH, "bench");
+
+    TmPrintf("Address space switch: cycles per switch + %u kernel page touches\n", pages);
+
+    uint32_t cr4 = rdcr4();
+    if (cr4 & BENCH_CR4_PGE)
+    {
+        TmPrintf("  global pages:     %6llu\n", BenchVirtSpaceSwitchRun(spaces, kernel, pages, rounds));
+        wrcr4(cr4 & ~BENCH_CR4_PGE);
+        TmPrintf("  no global pages:  %6llu\n", BenchVirtSpaceSwitchRun(spaces, kernel, pages, rounds));
+        wrcr4(cr4);
+    }
+    else
+    {
+        TmPrintf("  no global pages:  %6llu\n", BenchVirtSpaceSwitchRun(spaces, kernel, pages, rounds));
+    }
+
+    VirtFree((void*)kernel);
+    PhysFree(phys);
+    VirtSpaceDestroy(spaces[0]);
+    VirtSpaceDestroy(spaces[1]);
+}
+
+void BenchRunAll()
+{
+    BenchSleepQueue();
+    BenchBitmap();
+    BenchPhysAlloc();
+    BenchPhysSinglePage();
+    BenchVirtAlloc();
+    BenchVirtSpaceSwitch();
+}
@@ -0,0 +1,6 @@
+#ifndef KERNEL_BENCH_H
+#define KERNEL_BENCH_H
+
+void BenchRunAll();
+
+#endif
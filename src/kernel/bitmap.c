@@ -1,6 +1,7 @@
 #include <string.h>
 #include "debug.h"
 #include "bitmap.h"
+#include "lowlevel.h"
 #include "textmode.h"
 
 size_t BitmapCalcSize(size_t bits)
@@ -30,12 +31,34 @@ void BitmapDebugDump(Bitmap* bmp)
 	TmPrintf("|\n\n");
 }
 
+static inline size_t BitmapWordCount(Bitmap* bmp)
+{
+	return (bmp->Size + (BITMAP_WORD_BITS - 1)) / BITMAP_WORD_BITS;
+}
+
+static inline BITMAP_WORD_TYPE BitmapPopCount(BITMAP_WORD_TYPE word)
+{
+	// SWAR popcount, the kernel doesn't assume the popcnt instruction is available
+	word = word - ((word >> 1) & 0x55555555);
+	word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+	word = (word + (word >> 4)) & 0x0F0F0F0F;
+	return (word * 0x01010101) >> 24;
+}
+
+static inline void BitmapApplyMask(Bitmap* bmp, size_t idx, BITMAP_WORD_TYPE mask, bool val)
+{
+	if (val)
+		bmp->Words[idx] |= mask;
+	else
+		bmp->Words[idx] &= ~mask;
+}
+
 bool BitmapGetBit(Bitmap* bmp, size_t offset)
 {
 	DbgAssert(offset < bmp->Size);
 	size_t idx = offset / BITMAP_WORD_BITS;
 	size_t bit = offset % BITMAP_WORD_BITS;
-	return bmp->Words[idx] & (1 << bit);
+	return bmp->Words[idx] & ((BITMAP_WORD_TYPE)1 << bit);
 }
 
 void BitmapSetBit(Bitmap* bmp, size_t offset, bool val)
@@ -43,10 +66,7 @@ void BitmapSetBit(Bitmap* bmp, size_t offset, bool val)
 	DbgAssert(offset < bmp->Size);
 	size_t idx = offset / BITMAP_WORD_BITS;
 	size_t bit = offset % BITMAP_WORD_BITS;
-	if (val)
-		bmp->Words[idx] |= (1 << bit);
-	else
-		bmp->Words[idx] &= ~(1 << bit);
+	BitmapApplyMask(bmp, idx, (BITMAP_WORD_TYPE)1 << bit, val);
 }
 
 void BitmapSetBits(Bitmap* bmp, size_t offset, size_t length, bool val)
@@ -54,75 +74,92 @@ void BitmapSetBits(Bitmap* bmp, size_t offset, size_t length, bool val)
 	size_t end = offset + length;
 	DbgAssert(offset < bmp->Size);
 	DbgAssert(end <= bmp->Size);
-	for (size_t bit = offset; bit < end; bit++)
-		BitmapSetBit(bmp, bit, val);
+	if (length == 0)
+		return;
+
+	// Partial first and last words are masked, the words in between are stored whole
+	size_t idx = offset / BITMAP_WORD_BITS;
+	size_t last = (end - 1) / BITMAP_WORD_BITS;
+	BITMAP_WORD_TYPE head = BITMAP_WORD_ALL_SET << (offset % BITMAP_WORD_BITS);
+	BITMAP_WORD_TYPE tail = BITMAP_WORD_ALL_SET >> (BITMAP_WORD_BITS - 1 - (end - 1) % BITMAP_WORD_BITS);
+	if (idx == last)
+	{
+		BitmapApplyMask(bmp, idx, head & tail, val);
+		return;
+	}
+
+	BitmapApplyMask(bmp, idx, head, val);
+	BITMAP_WORD_TYPE fill = val ? BITMAP_WORD_ALL_SET : 0;
+	for (idx++; idx < last; idx++)
+		bmp->Words[idx] = fill;
+	BitmapApplyMask(bmp, last, tail, val);
 }
 
 size_t BitmapFindFirstBit(Bitmap* bmp, size_t offset, bool val)
 {
 	DbgAssert(offset < bmp->Size);
-	size_t end = bmp->Size;
-	for (size_t bit = offset; bit < end; bit++)
-		if (BitmapGetBit(bmp, bit) == val)
-			return bit;
-	return BITMAP_INVALID_OFFSET;
+
+	// Searching for a clear bit is searching for a set bit in the inverted word, whole words without a match are
+	// skipped with a single compare
+	BITMAP_WORD_TYPE invert = val ? 0 : BITMAP_WORD_ALL_SET;
+	size_t words = BitmapWordCount(bmp);
+	size_t idx = offset / BITMAP_WORD_BITS;
+	BITMAP_WORD_TYPE word = (bmp->Words[idx] ^ invert) & (BITMAP_WORD_ALL_SET << (offset % BITMAP_WORD_BITS));
+	while (word == 0)
+	{
+		if (++idx >= words)
+			return BITMAP_INVALID_OFFSET;
+		word = bmp->Words[idx] ^ invert;
+	}
+
+	size_t bit = idx * BITMAP_WORD_BITS + bsf(word);
+	return bit < bmp->Size ? bit : BITMAP_INVALID_OFFSET;
 }
 
 size_t BitmapFindFirstRegion(Bitmap* bmp, size_t offset, size_t length, bool val)
 {
 	DbgAssert(offset < bmp->Size);
 	DbgAssert(length > 0);
+
+	// Jump from the start of one run of matching bits to the next, the end of each run is found word-wise as well
 	size_t bit = offset;
-	size_t end = bmp->Size;
-	size_t lim = end - length + 1;
-	while (bit < lim)
+	while (true)
 	{
-		if (BitmapGetBit(bmp, bit++) == val)
-		{
-			size_t len = 1;
-			while (len < length && bit < end && BitmapGetBit(bmp, bit++) == val)
-				len++;
-			if (len == length)
-				return bit - len;
-			bit--;
-		}
+		size_t beg = BitmapFindFirstBit(bmp, bit, val);
+		if (beg == BITMAP_INVALID_OFFSET || bmp->Size - beg < length)
+			return BITMAP_INVALID_OFFSET;
+		size_t end = BitmapFindFirstBit(bmp, beg, !val);
+		if (end == BITMAP_INVALID_OFFSET)
+			end = bmp->Size;
+		if (end - beg >= length)
+			return beg;
+		if (end >= bmp->Size)
+			return BITMAP_INVALID_OFFSET;
+		bit = end;
 	}
-	return BITMAP_INVALID_OFFSET;
 }
 
 size_t BitmapCountSetBits(Bitmap* bmp)
 {
 	if (bmp->Size == 0)
 		return 0;
-	
-	size_t result = 0;
-	size_t words = (bmp->Size + (BITMAP_WORD_BITS - 1)) / BITMAP_WORD_BITS;
 
-	for (size_t idx = 0; idx < words - 1; idx++)
+	size_t result = 0;
+	size_t full = bmp->Size / BITMAP_WORD_BITS;
+	for (size_t idx = 0; idx < full; idx++)
 	{
 		BITMAP_WORD_TYPE word = bmp->Words[idx];
 		if (word == 0)
 			continue;
-
 		if (word == BITMAP_WORD_ALL_SET)
-		{
 			result += BITMAP_WORD_BITS;
-			continue;
-		}
-
-		for (size_t off = 0; off < BITMAP_WORD_BITS; off++)
-			if (word & (1 << off))
-				result++;
+		else
+			result += BitmapPopCount(word);
 	}
 
 	size_t rest = bmp->Size % BITMAP_WORD_BITS;
 	if (rest != 0)
-	{
-		BITMAP_WORD_TYPE word = bmp->Words[words - 1];
-		for (size_t off = 0; off < rest; off++)
-			if (word & (1 << off))
-				result++;
-	}
+		result += BitmapPopCount(bmp->Words[full] & (BITMAP_WORD_ALL_SET >> (BITMAP_WORD_BITS - rest)));
 
 	return result;
 }
@@ -0,0 +1,135 @@
+#include "tsc.h"
+#include "hpet.h"
+#include "clock.h"
+#include "debug.h"
+#include "textmode.h"
+#include "interrupts.h"
+
+// --------------------------------------------------------------------------------
+// Monotonic nanosecond clock. Counter values are converted with a fixed point
+// multiplier, ns = base + (count * mult) >> shift, so reads never divide. The
+// counter is the TSC, or the HPET if the TSC isn't invariant. The state is
+// published with a sequence counter so readers (including interrupt handlers)
+// always see a consistent snapshot of the 64-bit fields, and the source can be
+// switched or recalibrated without the clock jumping.
+// --------------------------------------------------------------------------------
+
+typedef struct ClockState_s
+{
+    ClockReadFn* read;
+    uint64_t baseCount;
+    uint64_t baseNs;
+    uint32_t mult;
+    uint32_t shift;
+    uint32_t tscMult; // for ClockCyclesToNs, even if the TSC isn't the clock source
+    uint32_t tscShift;
+} ClockState;
+
+static volatile uint32_t ClockSequence = 0;
+static ClockState ClockCurrent = {0};
+
+static uint64_t ClockReadTsc()
+{
+    return rdtsc();
+}
+
+static inline uint64_t ClockScale(uint64_t count, uint32_t mult, uint32_t shift)
+{
+    // 64x32 bit multiply with a 96-bit intermediate, shift <= 32
+    uint64_t hi = (count >> 32) * mult;
+    uint64_t lo = (count & 0xFFFFFFFF) * mult;
+    return (hi << (32 - shift)) + (lo >> shift);
+}
+
+static void ClockComputeScale(uint64_t frequency, uint32_t* mult, uint32_t* shift)
+{
+    // Pick the largest shift (= most precision) for which the multiplier still fits in 32 bits
+    uint32_t s = 32;
+    uint64_t m = (1000000000ull << s) / frequency;
+    while (m > UINT32_MAX)
+    {
+        s--;
+        m = (1000000000ull << s) / frequency;
+    }
+    *mult = (uint32_t)m;
+    *shift = s;
+}
+
+static void ClockReadState(ClockState* state, uint64_t* count)
+{
+    uint32_t sequence;
+    do
+    {
+        sequence = ClockSequence;
+        asm volatile("": : :"memory");
+        *state = ClockCurrent;
+        if (count)
+            *count = state->read ? state->read() : 0;
+        asm volatile("": : :"memory");
+    } while ((sequence & 1) != 0 || sequence != ClockSequence);
+}
+
+static void ClockUpdate(const ClockState* update)
+{
+    // Rebase at the current time so the clock stays continuous
+    uint32_t irqLock = IntEnterCriticalSection();
+    uint64_t nowNs = 0;
+    if (ClockCurrent.read)
+        nowNs = ClockCurrent.baseNs + ClockScale(ClockCurrent.read() - ClockCurrent.baseCount, ClockCurrent.mult, ClockCurrent.shift);
+    ClockSequence++;
+    asm volatile("": : :"memory");
+    ClockCurrent = *update;
+    ClockCurrent.baseCount = update->read();
+    ClockCurrent.baseNs = nowNs;
+    asm volatile("": : :"memory");
+    ClockSequence++;
+    IntLeaveCriticalSection(irqLock);
+}
+
+void ClockInitialize()
+{
+    DbgAssert(TscFrequency != 0);
+    ClockSetTscFrequency(TscFrequency);
+
+    // A 32-bit HPET counter wraps in minutes, so only switch if it is 64 bits wide
+    if (!TscIsInvariant && HpetIsAvailable() && HpetCounterMask == UINT64_MAX)
+        ClockSetSource("HPET", HpetReadCounter, HpetFrequency);
+}
+
+void ClockSetSource(const char* name, ClockReadFn* read, uint64_t frequency)
+{
+    ClockState update = ClockCurrent;
+    update.read = read;
+    ClockComputeScale(frequency, &update.mult, &update.shift);
+    ClockUpdate(&update);
+    TmPrintfVrb("Clock source: %s, %llu Hz, mult=%u shift=%u\n", name, frequency, update.mult, update.shift);
+}
+
+void ClockSetTscFrequency(uint64_t tscFrequency)
+{
+    ClockState update = ClockCurrent;
+    ClockComputeScale(tscFrequency, &update.tscMult, &update.tscShift);
+    if (update.read == NULL || update.read == ClockReadTsc)
+    {
+        update.read = ClockReadTsc;
+        update.mult = update.tscMult;
+        update.shift = update.tscShift;
+        TmPrintfVrb("Clock source: TSC, %llu Hz, mult=%u shift=%u\n", tscFrequency, update.mult, update.shift);
+    }
+    ClockUpdate(&update);
+}
+
+uint64_t ClockGetNs()
+{
+    ClockState state;
+    uint64_t count;
+    ClockReadState(&state, &count);
+    return state.baseNs + ClockScale(count - state.baseCount, state.mult, state.shift);
+}
+
+uint64_t ClockCyclesToNs(uint64_t cycles)
+{
+    ClockState state;
+    ClockReadState(&state, NULL);
+    return ClockScale(cycles, state.tscMult, state.tscShift);
+}
@@ -0,0 +1,14 @@
+#ifndef KERNEL_CLOCK_H
+#define KERNEL_CLOCK_H
+
+#include <stdint.h>
+
+typedef uint64_t ClockReadFn();
+
+void ClockInitialize();
+void ClockSetSource(const char* name, ClockReadFn* read, uint64_t frequency);
+void ClockSetTscFrequency(uint64_t tscFrequency);
+uint64_t ClockGetNs();
+uint64_t ClockCyclesToNs(uint64_t cycles);
+
+#endif
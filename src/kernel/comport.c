@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdarg.h>
 #include "comport.h"
 #include "lowlevel.h"
 
@@ -47,3 +49,19 @@ void ComWrite(uint8_t b)
         ;
     outb(COM1_PORT_DATA, b);
 }
+
+void ComWriteString(const char* str)
+{
+    while (*str)
+        ComWrite((uint8_t)*str++);
+}
+
+void ComPrintf(const char* fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    ComWriteString(buf);
+}
@@ -6,5 +6,7 @@
 void ComInitialize();
 uint8_t ComRead();
 void ComWrite(uint8_t b);
+void ComWriteString(const char* str);
+void ComPrintf(const char* fmt, ...);
 
 #endif
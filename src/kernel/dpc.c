@@ -0,0 +1,113 @@
+#include "dpc.h"
+#include "irql.h"
+#include "debug.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "interrupts.h"
+
+static ListHead DpcQueues[DPC_PRIORITY_COUNT];
+static SchEvent* DpcEvent = NULL;
+
+static uint32_t DpcTask(void* ctx)
+{
+    // Picks up whatever an interrupt exit left behind after using up its budget
+    while (true)
+    {
+        SchEventWait(DpcEvent);
+        SchEventReset(DpcEvent);
+
+        irql_t irql = IrqlRaise(IRQL_SCHEDULER);
+        uint32_t irqLock = IntEnterCriticalSection();
+        DpcDrain(true);
+        IntLeaveCriticalSection(irqLock);
+        IrqlLower(irql);
+        SchYield();
+    }
+    return 0;
+}
+
+void DpcInitialize()
+{
+    for (uint32_t i = 0; i < DPC_PRIORITY_COUNT; i++)
+        ListInitialize(&DpcQueues[i]);
+    DpcEvent = SchCreateEvent();
+    SchTask* task = SchCreateTask("kdpc", 0, DpcTask, NULL);
+    SchSetPriority(task, SCH_PRIORITY_HIGH);
+}
+
+Dpc* DpcCreate(DpcFn* callback, void* ctx, uint32_t priority)
+{
+    DbgAssert(callback != NULL);
+    DbgAssert(priority < DPC_PRIORITY_COUNT);
+    Dpc* dpc = kalloc(sizeof(Dpc));
+    dpc->callback = callback;
+    dpc->ctx = ctx;
+    dpc->priority = priority;
+    dpc->queued = false;
+    return dpc;
+}
+
+void DpcDestroy(Dpc* dpc)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    if (dpc->queued)
+        ListRemove(&dpc->list);
+    IntLeaveCriticalSection(irqLock);
+    kfree(dpc);
+}
+
+bool DpcQueue(Dpc* dpc)
+{
+    // Queueing an already queued DPC is a no-op, so a burst of interrupts is handled by a single run
+    uint32_t irqLock = IntEnterCriticalSection();
+    if (dpc->queued)
+    {
+        IntLeaveCriticalSection(irqLock);
+        return false;
+    }
+    dpc->queued = true;
+    ListPushBack(&DpcQueues[dpc->priority], &dpc->list);
+    IntLeaveCriticalSection(irqLock);
+
+    IrqlRequestSoftware(IRQL_SCHEDULER);
+    return true;
+}
+
+static Dpc* DpcPop()
+{
+    for (uint32_t i = 0; i < DPC_PRIORITY_COUNT; i++)
+    {
+        if (!ListIsEmpty(&DpcQueues[i]))
+            return CONTAINING_RECORD(ListPopFront(&DpcQueues[i]), Dpc, list);
+    }
+    return NULL;
+}
+
+void DpcDrain(bool interruptible)
+{
+    // Called at IRQL_SCHEDULER with IF=0. Interrupts are enabled around each callback unless the caller
+    // must keep them disabled.
+    DbgAssert(IrqlGetCurrent() == IRQL_SCHEDULER);
+    DbgAssert(!IntAreIRQsEnabled());
+    for (uint32_t budget = DPC_DRAIN_BUDGET; budget != 0; budget--)
+    {
+        Dpc* dpc = DpcPop();
+        if (dpc == NULL)
+            return;
+        dpc->queued = false;
+        if (interruptible)
+            IntEnableIRQs();
+        dpc->callback(dpc, dpc->ctx);
+        if (interruptible)
+            IntDisableIRQs();
+    }
+
+    for (uint32_t i = 0; i < DPC_PRIORITY_COUNT; i++)
+    {
+        if (!ListIsEmpty(&DpcQueues[i]))
+        {
+            SchEventSignal(DpcEvent);
+            break;
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef KERNEL_DPC_H
+#define KERNEL_DPC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "list.h"
+
+#define DPC_PRIORITY_HIGH   0
+#define DPC_PRIORITY_NORMAL 1
+#define DPC_PRIORITY_LOW    2
+#define DPC_PRIORITY_COUNT  3
+
+#define DPC_DRAIN_BUDGET    16 // DPCs run per drain before the rest is left to the kdpc task
+
+typedef struct Dpc_s Dpc;
+
+// DPC callbacks run at IRQL_SCHEDULER, either on interrupt exit or in the kdpc task. Device interrupts stay
+// enabled but they must not block or yield.
+typedef void DpcFn(Dpc* dpc, void* ctx);
+
+typedef struct Dpc_s
+{
+    ListEntry list;
+    DpcFn* callback;
+    void* ctx;
+    uint32_t priority;
+    bool queued;
+} Dpc;
+
+void DpcInitialize();
+Dpc* DpcCreate(DpcFn* callback, void* ctx, uint32_t priority);
+void DpcDestroy(Dpc* dpc);
+bool DpcQueue(Dpc* dpc);
+void DpcDrain(bool interruptible);
+
+#endif
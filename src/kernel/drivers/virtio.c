@@ -43,7 +43,7 @@ bool DrvVirtioCreate(DrvVirtio* drv, const PciDeviceInfo* pciInfo)
     {
         uint8_t cap_vndr = PciReadByte(bus, device, function, cap_ptr+VIRTIO_PCI_CAP_VNDR);
         uint8_t cap_next = PciReadByte(bus, device, function, cap_ptr+VIRTIO_PCI_CAP_NEXT);
-        if (cap_vndr == 0x09)
+        if (cap_vndr == PCI_CAP_ID_VNDR)
         {
             uint8_t cfg_type = PciReadByte(bus, device, function, cap_ptr+VIRTIO_PCI_CAP_CFG_TYPE);
             uint8_t bar      = PciReadByte(bus, device, function, cap_ptr+VIRTIO_PCI_CAP_BAR);
@@ -83,10 +83,68 @@ bool DrvVirtioCreate(DrvVirtio* drv, const PciDeviceInfo* pciInfo)
 
 static void DrvVirtio_HandleISR(void* ctx)
 {
+    // The line may be shared, the ISR status tells whether this device raised it and has to be read to deassert it
     DrvVirtio* drv = (DrvVirtio*)ctx;
-    DrvVirtioReadISR(drv);
-    if (drv->InterruptFn)
-        drv->InterruptFn(drv);
+    uint8_t isr = DrvVirtioReadISR(drv);
+    if ((isr & VIRTIO_PCI_ISR_QUEUE) == 0 || !drv->InterruptFn)
+        return;
+    for (uint32_t i = 0; i < drv->NumQueues; i++)
+        drv->InterruptFn(drv, i);
+}
+
+static void DrvVirtio_HandleQueueMsiX(void* ctx)
+{
+    // MSI-X messages are edge triggered, no need to touch the ISR status. The vector may be shared with other
+    // queues when the band is full, so the interrupt function must cope with a queue that has nothing to do.
+    DrvVirtioQueueInterrupt* queueInt = (DrvVirtioQueueInterrupt*)ctx;
+    if (queueInt->Drv->InterruptFn)
+        queueInt->Drv->InterruptFn(queueInt->Drv, queueInt->Queue);
+}
+
+static void DrvVirtio_TeardownMsiX(DrvVirtio* drv, uint32_t numVectors)
+{
+    for (uint32_t i = 0; i < numVectors; i++)
+    {
+        DrvVirtioQueueInterrupt* queueInt = &drv->QueueInterrupts[i];
+        IntUnregisterCallback2(queueInt->Vector, DrvVirtio_HandleQueueMsiX, queueInt);
+        IntFreeVector(queueInt->Vector);
+    }
+    kfree(drv->QueueInterrupts);
+    drv->QueueInterrupts = NULL;
+    PciMsiXDestroy(&drv->MsiX);
+    drv->UseMsiX = false;
+}
+
+static bool DrvVirtio_SetupMsiX(DrvVirtio* drv)
+{
+    if (!PciMsiXInitialize(&drv->MsiX, drv->PciBus, drv->PciDevice, drv->PciFunction))
+        return false;
+    if (drv->MsiX.TableSize < drv->NumQueues)
+    {
+        TmPrintfWrn("[VirtIO] MSI-X table has %u entries for %u queues\n", drv->MsiX.TableSize, drv->NumQueues);
+        PciMsiXDestroy(&drv->MsiX);
+        return false;
+    }
+
+    // Table entry i is used by queue i, config change notifications are not used
+    drv->QueueInterrupts = kcalloc(sizeof(DrvVirtioQueueInterrupt) * drv->NumQueues);
+    for (uint32_t i = 0; i < drv->NumQueues; i++)
+    {
+        DrvVirtioQueueInterrupt* queueInt = &drv->QueueInterrupts[i];
+        queueInt->Drv = drv;
+        queueInt->Queue = i;
+        queueInt->Vector = IntAllocateSharedVector(IRQL_DEVICE_LO);
+        if (queueInt->Vector == 0)
+        {
+            DrvVirtio_TeardownMsiX(drv, i);
+            return false;
+        }
+        IntRegisterCallback(queueInt->Vector, DrvVirtio_HandleQueueMsiX, queueInt);
+        PciMsiXSetVector(&drv->MsiX, i, queueInt->Vector);
+    }
+    PciMsiXEnable(&drv->MsiX);
+    drv->UseMsiX = true;
+    return true;
 }
 
 bool DrvVirtioStart(DrvVirtio* drv, uint32_t reqFeatures[2], uint32_t optFeatures[2])
@@ -137,6 +195,8 @@ bool DrvVirtioStart(DrvVirtio* drv, uint32_t reqFeatures[2], uint32_t optFeature
     // 7. Perform device-specific setup, including discovery of virtqueues for the device
     drv->NumQueues = cfg->num_queues;
     drv->Queues = kalloc(sizeof(vring) * drv->NumQueues);
+    if (DrvVirtio_SetupMsiX(drv))
+        cfg->msix_config = VIRTIO_MSI_NO_VECTOR;
     for (uint32_t i = 0; i < drv->NumQueues; i++)
     {
         cfg->queue_select = i;
@@ -164,9 +224,8 @@ bool DrvVirtioStart(DrvVirtio* drv, uint32_t reqFeatures[2], uint32_t optFeature
         TmPrintf("Queue #%u    PageCount:     %u\n", i+1, pageCount);
 
         // Allocate memory for queue
-        kphys_t queuePhys = PhysAlloc(pageCount, PHYS_REGION_TYPE_HARDWARE, "virtq");
+        kphys_t queuePhys = PhysAllocZeroed(pageCount, PHYS_REGION_TYPE_HARDWARE, "virtq");
         uint8_t* queueMemory = VirtAlloc(queuePhys, pageCount, VIRT_PROT_READWRITE, VIRT_REGION_TYPE_HARDWARE, "virtq");
-        memset(queueMemory, 0, totalSize);
 
         // Setup queue memory
         vring* ring = &drv->Queues[i];
@@ -184,16 +243,36 @@ bool DrvVirtioStart(DrvVirtio* drv, uint32_t reqFeatures[2], uint32_t optFeature
             ring->desc[j].next = j + 1;
         }
 
+        // Route the queue to its MSI-X table entry, the device answers with VIRTIO_MSI_NO_VECTOR if it can't
+        if (drv->UseMsiX)
+        {
+            cfg->queue_msix_vector = i;
+            if (cfg->queue_msix_vector != i)
+            {
+                TmPrintfWrn("[VirtIO] Queue #%u rejected its MSI-X vector, falling back to INTx\n", i+1);
+                for (uint32_t j = 0; j <= i; j++)
+                {
+                    cfg->queue_select = j;
+                    cfg->queue_msix_vector = VIRTIO_MSI_NO_VECTOR;
+                }
+                cfg->queue_select = i;
+                DrvVirtio_TeardownMsiX(drv, drv->NumQueues);
+            }
+        }
+
         // Enable queue
         cfg->queue_desc = VirtToPhys(ring->desc);
         cfg->queue_avail = VirtToPhys(ring->avail);
         cfg->queue_used = VirtToPhys(ring->used);
         cfg->queue_enable = 1;
-        TmPrintf("[VirtIO] Enabled Queue #%u\n", i+1);
+        if (drv->UseMsiX)
+            TmPrintf("[VirtIO] Enabled Queue #%u on ISR%02Xh (MSI-X)\n", i+1, drv->QueueInterrupts[i].Vector);
+        else
+            TmPrintf("[VirtIO] Enabled Queue #%u\n", i+1);
     }
 
-    // Find the ISR and subscribe..
-    if (drv->PciIntPin != PCI_INT_PIN_NONE)
+    // Without MSI-X find the ISR of the INTx pin and subscribe..
+    if (!drv->UseMsiX && drv->PciIntPin != PCI_INT_PIN_NONE)
     {
         drv->Interrupt = PciLookupIntPinISR(drv->PciBus, drv->PciDevice, drv->PciIntPin);
         TmPrintf("[VirtIO] Using ISR%02Xh for interrupts\n", drv->Interrupt);
@@ -233,23 +312,29 @@ static vring_desc* DrvVirtioRing_AllocOneDesc(vring* ring)
     return desc;
 }
 
-// TODO: these functions should probably be called under an IRQ lock
+// The free list is modified by submitting threads and by completion DPCs, which can run in between as soon as
+// the IRQL drops. Both functions keep device interrupts out while they touch it.
 bool DrvVirtioRing_AllocDescs(DrvVirtio* drv, size_t queue, vring_desc** descs, size_t count)
 {
     vring* ring = &drv->Queues[queue];
+    irql_t irql = IrqlRaise(IRQL_DEVICE_LO);
     if (ring->num_unused_desc < count)
+    {
+        IrqlLower(irql);
         return false;
+    }
 
     for (size_t i = 0; i < count; i++)
         descs[i] = DrvVirtioRing_AllocOneDesc(ring);
 
+    IrqlLower(irql);
     return true;
 }
 
-// TODO: these functions should probably be called under an IRQ lock
 void DrvVirtioRing_FreeChain(DrvVirtio* drv, size_t queue, uint16_t id)
 {
     vring* ring = &drv->Queues[queue];
+    irql_t irql = IrqlRaise(IRQL_DEVICE_LO);
     vring_desc* head = &ring->desc[id];
     vring_desc* last = head;
 
@@ -267,6 +352,7 @@ void DrvVirtioRing_FreeChain(DrvVirtio* drv, size_t queue, uint16_t id)
     }
     ring->first_unused_desc = head;
     ring->num_unused_desc += count;
+    IrqlLower(irql);
 }
 
 void DrvVirtioRing_BatchAdd(DrvVirtio* drv, size_t queue, const vring_desc** descs, size_t count)
@@ -294,3 +380,20 @@ void DrvVirtioRing_BatchComplete(DrvVirtio* drv, size_t queue)
     // TODO: only notify if device wants it! not supressing!
     *(volatile uint16_t*)((uint8_t*)drv->NotifyCfg + (queue * drv->NotifyCfgMult)) = ring->avail->idx;
 }
+
+void DrvVirtioRing_DisableInterrupts(DrvVirtio* drv, size_t queue)
+{
+    // Only a hint, the device may still send an interrupt it already decided on
+    vring* ring = &drv->Queues[queue];
+    *(volatile uint16_t*)&ring->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+bool DrvVirtioRing_EnableInterrupts(DrvVirtio* drv, size_t queue)
+{
+    // Buffers used while interrupts were suppressed won't raise one, so the used ring has to be re-checked after
+    // the flag is visible to the device. Returns false if there is more work and the caller should keep polling.
+    vring* ring = &drv->Queues[queue];
+    *(volatile uint16_t*)&ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    asm volatile("mfence": : :"memory");
+    return !DrvVirtioRing_HasUsed(drv, queue);
+}
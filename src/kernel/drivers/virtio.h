@@ -11,7 +11,14 @@
 
 struct DrvVirtio;
 
-typedef void (*DrvVirtioInterruptFn)(struct DrvVirtio* drv);
+typedef void (*DrvVirtioInterruptFn)(struct DrvVirtio* drv, uint32_t queue);
+
+typedef struct DrvVirtioQueueInterrupt
+{
+    struct DrvVirtio* Drv;
+    uint32_t Queue;
+    uint8_t Vector;
+} DrvVirtioQueueInterrupt;
 
 typedef struct DrvVirtio
 {
@@ -49,6 +56,11 @@ typedef struct DrvVirtio
     uint32_t NumQueues;
     uint8_t Interrupt;
     DrvVirtioInterruptFn InterruptFn;
+
+    // With MSI-X every queue has its own vector, otherwise all queues share Interrupt (INTx)
+    bool UseMsiX;
+    PciMsiX MsiX;
+    DrvVirtioQueueInterrupt* QueueInterrupts;
 } DrvVirtio;
 
 bool DrvVirtioCreate(DrvVirtio* drv, const PciDeviceInfo* pciInfo);
@@ -59,6 +71,14 @@ bool DrvVirtioRing_AllocDescs(DrvVirtio* drv, size_t queue, vring_desc** descs,
 void DrvVirtioRing_FreeChain(DrvVirtio* drv, size_t queue, uint16_t id);
 void DrvVirtioRing_BatchAdd(DrvVirtio* drv, size_t queue, const vring_desc** descs, size_t count);
 void DrvVirtioRing_BatchComplete(DrvVirtio* drv, size_t queue);
+void DrvVirtioRing_DisableInterrupts(DrvVirtio* drv, size_t queue);
+bool DrvVirtioRing_EnableInterrupts(DrvVirtio* drv, size_t queue);
+
+static inline bool DrvVirtioRing_HasUsed(DrvVirtio* drv, size_t queue)
+{
+    vring* ring = &drv->Queues[queue];
+    return ring->last_seen_used != *(volatile uint16_t*)&ring->used->idx;
+}
 
 static inline uint16_t DrvVirtioRing_DescIndex(DrvVirtio* drv, size_t queue, vring_desc* desc)
 {
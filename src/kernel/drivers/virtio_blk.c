@@ -21,19 +21,64 @@ DrvVirtioBlk* DrvVirtioBlk_Create(const PciDeviceInfo* pciInfo)
     return drv;
 }
 
-static void DrvVirtioBlk_Process(DrvVirtioBlk* drv, size_t queue);
+static uint32_t DrvVirtioBlk_Process(DrvVirtioBlk* drv, size_t queue, uint32_t budget);
 
-static void DrvVirtioBlk_OnInterrupt(DrvVirtio* drv)
+static uint32_t DrvVirtioBlk_PollBudget(DrvVirtioBlk* drv)
 {
+    // A budget of 0 would never reap anything, the DPC would requeue itself forever
+    return drv->Tunables.PollBudget != 0 ? drv->Tunables.PollBudget : 1;
+}
+
+static void DrvVirtioBlk_OnCompletionDpc(Dpc* dpc, void* ctx)
+{
+    // Completions of all queues are handled in one go, however many interrupts queued this DPC. In hybrid mode
+    // the queue stays in polling mode (interrupts suppressed) for as long as each run uses up its budget.
+    DrvVirtioBlk* blk = (DrvVirtioBlk*)ctx;
+    bool hybrid = blk->Tunables.Mode == DRV_VIRTIO_BLK_MODE_HYBRID;
+    uint32_t budget = hybrid ? DrvVirtioBlk_PollBudget(blk) : UINT32_MAX;
+    bool again = false;
+    blk->Stats.PollRuns++;
+    for (uint32_t queue = 0; queue < blk->Drv.NumQueues; queue++)
+    {
+        uint32_t processed = DrvVirtioBlk_Process(blk, queue, budget);
+        if (!hybrid)
+            continue;
+        if (processed == budget)
+        {
+            blk->Stats.BudgetExhausted++;
+            again = true;
+        }
+        else if (!DrvVirtioRing_EnableInterrupts(&blk->Drv, queue))
+        {
+            blk->Stats.RearmRaces++;
+            DrvVirtioRing_DisableInterrupts(&blk->Drv, queue);
+            again = true;
+        }
+        else
+            blk->Stats.Rearms++;
+    }
+    if (again)
+        DpcQueue(dpc);
+}
+
+static void DrvVirtioBlk_OnInterrupt(DrvVirtio* drv, uint32_t queue)
+{
+    // The virtio layer already acknowledged the interrupt, the completion work is deferred
     DrvVirtioBlk* blk = (DrvVirtioBlk*)drv;
-    TmPrintf("[VirtIO-BLK] !!! Interrupt caught !!!\n");
-    DrvVirtioBlk_Process(blk, 0);
+    blk->Stats.Interrupts++;
+    if (blk->Tunables.Mode == DRV_VIRTIO_BLK_MODE_HYBRID)
+        DrvVirtioRing_DisableInterrupts(drv, queue);
+    DpcQueue(blk->CompletionDpc);
 }
 
 bool DrvVirtioBlk_Start(DrvVirtioBlk* drv)
 {
     uint32_t blkReqFeatures[2] = {0, (1 << (VIRTIO_F_VERSION_1 - 32))};
     uint32_t blkOptFeatures[2] = {(1 << VIRTIO_BLK_F_RO) | (1 << VIRTIO_BLK_F_BLK_SIZE) | (1 << VIRTIO_BLK_F_DISCARD) | (1 << VIRTIO_BLK_F_WRITE_ZEROES), 0};
+    drv->CompletionDpc = DpcCreate(DrvVirtioBlk_OnCompletionDpc, drv, DPC_PRIORITY_HIGH);
+    drv->Tunables.Mode = DRV_VIRTIO_BLK_MODE_HYBRID;
+    drv->Tunables.PollBudget = 32;
+    drv->Tunables.SyncSpinMicrosecs = 50;
     drv->Drv.InterruptFn = DrvVirtioBlk_OnInterrupt;
     return DrvVirtioStart(&drv->Drv, blkReqFeatures, blkOptFeatures);
 }
@@ -47,6 +92,7 @@ typedef struct DrvVirtioBlk_IoOp
     AsyncCallbackFn AsyncCallback;
     virtio_blk_req Req;
     uint8_t ReturnCode;
+    SchEvent Done; // Signaled for synchronous operations
 } DrvVirtioBlk_IoOp;
 
 static void DrvVirtioBlk_ProcessOne(DrvVirtioBlk* drv, size_t queue, vring_used_elem* elem)
@@ -57,36 +103,89 @@ static void DrvVirtioBlk_ProcessOne(DrvVirtioBlk* drv, size_t queue, vring_used_
     DrvVirtioBlk_IoOp* op = CONTAINING_RECORD(req, DrvVirtioBlk_IoOp, Req);
     TmPrintf("[VirtIO-BLK] IO operation #%u finished [qdesc=%u, xfer=%u, err=%u]\n", op->Id, elem->id, elem->len, op->ReturnCode);
     DrvVirtioRing_FreeChain(&drv->Drv, queue, elem->id);
-    op->Finished = true;
     op->Transferred = elem->len - 1;
+    op->Finished = true;
     if (op->AsyncCall != NULL)
     {
         op->AsyncCall->Success = op->ReturnCode == 0;
         op->AsyncCall->Transferred = op->Transferred;
         if (op->AsyncCall->Event != NULL)
-            SchEventSignal(op->AsyncCall->Event); // TODO: hmm, what to do if this enables interrupts?
+            SchEventSignal(op->AsyncCall->Event);
         if (op->AsyncCallback != NULL)
-            op->AsyncCallback(op->AsyncCall); // TODO: hmm, what to do if this enables interrupts?
+            op->AsyncCallback(op->AsyncCall);
     }
+    else
+        SchEventSignal(&op->Done);
 }
 
-static void DrvVirtioBlk_Process(DrvVirtioBlk* drv, size_t queue)
+static uint32_t DrvVirtioBlk_Process(DrvVirtioBlk* drv, size_t queue, uint32_t budget)
 {
     vring* q = &drv->Drv.Queues[queue];
-    while (true)
+    uint32_t processed = 0;
+    while (processed < budget)
     {
-        uint32_t irqLock = IntEnterCriticalSection();
+        irql_t irql = IrqlRaise(IRQL_DEVICE_LO);
         if (q->last_seen_used == q->used->idx)
         {
-            IntLeaveCriticalSection(irqLock);
+            IrqlLower(irql);
             break;
         }
         vring_used_elem* elem = &q->used->ring[q->last_seen_used % q->num];
         q->last_seen_used++;
-        IntLeaveCriticalSection(irqLock);
+        IrqlLower(irql);
 
         DrvVirtioBlk_ProcessOne(drv, queue, elem);
+        processed++;
+    }
+    drv->Stats.Completions += processed;
+    return processed;
+}
+
+static void DrvVirtioBlk_AllocDescs(DrvVirtioBlk* drv, vring_desc** descs, size_t count)
+{
+    // The completion DPC returns descriptors to the free list, wait for it when the ring is full
+    while (true)
+    {
+        if (DrvVirtioRing_AllocDescs(&drv->Drv, 0, descs, count))
+            return;
+        SchYield();
+    }
+}
+
+static uint32_t DrvVirtioBlk_ProcessSync(DrvVirtioBlk* drv, size_t queue, uint32_t budget)
+{
+    // Other requests' completions are reaped here too. Like in the DPC, a completion is marked finished and
+    // signalled without being preempted in between, or its waiter could free the request while it's signalled.
+    irql_t irql = IrqlRaise(IRQL_SCHEDULER);
+    uint32_t processed = DrvVirtioBlk_Process(drv, queue, budget);
+    IrqlLower(irql);
+    return processed;
+}
+
+static void DrvVirtioBlk_WaitSync(DrvVirtioBlk* drv, DrvVirtioBlk_IoOp* op)
+{
+    // Low queue depth: poll the used ring for a short while with interrupts suppressed, the completion often
+    // arrives sooner than an interrupt, DPC and wakeup would take. Sleep if it doesn't. Interrupt mode never
+    // suppresses interrupts, so it doesn't spin either.
+    if (drv->Tunables.Mode == DRV_VIRTIO_BLK_MODE_HYBRID && drv->Tunables.SyncSpinMicrosecs != 0)
+    {
+        DrvVirtioRing_DisableInterrupts(&drv->Drv, 0);
+        uint64_t spinUntil = rdtsc() + TscUsToTicks(drv->Tunables.SyncSpinMicrosecs);
+        while (!op->Finished && rdtsc() < spinUntil)
+        {
+            if (DrvVirtioBlk_ProcessSync(drv, 0, DrvVirtioBlk_PollBudget(drv)) == 0)
+                asm volatile("pause");
+        }
+        if (!DrvVirtioRing_EnableInterrupts(&drv->Drv, 0))
+            DrvVirtioBlk_ProcessSync(drv, 0, UINT32_MAX);
+        if (op->Finished)
+        {
+            drv->Stats.SyncSpinHits++;
+            return;
+        }
     }
+    drv->Stats.SyncSleeps++;
+    SchEventWait(&op->Done);
 }
 
 static uint32_t DrvVirtioBlk_NextOpId = 1;
@@ -94,7 +193,7 @@ static uint32_t DrvVirtioBlk_NextOpId = 1;
 size_t DrvVirtioBlk_Read(DrvVirtioBlk* drv, uint64_t sector, void* user_buf, size_t user_len)
 {
     // Build request
-    DrvVirtioBlk_IoOp* op = kalloc(sizeof(DrvVirtioBlk_IoOp));
+    DrvVirtioBlk_IoOp* op = kcalloc(sizeof(DrvVirtioBlk_IoOp));
     op->Id = DrvVirtioBlk_NextOpId++;
     op->Finished = false;
     op->Transferred = 0;
@@ -107,8 +206,7 @@ size_t DrvVirtioBlk_Read(DrvVirtioBlk* drv, uint64_t sector, void* user_buf, siz
 
     // Allocate and set up buffer descriptors
     vring_desc* descs[3];
-    while (!DrvVirtioRing_AllocDescs(&drv->Drv, 0, descs, 3))
-        SchYield();
+    DrvVirtioBlk_AllocDescs(drv, descs, 3);
 
     // Request header is device read-only
     descs[0]->addr = VirtToPhys(&op->Req);
@@ -129,16 +227,15 @@ size_t DrvVirtioBlk_Read(DrvVirtioBlk* drv, uint64_t sector, void* user_buf, siz
     descs[2]->next = UINT16_MAX;
 
     // Submit & wait for completion
-    uint32_t irqLock = IntEnterCriticalSection();
+    irql_t irql = IrqlRaise(IRQL_DEVICE_LO);
     {
         DrvVirtioRing_BatchAdd(&drv->Drv, 0, &descs[0], 1); // only add desciptor chain heads
         DrvVirtioRing_BatchComplete(&drv->Drv, 0);
         TmPrintf("[VirtIO-BLK] IO operation #%u submitted [sector=%llu, length=%u]\n", op->Id, sector, user_len);
     }
-    IntLeaveCriticalSection(irqLock);
+    IrqlLower(irql);
 
-    while (!op->Finished)
-        DrvVirtioBlk_Process(drv, 0);
+    DrvVirtioBlk_WaitSync(drv, op);
 
     // Free request
     size_t result = op->ReturnCode == 0 ? op->Transferred : 0;
@@ -164,8 +261,7 @@ void DrvVirtioBlk_ReadAsync(DrvVirtioBlk* drv, uint64_t sector, void* user_buf,
 
     // Allocate and set up buffer descriptors
     vring_desc* descs[3];
-    while (!DrvVirtioRing_AllocDescs(&drv->Drv, 0, &descs, 3))
-        SchYield();
+    DrvVirtioBlk_AllocDescs(drv, descs, 3);
 
     // Request header is device read-only
     descs[0]->addr = VirtToPhys(&op->Req);
@@ -186,16 +282,26 @@ void DrvVirtioBlk_ReadAsync(DrvVirtioBlk* drv, uint64_t sector, void* user_buf,
     descs[2]->next = UINT16_MAX;
 
     // Submit
-    uint32_t irqLock = IntEnterCriticalSection();
+    irql_t irql = IrqlRaise(IRQL_DEVICE_LO);
     {
         DrvVirtioRing_BatchAdd(&drv->Drv, 0, &descs[0], 1); // only add desciptor chain heads
         DrvVirtioRing_BatchComplete(&drv->Drv, 0);
         TmPrintf("[VirtIO-BLK] IO operation #%u submitted [sector=%llu, length=%u, !ASYNC!]\n", op->Id, sector, user_len);
     }
-    IntLeaveCriticalSection(irqLock);
+    IrqlLower(irql);
 }
 
 size_t DrvVirtioBlk_Write(DrvVirtioBlk* drv, uint64_t sector, const void* buf, size_t len)
 {
     return (size_t)-1;
 }
+
+void DrvVirtioBlk_DebugDump(DrvVirtioBlk* drv)
+{
+    DrvVirtioBlkStats* stats = &drv->Stats;
+    TmPrintf("[VirtIO-BLK] mode=%s budget=%u spin=%uus\n", drv->Tunables.Mode == DRV_VIRTIO_BLK_MODE_HYBRID ? "hybrid" : "interrupt",
+             DrvVirtioBlk_PollBudget(drv), drv->Tunables.SyncSpinMicrosecs);
+    TmPrintf("[VirtIO-BLK] interrupts=%llu polls=%llu completions=%llu exhausted=%llu rearms=%llu races=%llu\n",
+             stats->Interrupts, stats->PollRuns, stats->Completions, stats->BudgetExhausted, stats->Rearms, stats->RearmRaces);
+    TmPrintf("[VirtIO-BLK] sync reads: spin hits=%llu sleeps=%llu\n", stats->SyncSpinHits, stats->SyncSleeps);
+}
@@ -2,10 +2,36 @@
 #define KERNEL_DRIVERS_VIRTIO_BLK_H
 
 #include "virtio.h"
+#include "../dpc.h"
+
+#define DRV_VIRTIO_BLK_MODE_INTERRUPT 0 // Every completion may raise an interrupt
+#define DRV_VIRTIO_BLK_MODE_HYBRID    1 // The first interrupt switches the queue to polling until it runs dry
+
+typedef struct DrvVirtioBlkTunables
+{
+    uint32_t Mode;
+    uint32_t PollBudget;        // Completions reaped per queue and DPC run before the DPC requeues itself, 0 counts as 1
+    uint32_t SyncSpinMicrosecs; // How long synchronous reads poll for their completion before sleeping, 0 to never spin. Hybrid mode only.
+} DrvVirtioBlkTunables;
+
+typedef struct DrvVirtioBlkStats
+{
+    uint64_t Interrupts;
+    uint64_t PollRuns;        // Completion DPC runs
+    uint64_t Completions;
+    uint64_t BudgetExhausted; // DPC runs that requeued themselves because a queue still had work
+    uint64_t Rearms;          // Queues that went idle and got their interrupts back
+    uint64_t RearmRaces;      // Completions found right after re-enabling interrupts
+    uint64_t SyncSpinHits;    // Synchronous reads completed while spinning
+    uint64_t SyncSleeps;      // Synchronous reads that had to sleep
+} DrvVirtioBlkStats;
 
 typedef struct DrvVirtioBlk
 {
     DrvVirtio Drv;
+    Dpc* CompletionDpc;
+    DrvVirtioBlkTunables Tunables;
+    DrvVirtioBlkStats Stats;
 } DrvVirtioBlk;
 
 typedef struct AsyncCall
@@ -26,4 +52,6 @@ void DrvVirtioBlk_ReadAsync(DrvVirtioBlk* drv, uint64_t sector, void* buf, size_
 
 size_t DrvVirtioBlk_Write(DrvVirtioBlk* drv, uint64_t sector, const void* buf, size_t len);
 
+void DrvVirtioBlk_DebugDump(DrvVirtioBlk* drv);
+
 #endif
@@ -0,0 +1,90 @@
+#include <acpi/acpi.h>
+#include "hpet.h"
+#include "debug.h"
+#include "memory.h"
+#include "textmode.h"
+
+#define HPET_REG_GCAP_ID     0x000 // General Capabilities and ID
+#define HPET_REG_GEN_CONF    0x010 // General Configuration
+#define HPET_REG_MAIN_CNT    0x0F0 // Main Counter Value
+
+#define HPET_GCAP_COUNT_SIZE_CAP (1 << 13) // Main counter is 64 bits wide
+#define HPET_GEN_CONF_ENABLE     (1 << 0)  // Main counter runs
+#define HPET_GEN_CONF_LEGACY     (1 << 1)  // Legacy replacement routing (timers 0/1 replace PIT/RTC)
+
+#define HPET_MAX_PERIOD_FS 100000000 // 100ns, required by the spec
+
+uint64_t HpetFrequency = 0;
+uint64_t HpetCounterMask = 0;
+static volatile uint8_t* HpetBase = NULL;
+
+static inline uint32_t HpetReadRegister(uint32_t reg)
+{
+    return *(volatile uint32_t*)(HpetBase + reg);
+}
+
+static inline void HpetWriteRegister(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t*)(HpetBase + reg) = value;
+}
+
+bool HpetInitialize()
+{
+    ACPI_TABLE_HPET* hpet = NULL;
+    if (ACPI_FAILURE(AcpiGetTable(ACPI_SIG_HPET, 0, (ACPI_TABLE_HEADER**)&hpet)))
+    {
+        TmPrintfWrn("No HPET found\n");
+        return false;
+    }
+    if (hpet->Address.SpaceId != ACPI_ADR_SPACE_SYSTEM_MEMORY)
+    {
+        TmPrintfWrn("HPET is not memory mapped (address space %u)\n", hpet->Address.SpaceId);
+        return false;
+    }
+
+    // Map HPET registers into virtual memory
+    kphys_t address = (kphys_t)hpet->Address.Address;
+    HpetBase = VirtAlloc(address, 1, VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE, VIRT_REGION_TYPE_HARDWARE, "HPET");
+    PhysMark(address, 1, PHYS_REGION_TYPE_HARDWARE, "HPET");
+
+    uint32_t caps = HpetReadRegister(HPET_REG_GCAP_ID);
+    uint32_t periodFs = HpetReadRegister(HPET_REG_GCAP_ID + 4);
+    if (periodFs == 0 || periodFs > HPET_MAX_PERIOD_FS)
+    {
+        TmPrintfErr("HPET reports invalid counter period %u fs\n", periodFs);
+        HpetBase = NULL;
+        return false;
+    }
+    HpetFrequency = 1000000000000000ull / periodFs;
+    HpetCounterMask = (caps & HPET_GCAP_COUNT_SIZE_CAP) ? UINT64_MAX : UINT32_MAX;
+
+    // Start the main counter, without legacy replacement routing (the PIT keeps IRQ0)
+    uint32_t conf = HpetReadRegister(HPET_REG_GEN_CONF);
+    conf &= ~HPET_GEN_CONF_LEGACY;
+    conf |= HPET_GEN_CONF_ENABLE;
+    HpetWriteRegister(HPET_REG_GEN_CONF, conf);
+
+    TmPrintfDbg("Found HPET (addr=%p, %llu Hz, %u-bit counter, %u timers)\n", HpetBase, HpetFrequency,
+                HpetCounterMask == UINT64_MAX ? 64 : 32, ((caps >> 8) & 0x1F) + 1);
+    return true;
+}
+
+bool HpetIsAvailable()
+{
+    return HpetBase != NULL;
+}
+
+uint64_t HpetReadCounter()
+{
+    if (HpetCounterMask != UINT64_MAX)
+        return HpetReadRegister(HPET_REG_MAIN_CNT);
+
+    // 32-bit code reads the 64-bit counter in two halves, retry if the low half wrapped in between
+    uint32_t hi, lo;
+    do
+    {
+        hi = HpetReadRegister(HPET_REG_MAIN_CNT + 4);
+        lo = HpetReadRegister(HPET_REG_MAIN_CNT);
+    } while (hi != HpetReadRegister(HPET_REG_MAIN_CNT + 4));
+    return ((uint64_t)hi << 32) | lo;
+}
@@ -0,0 +1,14 @@
+#ifndef KERNEL_HPET_H
+#define KERNEL_HPET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+extern uint64_t HpetFrequency;
+extern uint64_t HpetCounterMask;
+
+bool HpetInitialize();
+bool HpetIsAvailable();
+uint64_t HpetReadCounter();
+
+#endif
@@ -1,12 +1,16 @@
 #include <stdint.h>
+#include <string.h>
 #include <acpi/acpi.h>
 #include "isr.h"
 #include "pit.h"
+#include "tsc.h"
 #include "pic.h"
 #include "apic.h"
+#include "clock.h"
 #include "ioapic.h"
 #include "debug.h"
 #include "memory.h"
+#include "comport.h"
 #include "lowlevel.h"
 #include "textmode.h"
 #include "scheduler.h"
@@ -31,105 +35,182 @@ typedef struct
 } IdtEntry;
 #pragma pack(pop)
 
+typedef struct IntCallbackRecord_s IntCallbackRecord;
 typedef struct IntCallbackRecord_s
 {
-    SListEntry List;
-    uint32_t Interrupt;
+    IntCallbackRecord* Next;
     IntCallbackFn Function;
     void* Context;
 } IntCallbackRecord;
 
+typedef void (*IntVectorHandlerFn)(InterruptContext* ctx);
+
+#define INT_STATS_BUCKETS 32 // log2 of the handler time in TSC cycles
+
+typedef struct IntVectorStats_s
+{
+    uint64_t Count;
+    uint64_t TotalCycles;
+    uint64_t MaxCycles;
+    uint32_t Histogram[INT_STATS_BUCKETS];
+} IntVectorStats;
+
 extern int __kernel_idt_beg;
 static IdtEntry* IntIDT = (IdtEntry*)&__kernel_idt_beg;
-static SListHead IntCallbackList;
+static IntVectorHandlerFn IntVectorHandlers[256]; // Built-in handlers for CPU exceptions and the APIC timer
+static IntCallbackRecord* IntCallbacks[256];      // Chains of registered callbacks, shared lines have several
 static int IntPicMode = INT_PIC_MODE_8259;
 static int IntPageFaultsDeferred = 0;
 static bool IntDeferringPageFaults = false;
+static uint32_t IntVectorsInUse[256 / 32]; // Vectors that are fixed or handed out by IntAllocateVector
+static uint8_t IntVectorUsers[256]; // Owners of vectors handed out by IntAllocateSharedVector, 0 for exclusive ones
+static IntVectorStats IntStats[256];
+static int IntStatsVector = -1; // vector of the handler being timed, -1 if none
+static uint64_t IntStatsStart = 0;
 
-void IntCommonHandler(InterruptContext ctx)
+static void IntHandleGpFault(InterruptContext* ctx)
 {
-    // This is only the case during early boot
-    if (ctx.interrupt >= INT20_PIC_IRQ0 && ctx.interrupt <= INT2F_PIC_IRQ15)
+    TmSetColor(TM_COLOR_LTRED, TM_COLOR_BLACK);
+    TmPrintf("GENERAL PROTECTION FAULT\n");
+    TmPrintf("eip=%p  eflags=%p task=%d\n", ctx->eip, ctx->eflags, SchCurrentTask ? SchCurrentTask->id : 0);
+    TmPrintf("int=%p  err=%p  uesp=%p\n", ctx->interrupt, ctx->errcode, ctx->useresp);
+    TmPrintf("cs=%p   ds=%p   ss=%p\n", ctx->cs, ctx->ds, ctx->ss);
+    TmPrintf("eax=%p  ebx=%p  ecx=%p  edx=%p\n", ctx->eax, ctx->ebx, ctx->ecx, ctx->edx);
+    TmPrintf("ebp=%p  esp=%p  edi=%p  esi=%p\n", ctx->ebp, ctx->esp, ctx->edi, ctx->esi);
+    DbgPanic("GP fault");
+}
+
+static void IntHandlePageFault(InterruptContext* ctx)
+{
+    int taskId = SchCurrentTask ? SchCurrentTask->id : 0;
+    void* addr = rdcr2();
+    void* page = (void*)KPAGE_ALIGN_DOWN(addr);
+    if (page == NULL || !IntDeferringPageFaults)
     {
-        PicSendEOI(ctx.interrupt - INT20_PIC_IRQ0); // TODO: don't send EOI for spurious interrupts
-        if (ctx.interrupt == INT20_PIC_IRQ0 && IntPicMode == INT_PIC_MODE_8259)
-            PitCurrentTick++;
-        if (ctx.interrupt == INT21_PIC_IRQ1)
-            inb(0x60);
-        return;
+        TmPushColor(TM_COLOR_LTRED, TM_COLOR_BLACK);
+        TmPrintf("PAGE FAULT: address %p\n", addr);
+        TmPrintf("eip=%p  eflags=%p task=%d\n", ctx->eip, ctx->eflags, taskId);
+        TmPrintf("int=%p  err=%p  uesp=%p\n", ctx->interrupt, ctx->errcode, ctx->useresp);
+        TmPrintf("cs=%p   ds=%p   ss=%p\n", ctx->cs, ctx->ds, ctx->ss);
+        TmPrintf("eax=%p  ebx=%p  ecx=%p  edx=%p\n", ctx->eax, ctx->ebx, ctx->ecx, ctx->edx);
+        TmPrintf("ebp=%p  esp=%p  edi=%p  esi=%p\n", ctx->ebp, ctx->esp, ctx->edi, ctx->esi);
+        TmPopColor();
     }
+    if (page != NULL && IntDeferringPageFaults)
+    {
+        IntPageFaultsDeferred++;
+        VirtMapMemory(KPHYS(page), KVIRT(page), 1, VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE, "FAULT");
+    }
+    if (page == NULL)
+        DbgPanic("NULL pointer accessed");
+    if (!IntDeferringPageFaults)
+        DbgPanic("page fault");
+}
 
-    // Don't send EOI for ISRFFh (spurious interrupt ISR)
-    if (IntPicMode == INT_PIC_MODE_APIC && ctx.interrupt != 0xFF)
-        ApicSendEOI(ctx.interrupt);
+static void IntHandleApicTimer(InterruptContext* ctx)
+{
+    if (SchCurrentTask)
+        SchTick();
+    else
+        PitCurrentTick++;
+}
+
+static void IntHandleApicIrq0(InterruptContext* ctx)
+{
+    TmColorPrintf(TM_COLOR_YELLOW, TM_COLOR_BLACK, "[INT%02Xh] Spurious IRQ0 timer!\n", ctx->interrupt & 0xFF);
+}
 
-    bool handled = false;
-    IntCallbackRecord* callback = CONTAINING_RECORD(IntCallbackList.Next, IntCallbackRecord, List);
-    while (callback)
+static void IntHandleApicIrq1(InterruptContext* ctx)
+{
+    TmColorPrintf(TM_COLOR_WHITE, TM_COLOR_BLACK, "[INT%02Xh] Got keyboard scancode: 0x%02X\n", ctx->interrupt & 0xFF, inb(0x60));
+}
+
+static void IntDispatch(InterruptContext* ctx, uint32_t interrupt)
+{
+    // Registered callbacks run before the built-in handler, which may switch tasks (timer) or not return (faults)
+    IntCallbackRecord* callback = IntCallbacks[interrupt];
+    IntVectorHandlerFn handler = IntVectorHandlers[interrupt];
+    if (callback == NULL && handler == NULL)
     {
-        if (callback->Interrupt == ctx.interrupt)
-        {
-            callback->Function(callback->Context);
-            handled = true;
-        }
-        callback = CONTAINING_RECORD(callback->List.Next, IntCallbackRecord, List);
+        TmColorPrintf(TM_COLOR_LTRED, TM_COLOR_BLACK, "[INT%02Xh] Unknown interrupt 0x%02X called (err=0x%08X)\n", interrupt, interrupt, ctx->errcode);
+        return;
     }
+    for (; callback; callback = callback->Next)
+        callback->Function(callback->Context);
+    if (handler)
+        handler(ctx);
+}
+
+void IntStatsEnd()
+{
+    // Called when the handler returns, or before it switches tasks (the timer) so that the time the other
+    // task runs isn't attributed to the handler
+    if (IntStatsVector < 0)
+        return;
+    uint64_t cycles = rdtsc() - IntStatsStart;
+    IntVectorStats* stats = &IntStats[IntStatsVector];
+    stats->Count++;
+    stats->TotalCycles += cycles;
+    if (cycles > stats->MaxCycles)
+        stats->MaxCycles = cycles;
+    uint32_t bucket = (cycles >> 32) != 0 ? INT_STATS_BUCKETS - 1 : (cycles != 0 ? bsr((uint32_t)cycles) : 0);
+    stats->Histogram[bucket]++;
+    IntStatsVector = -1;
+}
+
+void IntCommonHandler(InterruptContext* ctx)
+{
+    uint32_t interrupt = ctx->interrupt & 0xFF;
+    IntStatsVector = interrupt;
+    IntStatsStart = rdtsc();
 
-    if (ctx.interrupt == INT0D_CPU_GP_FAULT)
+    // This is only the case during early boot
+    if (interrupt >= INT20_PIC_IRQ0 && interrupt <= INT2F_PIC_IRQ15)
     {
-        TmSetColor(TM_COLOR_LTRED, TM_COLOR_BLACK);
-        TmPrintf("GENERAL PROTECTION FAULT\n");
-        TmPrintf("eip=%p  eflags=%p task=%d\n", ctx.eip, ctx.eflags, SchCurrentTask ? SchCurrentTask->id : 0);
-        TmPrintf("int=%p  err=%p  uesp=%p\n", ctx.interrupt, ctx.errcode, ctx.useresp);
-        TmPrintf("cs=%p   ds=%p   ss=%p\n", ctx.cs, ctx.ds, ctx.ss);
-        TmPrintf("eax=%p  ebx=%p  ecx=%p  edx=%p\n", ctx.eax, ctx.ebx, ctx.ecx, ctx.edx);
-        TmPrintf("ebp=%p  esp=%p  edi=%p  esi=%p\n", ctx.ebp, ctx.esp, ctx.edi, ctx.esi);
-        DbgPanic("GP fault");
+        PicSendEOI(interrupt - INT20_PIC_IRQ0); // TODO: don't send EOI for spurious interrupts
+        if (interrupt == INT20_PIC_IRQ0 && IntPicMode == INT_PIC_MODE_8259)
+            PitCurrentTick++;
+        if (interrupt == INT21_PIC_IRQ1)
+            inb(0x60);
+        IntStatsEnd();
+        return;
     }
-    else if (ctx.interrupt == INT0E_CPU_PAGE_FAULT)
+
+    // The handler runs at the IRQL of its vector, IrqlLower replays whatever got deferred meanwhile
+    irql_t oldIrql = IrqlGetCurrent();
+
+    // Don't send EOI for ISRFFh (spurious interrupt ISR)
+    if (IntPicMode == INT_PIC_MODE_APIC && interrupt != 0xFF)
     {
-        int taskId = SchCurrentTask ? SchCurrentTask->id : 0;
-        void* addr = rdcr2();
-        void* page = (void*)KPAGE_ALIGN_DOWN(addr);
-        if (page == NULL || !IntDeferringPageFaults)
+        // Masked by the current IRQL, keep it in service until IrqlLower replays it
+        if (interrupt >= INTXX_APIC_IRQ0 && IrqlFromVector(interrupt) <= oldIrql)
         {
-            TmPushColor(TM_COLOR_LTRED, TM_COLOR_BLACK);
-            TmPrintf("PAGE FAULT: address %p\n", addr);
-            TmPrintf("eip=%p  eflags=%p task=%d\n", ctx.eip, ctx.eflags, taskId);
-            TmPrintf("int=%p  err=%p  uesp=%p\n", ctx.interrupt, ctx.errcode, ctx.useresp);
-            TmPrintf("cs=%p   ds=%p   ss=%p\n", ctx.cs, ctx.ds, ctx.ss);
-            TmPrintf("eax=%p  ebx=%p  ecx=%p  edx=%p\n", ctx.eax, ctx.ebx, ctx.ecx, ctx.edx);
-            TmPrintf("ebp=%p  esp=%p  edi=%p  esi=%p\n", ctx.ebp, ctx.esp, ctx.edi, ctx.esi);
-            TmPopColor();
+            IntStatsVector = -1;
+            IrqlDeferInterrupt(interrupt);
+            return;
         }
-        if (page != NULL && IntDeferringPageFaults)
-        {
-            IntPageFaultsDeferred++;
-            VirtMapMemory(KPHYS(page), KVIRT(page), 1, VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE, "FAULT");
-        }
-        if (page == NULL)
-            DbgPanic("NULL pointer accessed");
-        if (!IntDeferringPageFaults)
-            DbgPanic("page fault");
-    }
-    else if (ctx.interrupt == INTXX_APIC_IRQ0)
-    {
-        TmColorPrintf(TM_COLOR_YELLOW, TM_COLOR_BLACK, "[INT%02Xh] Spurious IRQ0 timer!\n", ctx.interrupt & 0xFF);
-    }
-    else if (ctx.interrupt == INTXX_APIC_TIMER)
-    {
-        PitCurrentTick++;
-        if (SchCurrentTask)
-            SchYield();
-    }
-    else if (ctx.interrupt == INTXX_APIC_IRQ1)
-    {
-        TmColorPrintf(TM_COLOR_WHITE, TM_COLOR_BLACK, "[INT%02Xh] Got keyboard scancode: 0x%02X\n", ctx.interrupt & 0xFF, inb(0x60));
-    }
-    else if (!handled)
-    {
-        TmColorPrintf(TM_COLOR_LTRED, TM_COLOR_BLACK, "[INT%02Xh] Unknown interrupt 0x%02X called (err=0x%08X)\n", ctx.interrupt & 0xFF, ctx.interrupt & 0xFF, ctx.errcode);
+        ApicSendEOI(interrupt);
+        if (interrupt >= INTXX_APIC_IRQ0)
+            IrqlRaise(IrqlFromVector(interrupt));
     }
+
+    IntDispatch(ctx, interrupt);
+    IntStatsEnd();
+    if (IrqlGetCurrent() > oldIrql)
+        IrqlLowerFromInterrupt(oldIrql, (ctx->eflags & (1 << 9)) != 0);
+}
+
+void IntReplayInterrupt(uint8_t vector)
+{
+    // Called by IrqlLower with IF=0 and the IRQL raised to the level of the vector
+    InterruptContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.interrupt = vector;
+    ApicSendEOI(vector);
+    IntStatsVector = vector;
+    IntStatsStart = rdtsc();
+    IntDispatch(&ctx, vector);
+    IntStatsEnd();
 }
 
 void IntSetPicMode(int picMode)
@@ -158,53 +239,118 @@ void IntSetAcpiPicMode()
 
 void IntRegisterCallback(uint32_t interrupt, IntCallbackFn fn, void* ctx)
 {
+    DbgAssert(interrupt < 256);
+    IntCallbackRecord* record = kalloc(sizeof(IntCallbackRecord));
+    record->Function = fn;
+    record->Context = ctx;
+
     uint32_t irqLock = IntEnterCriticalSection();
     {
-        IntCallbackRecord* record = kalloc(sizeof(IntCallbackRecord));
-        record->Interrupt = interrupt;
-        record->Function = fn;
-        record->Context = ctx;
-        SListPushFront(&IntCallbackList, &record->List);
+        record->Next = IntCallbacks[interrupt];
+        IntCallbacks[interrupt] = record;
     }
     IntLeaveCriticalSection(irqLock);
 }
 
-void IntUnregisterCallback(uint32_t interrupt, IntCallbackFn fn)
+static void IntUnregisterCallbackRecord(uint32_t interrupt, IntCallbackFn fn, bool matchContext, void* ctx)
 {
+    DbgAssert(interrupt < 256);
+    IntCallbackRecord* removed = NULL;
     uint32_t irqLock = IntEnterCriticalSection();
     {
-        SListEntry** prevNext = &IntCallbackList.Next;
+        IntCallbackRecord** prevNext = &IntCallbacks[interrupt];
         while (*prevNext)
         {
-            IntCallbackRecord* record = CONTAINING_RECORD(*prevNext, IntCallbackRecord, List);
-            if (record->Interrupt == interrupt && record->Function == fn)
+            IntCallbackRecord* record = *prevNext;
+            if (record->Function == fn && (!matchContext || record->Context == ctx))
             {
-                *prevNext = record->List.Next;
-                kfree(record);
+                *prevNext = record->Next;
+                removed = record;
                 break;
             }
-            prevNext = &record->List.Next;
+            prevNext = &record->Next;
         }
     }
     IntLeaveCriticalSection(irqLock);
+    if (removed)
+        kfree(removed);
+}
+
+void IntUnregisterCallback(uint32_t interrupt, IntCallbackFn fn)
+{
+    IntUnregisterCallbackRecord(interrupt, fn, false, NULL);
 }
 
 void IntUnregisterCallback2(uint32_t interrupt, IntCallbackFn fn, void* ctx)
 {
+    IntUnregisterCallbackRecord(interrupt, fn, true, ctx);
+}
+
+static void IntReserveVector(uint8_t vector)
+{
+    IntVectorsInUse[vector / 32] |= 1 << (vector % 32);
+}
+
+static uint8_t IntReserveFreeVector(irql_t irql)
+{
+    // The local APIC prioritizes interrupts by the upper 4 bits of the vector, which is also how the IRQL maps to
+    // the TPR, so a vector in the band (irql << 4) is masked exactly when running at or above that IRQL. Handlers
+    // run at the IRQL of their vector, so a full band can't spill over into another one.
+    DbgAssert(irql > IRQL_STANDARD && irql < IRQL_EXCLUSIVE);
+    for (uint32_t candidate = irql << 4; candidate < (uint32_t)(irql + 1) << 4; candidate++)
+    {
+        if ((IntVectorsInUse[candidate / 32] & (1 << (candidate % 32))) == 0)
+        {
+            IntReserveVector(candidate);
+            return candidate;
+        }
+    }
+    return 0;
+}
+
+uint8_t IntAllocateVector(irql_t irql)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    uint8_t vector = IntReserveFreeVector(irql);
+    IntLeaveCriticalSection(irqLock);
+    if (vector == 0)
+        TmPrintfWrn("No free interrupt vectors at IRQL %u\n", irql);
+    return vector;
+}
+
+uint8_t IntAllocateSharedVector(irql_t irql)
+{
+    // For sources whose callbacks cope with being called for another source's interrupt (MSI, MSI-X). Once the
+    // band is full the vector with the fewest owners is handed out again, callbacks on it are chained.
     uint32_t irqLock = IntEnterCriticalSection();
+    uint8_t vector = IntReserveFreeVector(irql);
+    if (vector == 0)
     {
-        SListEntry** prevNext = &IntCallbackList.Next;
-        while (*prevNext)
+        for (uint32_t candidate = irql << 4; candidate < (uint32_t)(irql + 1) << 4; candidate++)
         {
-            IntCallbackRecord* record = CONTAINING_RECORD(*prevNext, IntCallbackRecord, List);
-            if (record->Interrupt == interrupt && record->Function == fn && record->Context == ctx)
-            {
-                *prevNext = record->List.Next;
-                kfree(record);
-                break;
-            }
-            prevNext = &record->List.Next;
+            if (IntVectorUsers[candidate] != 0 && IntVectorUsers[candidate] != 0xFF &&
+                (vector == 0 || IntVectorUsers[candidate] < IntVectorUsers[vector]))
+                vector = candidate;
         }
+        if (vector != 0)
+            TmPrintfVrb("No free interrupt vectors at IRQL %u, sharing ISR%02Xh\n", irql, vector);
+    }
+    if (vector != 0)
+        IntVectorUsers[vector]++;
+    IntLeaveCriticalSection(irqLock);
+    if (vector == 0)
+        TmPrintfWrn("No free interrupt vectors at IRQL %u\n", irql);
+    return vector;
+}
+
+void IntFreeVector(uint8_t vector)
+{
+    DbgAssert(vector >= 0x30 && vector != 0xFF);
+    uint32_t irqLock = IntEnterCriticalSection();
+    if (IntVectorUsers[vector] == 0 || --IntVectorUsers[vector] == 0)
+    {
+        DbgAssert(IntCallbacks[vector] == NULL);
+        IntVectorsInUse[vector / 32] &= ~(1 << (vector % 32));
     }
     IntLeaveCriticalSection(irqLock);
 }
@@ -224,6 +370,53 @@ void IntFinishDeferPageFaults()
     IntPageFaultsDeferred = 0;
 }
 
+void IntDebugDump()
+{
+    // Copy under the lock, print without it
+    static IntVectorStats snapshot[256];
+    uint32_t irqLock = IntEnterCriticalSection();
+    memcpy(snapshot, IntStats, sizeof(snapshot));
+    IntLeaveCriticalSection(irqLock);
+
+    TmPrintf("    INTERRUPTS:    vec  count       avg ns      max ns   histogram (<= ns: count)\n");
+    for (int vector = 0; vector < 256; vector++)
+    {
+        IntVectorStats* stats = &snapshot[vector];
+        if (stats->Count == 0)
+            continue;
+        TmPrintf("                   %02Xh  %-10llu  %-10llu  %-10llu", vector, stats->Count,
+                 ClockCyclesToNs(stats->TotalCycles / stats->Count), ClockCyclesToNs(stats->MaxCycles));
+        for (int bucket = 0; bucket < INT_STATS_BUCKETS; bucket++)
+        {
+            if (stats->Histogram[bucket] != 0)
+                TmPrintf(" %llu:%u", ClockCyclesToNs(2ull << bucket), stats->Histogram[bucket]);
+        }
+        TmPrintf("\n");
+    }
+}
+
+void IntExportStats()
+{
+    static IntVectorStats snapshot[256];
+    uint32_t irqLock = IntEnterCriticalSection();
+    memcpy(snapshot, IntStats, sizeof(snapshot));
+    IntLeaveCriticalSection(irqLock);
+
+    // One line per vector, histogram buckets are counts of handlers that took [2^i, 2^(i+1)) TSC cycles
+    ComPrintf("INTSTATS,vector,count,total_ns,max_ns,tsc_hz,buckets[%u]\n", INT_STATS_BUCKETS);
+    for (int vector = 0; vector < 256; vector++)
+    {
+        IntVectorStats* stats = &snapshot[vector];
+        if (stats->Count == 0)
+            continue;
+        ComPrintf("INTSTATS,%u,%llu,%llu,%llu,%llu", vector, stats->Count, ClockCyclesToNs(stats->TotalCycles),
+                  ClockCyclesToNs(stats->MaxCycles), TscFrequency);
+        for (int bucket = 0; bucket < INT_STATS_BUCKETS; bucket++)
+            ComPrintf(",%u", stats->Histogram[bucket]);
+        ComWriteString("\n");
+    }
+}
+
 static void IntSetHandler(uint8_t index, void* offset, uint16_t selector, uint8_t flags)
 {
     uint32_t off = (uint32_t)offset;
@@ -238,7 +431,19 @@ static void IntSetHandler(uint8_t index, void* offset, uint16_t selector, uint8_
 
 void IntInitialize()
 {
-    SListInitialize(&IntCallbackList);
+    IntVectorHandlers[INT0D_CPU_GP_FAULT] = IntHandleGpFault;
+    IntVectorHandlers[INT0E_CPU_PAGE_FAULT] = IntHandlePageFault;
+    IntVectorHandlers[INTXX_APIC_IRQ0] = IntHandleApicIrq0;
+    IntVectorHandlers[INTXX_APIC_TIMER] = IntHandleApicTimer;
+    IntVectorHandlers[INTXX_APIC_IRQ1] = IntHandleApicIrq1;
+
+    // CPU exceptions, the legacy PIC range, the ISA IRQs, the timer and the spurious vector are never handed out
+    for (uint32_t vector = INT00_CPU_DIVIDE_BY_ZERO; vector <= INT2F_PIC_IRQ15; vector++)
+        IntReserveVector(vector);
+    for (uint8_t irq = 0; irq < 16; irq++)
+        IntReserveVector(IntApicIrqToIsr(irq));
+    IntReserveVector(INTXX_APIC_TIMER);
+    IntReserveVector(0xFF);
 
     IntSetHandler(0, Isr00, 0x08, 0x8E);
     IntSetHandler(1, Isr01, 0x08, 0x8E);
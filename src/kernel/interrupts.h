@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "irql.h"
 #include "debug.h"
 
 #define INT00_CPU_DIVIDE_BY_ZERO             0x00
@@ -114,6 +115,13 @@ void IntUnregisterCallback(uint32_t interrupt, IntCallbackFn fn);
 void IntUnregisterCallback2(uint32_t interrupt, IntCallbackFn fn, void* ctx);
 void IntBeginDeferPageFaults();
 void IntFinishDeferPageFaults();
+uint8_t IntAllocateVector(irql_t irql);
+uint8_t IntAllocateSharedVector(irql_t irql);
+void IntFreeVector(uint8_t vector);
+void IntReplayInterrupt(uint8_t vector);
+void IntStatsEnd();
+void IntDebugDump();
+void IntExportStats();
 
 static inline uint8_t IntApicIrqToIsr(uint8_t irq)
 {
@@ -141,30 +149,4 @@ static inline uint8_t IntApicIrqToIsr(uint8_t irq)
     }
 }
 
-static inline uint8_t IntIsrToApicIrq(uint8_t isr)
-{
-    switch (isr)
-    {
-    case INTXX_APIC_IRQ0: return 0;
-    case INTXX_APIC_IRQ1: return 1;
-    case INTXX_APIC_IRQ2: return 2;
-    case INTXX_APIC_IRQ3: return 3;
-    case INTXX_APIC_IRQ4: return 4;
-    case INTXX_APIC_IRQ5: return 5;
-    case INTXX_APIC_IRQ6: return 6;
-    case INTXX_APIC_IRQ7: return 7;
-    case INTXX_APIC_IRQ8: return 8;
-    case INTXX_APIC_IRQ9: return 9;
-    case INTXX_APIC_IRQ10: return 10;
-    case INTXX_APIC_IRQ11: return 11;
-    case INTXX_APIC_IRQ12: return 12;
-    case INTXX_APIC_IRQ13: return 13;
-    case INTXX_APIC_IRQ14: return 14;
-    case INTXX_APIC_IRQ15: return 15;
-    default:
-        DbgUnreachableCase(isr);
-        return 0;
-    }
-}
-
 #endif
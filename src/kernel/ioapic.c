@@ -1,6 +1,7 @@
 #include <acpi/acpi.h>
 #include "apic.h"
 #include "debug.h"
+#include "irql.h"
 #include "ioapic.h"
 #include "memory.h"
 #include "textmode.h"
@@ -8,7 +9,7 @@
 
 // Terminology used in this source file:
 // IRQ - Interrupt Request         - ISA standard IRQ0-IRQ15 (timer, keyboard, etc)
-// GSI - Global System Interrupt   - IOAPIC input pin number
+// GSI - Global System Interrupt   - IOAPIC input pin, numbered across all IOAPICs starting at their GlobalIrqBase
 // ISR - Interrupt Service Routine - CPU interrupt code
 
 #define IOAPIC_MMIO_OFF_REGSEL 0x00 // IOAPIC Register Select - this selects the register to be read/written using WINDOW
@@ -19,20 +20,55 @@
 #define IOAPIC_REG_ARB         0x02 // IOAPIC Arbitration ID
 #define IOAPIC_REG_TABLE       0x10 // IOAPIC Redirection Table
 
-static volatile uint32_t* IoApicBase = (uint32_t*)0;
-static uint32_t IoApicMaxEntries = 0;
-static int IoApicIrqToGsiMap[16] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+#define IOAPIC_MAX_CONTROLLERS 8
+#define IOAPIC_ENTRY_MASKED    (1 << 16)
 
-static inline uint32_t IoApicRead(uint32_t reg)
+typedef struct IoApicController_s
 {
-   IoApicBase[0] = (reg & 0xff);
-   return IoApicBase[4];
+    volatile uint32_t* Base;
+    uint8_t Id;
+    uint32_t GsiBase;
+    uint32_t NumPins;
+} IoApicController;
+
+typedef struct IoApicIsaRoute_s
+{
+    uint32_t Gsi;
+    uint16_t IntiFlags;
+    bool Overridden;
+} IoApicIsaRoute;
+
+// Interrupt topology, parsed from the MADT once by IoApicInitialize
+static IoApicController IoApicControllers[IOAPIC_MAX_CONTROLLERS];
+static uint32_t IoApicNumControllers = 0;
+static uint32_t IoApicNumGsis = 0;
+static IoApicIsaRoute IoApicIsaRoutes[16];
+
+// Routing state, each GSI fires at most one vector and each vector belongs to at most one GSI
+static uint8_t* IoApicGsiVectors = NULL;
+static int16_t IoApicVectorToGsi[256];
+
+static inline uint32_t IoApicRead(IoApicController* ioapic, uint32_t reg)
+{
+   ioapic->Base[0] = (reg & 0xff);
+   return ioapic->Base[4];
 }
  
-static inline void IoApicWrite(uint32_t reg, uint32_t value)
+static inline void IoApicWrite(IoApicController* ioapic, uint32_t reg, uint32_t value)
 {
-   IoApicBase[0] = (reg & 0xff);
-   IoApicBase[4] = value;
+   ioapic->Base[0] = (reg & 0xff);
+   ioapic->Base[4] = value;
+}
+
+static IoApicController* IoApicFindController(uint32_t gsi)
+{
+    for (uint32_t i = 0; i < IoApicNumControllers; i++)
+    {
+        IoApicController* ioapic = &IoApicControllers[i];
+        if (gsi >= ioapic->GsiBase && gsi < ioapic->GsiBase + ioapic->NumPins)
+            return ioapic;
+    }
+    return NULL;
 }
 
 static bool IoApicDeterminePolarity(uint8_t bus, uint32_t intiFlags)
@@ -63,78 +99,109 @@ static bool IoApicDetermineTrigger(uint8_t bus, uint32_t intiFlags)
     }
 }
 
-static void IoApicWriteEntry(uint8_t gsi, uint8_t cpu, uint8_t isr, uint8_t bus, uint32_t intiFlags, bool mask)
+static void IoApicWriteEntry(uint32_t gsi, uint8_t cpu, uint8_t isr, bool activeLow, bool levelTriggered, bool mask)
+{
+    IoApicController* ioapic = IoApicFindController(gsi);
+    DbgAssertMsg(ioapic != NULL, "no IOAPIC handles GSI %u", gsi);
+    uint32_t reg = IOAPIC_REG_TABLE + ((gsi - ioapic->GsiBase) * 2);
+    uint32_t loBits = isr | (0b000 << 8) | ((uint32_t)activeLow << 13) | ((uint32_t)levelTriggered << 15) | (mask ? IOAPIC_ENTRY_MASKED : 0);
+    uint32_t hiBits = (uint32_t)cpu << 24;
+    IoApicWrite(ioapic, reg + 1, hiBits);
+    IoApicWrite(ioapic, reg + 0, loBits);
+}
+
+static void IoApicRouteGsi(uint32_t gsi, uint8_t isr, bool activeLow, bool levelTriggered)
+{
+    uint8_t oldIsr = IoApicGsiVectors[gsi];
+    if (oldIsr != 0 && oldIsr != isr)
+        IoApicVectorToGsi[oldIsr] = -1;
+    IoApicGsiVectors[gsi] = isr;
+    IoApicVectorToGsi[isr] = gsi;
+    IoApicWriteEntry(gsi, ApicGetId(), isr, activeLow, levelTriggered, false);
+}
+
+static void IoApicSetMasked(uint8_t isr, bool masked)
 {
-    uint32_t reg = IOAPIC_REG_TABLE + (gsi * 2);
-    uint32_t pol = IoApicDeterminePolarity(bus, intiFlags);
-    uint32_t trg = IoApicDetermineTrigger(bus, intiFlags);
-    uint32_t loBits = isr | (0b000 << 8) | (pol << 13) | (trg << 15) | (mask << 16);
-    uint32_t hiBits = cpu << 24;
-    IoApicWrite(reg + 1, hiBits);
-    IoApicWrite(reg + 0, loBits);
+    int32_t gsi = IoApicVectorToGsi[isr];
+    if (gsi == -1)
+        return;
+    IoApicController* ioapic = IoApicFindController(gsi);
+    uint32_t reg = IOAPIC_REG_TABLE + ((gsi - ioapic->GsiBase) * 2);
+    uint32_t loBits = IoApicRead(ioapic, reg + 0);
+    loBits = masked ? loBits | IOAPIC_ENTRY_MASKED : loBits & ~IOAPIC_ENTRY_MASKED;
+    IoApicWrite(ioapic, reg + 0, loBits);
+    TmPrintfVrb("%s ISR%02Xh with IOAPIC (id=%u, gsi=%u)\n", masked ? "Masked" : "Unmasked", isr, ioapic->Id, gsi);
 }
 
-static void IoApicMapIRQ(ACPI_TABLE_MADT* madt, uint8_t gsi, uint8_t defaultIrq)
+static void IoApicParseMadt(ACPI_TABLE_MADT* madt)
 {
-    uint8_t actualIrq = defaultIrq;
-    uint32_t intiFlags = 0;
+    for (uint8_t irq = 0; irq < 16; irq++)
+    {
+        IoApicIsaRoutes[irq].Gsi = irq;
+        IoApicIsaRoutes[irq].IntiFlags = 0;
+        IoApicIsaRoutes[irq].Overridden = false;
+    }
 
     ACPI_SUBTABLE_HEADER* entryHdr = (ACPI_SUBTABLE_HEADER*)(madt + 1);
     ACPI_SUBTABLE_HEADER* tableEnd = (ACPI_SUBTABLE_HEADER*)((uint8_t*)madt + madt->Header.Length);
     while (entryHdr < tableEnd)
     {
-        ACPI_MADT_INTERRUPT_OVERRIDE* entry = (ACPI_MADT_INTERRUPT_OVERRIDE*)entryHdr;
-        if (entryHdr->Type == ACPI_MADT_TYPE_INTERRUPT_OVERRIDE && entry->Bus == 0 /* ISA bus */)
+        if (entryHdr->Type == ACPI_MADT_TYPE_IO_APIC)
         {
-            if (entry->SourceIrq == defaultIrq && entry->GlobalIrq != gsi)
-                return; // This ISA IRQ is mapped to a different GSI
+            ACPI_MADT_IO_APIC* entry = (ACPI_MADT_IO_APIC*)entryHdr;
+            DbgAssertMsg(IoApicNumControllers < IOAPIC_MAX_CONTROLLERS, "at most %u IOAPICs supported", IOAPIC_MAX_CONTROLLERS);
 
-            if (entry->GlobalIrq == gsi)
+            IoApicController* ioapic = &IoApicControllers[IoApicNumControllers++];
+            ioapic->Base = VirtAlloc(entry->Address, 1, VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE, VIRT_REGION_TYPE_HARDWARE, "IOAPIC");
+            PhysMark(entry->Address, 1, PHYS_REGION_TYPE_CPU_IO_APIC, "IOAPIC");
+            ioapic->Id = entry->Id;
+            ioapic->GsiBase = entry->GlobalIrqBase;
+            ioapic->NumPins = ((IoApicRead(ioapic, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+            if (ioapic->GsiBase + ioapic->NumPins > IoApicNumGsis)
+                IoApicNumGsis = ioapic->GsiBase + ioapic->NumPins;
+            TmPrintfDbg("Found IOAPIC (id=%u, addr=%p, gsi=%u-%u)\n", ioapic->Id, ioapic->Base, ioapic->GsiBase, ioapic->GsiBase + ioapic->NumPins - 1);
+        }
+        else if (entryHdr->Type == ACPI_MADT_TYPE_INTERRUPT_OVERRIDE)
+        {
+            ACPI_MADT_INTERRUPT_OVERRIDE* entry = (ACPI_MADT_INTERRUPT_OVERRIDE*)entryHdr;
+            if (entry->Bus == 0 /* ISA bus */ && entry->SourceIrq < 16)
             {
-                actualIrq = entry->SourceIrq;
-                intiFlags = entry->IntiFlags;
-                break;
+                IoApicIsaRoutes[entry->SourceIrq].Gsi = entry->GlobalIrq;
+                IoApicIsaRoutes[entry->SourceIrq].IntiFlags = entry->IntiFlags;
+                IoApicIsaRoutes[entry->SourceIrq].Overridden = true;
             }
         }
         entryHdr = (ACPI_SUBTABLE_HEADER*)((uint8_t*)entryHdr + entryHdr->Length);
     }
+}
 
-    uint8_t isr = IntApicIrqToIsr(actualIrq);
-    TmPrintfVrb("Mapping IRQ%u to IOAPIC pin %02Xh firing ISR%02Xh\n", actualIrq, gsi, isr);
-    IoApicIrqToGsiMap[actualIrq] = gsi;
-    IoApicWriteEntry(gsi, /* CPU LAPIC ID */ 0x00, isr, /* ISA bus */ 0, intiFlags, false);
+static bool IoApicIsaGsiTaken(uint8_t irq)
+{
+    // An identity mapped ISA IRQ loses its pin when another IRQ is overridden onto it (usually IRQ0 onto GSI2)
+    if (IoApicIsaRoutes[irq].Overridden)
+        return false;
+    for (uint8_t other = 0; other < 16; other++)
+        if (other != irq && IoApicIsaRoutes[other].Overridden && IoApicIsaRoutes[other].Gsi == IoApicIsaRoutes[irq].Gsi)
+            return true;
+    return false;
 }
 
 bool IoApicInitialize()
 {
     ACPI_TABLE_MADT* madt = NULL;
     DbgAssert(ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_MADT, 0, (ACPI_TABLE_HEADER**)&madt)));
+    IoApicParseMadt(madt);
 
-    ACPI_SUBTABLE_HEADER* entryHdr = (ACPI_SUBTABLE_HEADER*)(madt + 1);
-    ACPI_SUBTABLE_HEADER* tableEnd = (ACPI_SUBTABLE_HEADER*)((uint8_t*)madt + madt->Header.Length);
-    while (entryHdr < tableEnd)
-    {
-        if (entryHdr->Type == ACPI_MADT_TYPE_IO_APIC)
-        {
-            ACPI_MADT_IO_APIC* entry = (ACPI_MADT_IO_APIC*)entryHdr;
-            DbgAssertMsg(IoApicBase == NULL, "only 1 IOAPIC supported");
-            DbgAssertMsg(entry->GlobalIrqBase == 0, "IOAPIC must have global IRQ base 0, got %u", entry->GlobalIrqBase);
-
-            IoApicBase = VirtAlloc(entry->Address, 1, VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE, VIRT_REGION_TYPE_HARDWARE, "IOAPIC");
-            PhysMark(entry->Address, 1, PHYS_REGION_TYPE_CPU_IO_APIC, "IOAPIC");
-
-            IoApicMaxEntries = ((IoApicRead(IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
-            TmPrintfDbg("Found IOAPIC (addr=%p, pins=%u)\n", IoApicBase, IoApicMaxEntries);
-        }
-        entryHdr = (ACPI_SUBTABLE_HEADER*)((uint8_t*)entryHdr + entryHdr->Length);
-    }
-
-    if (IoApicBase == NULL || IoApicMaxEntries == 0)
+    if (IoApicNumControllers == 0 || IoApicNumGsis == 0)
     {
         TmPrintfErr("No IOAPIC found!\n");
         return false;
     }
 
+    IoApicGsiVectors = kcalloc(IoApicNumGsis);
+    for (uint32_t isr = 0; isr < 256; isr++)
+        IoApicVectorToGsi[isr] = -1;
+
     // Systems that support both APIC and dual 8259 interrupt models must map global system interrupts
     // 0-15 to the 8259 IRQs 0-15, except where Interrupt Source Overrides are provided (see
     // Section 5.2.12.5, "Interrupt Source Override Structure" below). This means that I/O APIC interrupt
@@ -142,23 +209,24 @@ bool IoApicInitialize()
     // IRQs 0-15 unless overrides are used.
     uint32_t irqLock = IntEnterCriticalSection();
     {
-        // TODO: This might not be the correct flow, instead build IRQ to GSI map first?
-        IoApicMapIRQ(madt, 0, 0);
-        IoApicMapIRQ(madt, 1, 1);
-        IoApicMapIRQ(madt, 2, 2);
-        IoApicMapIRQ(madt, 3, 3);
-        IoApicMapIRQ(madt, 4, 4);
-        IoApicMapIRQ(madt, 5, 5);
-        IoApicMapIRQ(madt, 6, 6);
-        IoApicMapIRQ(madt, 7, 7);
-        IoApicMapIRQ(madt, 8, 8);
-        IoApicMapIRQ(madt, 9, 9);
-        IoApicMapIRQ(madt, 10, 10);
-        IoApicMapIRQ(madt, 11, 11);
-        IoApicMapIRQ(madt, 12, 12);
-        IoApicMapIRQ(madt, 13, 13);
-        IoApicMapIRQ(madt, 14, 14);
-        IoApicMapIRQ(madt, 15, 15);
+        // Start with every pin masked, firmware may have left stale entries behind
+        for (uint32_t i = 0; i < IoApicNumControllers; i++)
+        {
+            IoApicController* ioapic = &IoApicControllers[i];
+            for (uint32_t pin = 0; pin < ioapic->NumPins; pin++)
+                IoApicWriteEntry(ioapic->GsiBase + pin, 0, 0, false, false, true);
+        }
+
+        // ISA IRQs keep their fixed vectors, everything else is allocated on demand by IoApicMapGsi
+        for (uint8_t irq = 0; irq < 16; irq++)
+        {
+            IoApicIsaRoute* route = &IoApicIsaRoutes[irq];
+            if (IoApicIsaGsiTaken(irq) || IoApicFindController(route->Gsi) == NULL)
+                continue;
+            uint8_t isr = IntApicIrqToIsr(irq);
+            TmPrintfVrb("Mapping IRQ%u to GSI %u firing ISR%02Xh\n", irq, route->Gsi, isr);
+            IoApicRouteGsi(route->Gsi, isr, IoApicDeterminePolarity(0, route->IntiFlags), IoApicDetermineTrigger(0, route->IntiFlags));
+        }
         IoApicMaskIRQ(INTXX_APIC_IRQ0);
     }
     IntLeaveCriticalSection(irqLock);
@@ -166,32 +234,42 @@ bool IoApicInitialize()
     return true;
 }
 
+uint8_t IoApicMapGsi(uint32_t gsi, irql_t irql, bool activeLow, bool levelTriggered)
+{
+    if (gsi >= IoApicNumGsis || IoApicFindController(gsi) == NULL)
+    {
+        TmPrintfErr("GSI %u isn't connected to any IOAPIC\n", gsi);
+        return 0;
+    }
+
+    uint32_t irqLock = IntEnterCriticalSection();
+    uint8_t isr = IoApicGsiVectors[gsi];
+    if (isr != 0)
+    {
+        // Already routed (an ISA IRQ or another device on the same line), the line is shared and keeps its vector
+        TmPrintfVrb("GSI %u is shared, keeping ISR%02Xh\n", gsi, isr);
+    }
+    else
+    {
+        isr = IntAllocateVector(irql);
+        if (isr == 0)
+        {
+            IntLeaveCriticalSection(irqLock);
+            return 0;
+        }
+        TmPrintfVrb("Mapping GSI %u to ISR%02Xh\n", gsi, isr);
+    }
+    IoApicRouteGsi(gsi, isr, activeLow, levelTriggered);
+    IntLeaveCriticalSection(irqLock);
+    return isr;
+}
+
 void IoApicMaskIRQ(uint8_t isr)
 {
-    uint32_t irq = IntIsrToApicIrq(isr);
-    int32_t gsi = IoApicIrqToGsiMap[irq];
-    if (gsi == -1)
-        return;
-    uint32_t reg = IOAPIC_REG_TABLE + (gsi * 2);
-    uint32_t hiBits = IoApicRead(reg + 1);
-    uint32_t loBits = IoApicRead(reg + 0);
-    loBits |= 1 << 16;
-    IoApicWrite(reg + 1, hiBits);
-    IoApicWrite(reg + 0, loBits);
-    TmPrintfVrb("Masked IRQ%u with IOAPIC (ISR%02Xh, pin=%02Xh)\n", irq, isr, gsi);
+    IoApicSetMasked(isr, true);
 }
 
 void IoApicUnmaskIRQ(uint8_t isr)
 {
-    uint32_t irq = IntIsrToApicIrq(isr);
-    int32_t gsi = IoApicIrqToGsiMap[irq];
-    if (gsi == -1)
-        return;
-    uint32_t reg = IOAPIC_REG_TABLE + (gsi * 2);
-    uint32_t hiBits = IoApicRead(reg + 1);
-    uint32_t loBits = IoApicRead(reg + 0);
-    loBits &= ~(1 << 16);
-    IoApicWrite(reg + 1, hiBits);
-    IoApicWrite(reg + 0, loBits);
-    TmPrintfVrb("Unmasked IRQ%u with IOAPIC (ISR%02Xh, pin=%02Xh)\n", irq, isr, gsi);
+    IoApicSetMasked(isr, false);
 }
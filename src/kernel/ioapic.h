@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "irql.h"
 
 bool IoApicInitialize();
+uint8_t IoApicMapGsi(uint32_t gsi, irql_t irql, bool activeLow, bool levelTriggered);
 void IoApicMaskIRQ(uint8_t isr);
 void IoApicUnmaskIRQ(uint8_t isr);
 
@@ -1,37 +1,135 @@
+#include "dpc.h"
 #include "irql.h"
 #include "apic.h"
 #include "debug.h"
-#include "textmode.h"
+#include "lowlevel.h"
 #include "interrupts.h"
 
+// IRQL is lazy: raising it only updates IrqlCurrent. The TPR is programmed when an interrupt arrives at a masked
+// level, that interrupt is left in service (no EOI) and replayed once the IRQL drops below its level.
 irql_t IrqlCurrent = IRQL_STANDARD;
+static irql_t IrqlHardware = IRQL_STANDARD;   // Level programmed into the TPR, never above IrqlCurrent
+static volatile uint32_t IrqlDeferredMask = 0; // Bit n set if interrupts or software requests at IRQL n are waiting
+static uint16_t IrqlDeferredVectors[16];       // Deferred vectors of each IRQL, bit n is vector (irql << 4) + n
+static uint32_t IrqlSoftwareRequests = 0;      // Bit n set if a software request at IRQL n is waiting
+static uint32_t IrqlExclusiveLock;
 
-static const char* IrqlName(irql_t irql)
+#define IRQL_EFLAGS_IF (1 << 9)
+
+void IrqlDeferInterrupt(uint8_t vector)
 {
-    switch (irql)
+    // Called from the interrupt handler with IF=0
+    irql_t level = IrqlFromVector(vector);
+    DbgAssert(level <= IrqlCurrent);
+    IrqlDeferredVectors[level] |= 1 << (vector & 0xF);
+    IrqlDeferredMask |= 1 << level;
+    if (IrqlHardware < IrqlCurrent)
     {
-    case IRQL_STANDARD:  return "IRQL_STANDARD";
-    case IRQL_SCHEDULER: return "IRQL_SCHEDULER";
-    case IRQL_DEVICE_LO: return "IRQL_DEVICE_LO";
-    case IRQL_DEVICE_HI: return "IRQL_DEVICE_HI";
-    case IRQL_EXCLUSIVE: return "IRQL_EXCLUSIVE";
-    default:
-        DbgUnreachableCase(irql);
-        return NULL;
+        ApicSetTPR(IrqlCurrent << 4);
+        IrqlHardware = IrqlCurrent;
     }
 }
 
-irql_t IrqlSetCurrent(irql_t level)
+void IrqlRequestSoftware(irql_t level)
 {
-    DbgAssert(level >= IRQL_STANDARD && level <= IRQL_EXCLUSIVE);
+    // Software requests (only DPCs at IRQL_SCHEDULER for now) run the next time the IRQL drops below their level
+    DbgAssert(level == IRQL_SCHEDULER);
     uint32_t lock = IntEnterCriticalSection();
+    IrqlSoftwareRequests |= 1 << level;
+    IrqlDeferredMask |= 1 << level;
+    IntLeaveCriticalSection(lock);
+    if (IrqlCurrent < level)
+        IrqlLower(IrqlRaise(level));
+}
+
+static void IrqlReplayDeferred(irql_t level, bool interruptible)
+{
+    // Highest vector first, which is also the order the APIC expects the EOIs of the in-service vectors in.
+    // Software requests of a level run after its interrupts.
+    while ((IrqlDeferredMask >> (level + 1)) != 0)
+    {
+        irql_t pending = bsr(IrqlDeferredMask);
+        uint8_t vector = 0;
+        if (IrqlDeferredVectors[pending] != 0)
+        {
+            vector = (pending << 4) | bsr(IrqlDeferredVectors[pending]);
+            IrqlDeferredVectors[pending] &= ~(1 << (vector & 0xF));
+        }
+        else
+            IrqlSoftwareRequests &= ~(1 << pending);
+        if (IrqlDeferredVectors[pending] == 0 && (IrqlSoftwareRequests & (1 << pending)) == 0)
+            IrqlDeferredMask &= ~(1 << pending);
+
+        IrqlCurrent = pending;
+        if (vector != 0)
+            IntReplayInterrupt(vector);
+        else
+            DpcDrain(interruptible);
+        // A replayed timer tick can switch tasks, and this task resumes with IF=1. The deferred state is only
+        // protected by IF, so it goes back off before the next round.
+        IntDisableIRQs();
+        IrqlCurrent = level;
+    }
+}
+
+irql_t IrqlRaise(irql_t level)
+{
     irql_t oldLevel = IrqlCurrent;
-    if (oldLevel != level)
+    DbgAssert(level >= oldLevel && level <= IRQL_EXCLUSIVE);
+    if (level == IRQL_EXCLUSIVE && oldLevel != IRQL_EXCLUSIVE)
+        IrqlExclusiveLock = IntEnterCriticalSection();
+    IrqlCurrent = level;
+    asm volatile("": : :"memory");
+    return oldLevel;
+}
+
+static inline bool IrqlLowerFast(irql_t level, irql_t oldLevel)
+{
+    DbgAssert(level <= oldLevel && level >= IRQL_STANDARD);
+    asm volatile("": : :"memory");
+    IrqlCurrent = level;
+
+    // An interrupt arriving after the store above sees the new level, one that arrived before it left a mark
+    return (IrqlDeferredMask >> (level + 1)) == 0 && IrqlHardware <= level && oldLevel != IRQL_EXCLUSIVE;
+}
+
+static void IrqlLowerSlow(irql_t level, uint32_t lock, bool interruptible)
+{
+    IrqlReplayDeferred(level, interruptible);
+    if (IrqlHardware > level)
     {
-        TmPrintfDbg("Switching to %s from %s\n", IrqlName(level), IrqlName(oldLevel));
         ApicSetTPR(level << 4);
-        IrqlCurrent = level;
+        IrqlHardware = level;
     }
     IntLeaveCriticalSection(lock);
+}
+
+void IrqlLower(irql_t level)
+{
+    irql_t oldLevel = IrqlCurrent;
+    if (IrqlLowerFast(level, oldLevel))
+        return;
+    uint32_t lock = oldLevel == IRQL_EXCLUSIVE ? IrqlExclusiveLock : IntEnterCriticalSection();
+    IrqlLowerSlow(level, lock, (lock & IRQL_EFLAGS_IF) != 0);
+}
+
+void IrqlLowerFromInterrupt(irql_t level, bool interruptible)
+{
+    // IF is clear in the handler, but the interrupted code may have had it set, in which case DPCs can run with
+    // interrupts enabled before we return to it
+    irql_t oldLevel = IrqlCurrent;
+    if (IrqlLowerFast(level, oldLevel))
+        return;
+    IrqlLowerSlow(level, IntEnterCriticalSection(), interruptible);
+}
+
+irql_t IrqlSetCurrent(irql_t level)
+{
+    DbgAssert(level >= IRQL_STANDARD && level <= IRQL_EXCLUSIVE);
+    irql_t oldLevel = IrqlCurrent;
+    if (level >= oldLevel)
+        IrqlRaise(level);
+    else
+        IrqlLower(level);
     return oldLevel;
 }
@@ -1,6 +1,9 @@
 #ifndef KERNEL_IRQL_H
 #define KERNEL_IRQL_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef int irql_t;
 
 extern irql_t IrqlCurrent;
@@ -16,6 +19,17 @@ static inline irql_t IrqlGetCurrent()
     return IrqlCurrent;
 }
 
+static inline irql_t IrqlFromVector(uint8_t vector)
+{
+    // The local APIC priority class of a vector is its upper nibble, the same as the IRQL it is masked by
+    return vector >> 4;
+}
+
+irql_t IrqlRaise(irql_t level);
+void IrqlLower(irql_t level);
+void IrqlLowerFromInterrupt(irql_t level, bool interruptible);
 irql_t IrqlSetCurrent(irql_t level);
+void IrqlDeferInterrupt(uint8_t vector);
+void IrqlRequestSoftware(irql_t level);
 
 #endif
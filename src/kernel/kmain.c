@@ -1,18 +1,24 @@
 #include <string.h>
 #include <acpi/acpi.h>
+#include "dpc.h"
 #include "pci.h"
 #include "pit.h"
 #include "tsc.h"
+#include "hpet.h"
+#include "clock.h"
 #include "pic.h"
 #include "irql.h"
 #include "apic.h"
+#include "bench.h"
 #include "ioapic.h"
 #include "ahci.h"
 #include "debug.h"
 #include "memory.h"
 #include "comport.h"
 #include "lowlevel.h"
+#include "profiler.h"
 #include "textmode.h"
+#include "timer.h"
 #include "scheduler.h"
 #include "interrupts.h"
 #include "drivers/virtio_blk.h"
@@ -27,6 +33,8 @@ static uint32_t kmonitor(void* ctx);
 
 void kinit(uint32_t magic, multiboot_info_t* info)
 {
+    ProfBegin("kinit");
+
     // Initialize text mode
     ComInitialize();
     TmInitialize();
@@ -66,47 +74,89 @@ void kinit(uint32_t magic, multiboot_info_t* info)
     TmPrintf("* Multiboot memory map size: %u bytes\n", info->mmap_length);
 
     TmPrintfInf("\nInitializing interrupt handling...\n");
+    ProfBegin("IntInitialize");
     IntInitialize();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing the PIC...\n");
+    ProfBegin("PicInitialize");
     PicInitialize();
+    ProfEnd();
 
-    TmPrintfInf("\nInitializing the PIT and TSC...\n");
+    TmPrintfInf("\nInitializing the PIT...\n");
+    ProfBegin("PitInitialize");
     PitInitialize(100);
-    TscInitialize();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing memory manager...\n");
+    ProfBegin("MemInitialize");
     MemInitialize(info);
+    ProfEnd();
 
     TmPrintfInf("\nInitializing ACPI tables...\n");
+    ProfBegin("AcpiInitializeTables");
     DbgAssert(ACPI_SUCCESS(AcpiInitializeTables(NULL, 16, FALSE)));
+    ProfEnd();
+
+    TmPrintfInf("\nInitializing the HPET...\n");
+    ProfBegin("HpetInitialize");
+    HpetInitialize();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing local APIC...\n");
+    ProfBegin("ApicInitialize");
     ApicInitialize();
+    ProfEnd();
+
+    // Pass true for a slower (500ms) but more precise calibration
+    TmPrintfInf("\nCalibrating the TSC and local APIC timer...\n");
+    ProfBegin("TscInitialize");
+    TscInitialize(false);
+    ClockInitialize();
+    ApicTimerStartPeriodic(PitFrequency);
+    ProfEnd();
 
     TmPrintfInf("\nInitializing I/O APIC...\n");
+    ProfBegin("IoApicInitialize");
     IoApicInitialize();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing scheduler...\n");
+    ProfBegin("SchInitialize");
+    TimerInitialize();
     SchTask* kidleTask = SchInitialize("kidle");
+    DpcInitialize();
+    PhysZeroInitialize();
+    ProfEnd();
 
     TmPrintfDbg("\nEnabling interrupts!\n");
     IntEnableIRQs();
 
     TmPrintfInf("\nInitializing ACPI...\n");
+    ProfBegin("AcpiInitialize");
+    ProfBegin("AcpiInitializeSubsystem");
     DbgAssert(ACPI_SUCCESS(AcpiInitializeSubsystem()));
+    ProfEnd();
+    ProfBegin("AcpiLoadTables");
     DbgAssert(ACPI_SUCCESS(AcpiLoadTables()));
+    ProfEnd();
+    ProfBegin("AcpiEnableSubsystem");
     DbgAssert(ACPI_SUCCESS(AcpiEnableSubsystem(ACPI_FULL_INITIALIZATION)));
+    ProfEnd();
+    ProfBegin("AcpiInitializeObjects");
     DbgAssert(ACPI_SUCCESS(AcpiInitializeObjects(ACPI_FULL_INITIALIZATION)));
+    ProfEnd();
     IntSetAcpiPicMode();
+    ProfEnd();
 
     TmPrintfInf("\nStarting kernel tasks...\n");
     SchTask* kmainTask = SchCreateTask("kmain", 1024*1024, kmain, NULL);
     SchTask* kmonitorTask = SchCreateTask("kmonitor", 32*1024, kmonitor, NULL);
+    ProfEnd();
 
-    // Hang/idle
-    while (true)
-        asm volatile("hlt");
+    // Become the idle task
+    SchSetPriority(kidleTask, SCH_PRIORITY_IDLE);
+    SchIdle();
 }
 
 static void k_TestAhci(const PciDeviceInfo* info, void* ctx)
@@ -172,6 +222,8 @@ static void k_TestVirtio(const PciDeviceInfo* info, void* ctx)
         DbgAssert(asyncCall.Success && asyncCall.Transferred == sizeof(buf));
         DbgHexdump(buf, 32); TmPutChar('\n');
     }
+
+    DrvVirtioBlk_DebugDump(drv);
 }
 
 typedef struct TestEntry
@@ -215,11 +267,22 @@ static uint32_t test_Consumer(void* ctx)
 
 static uint32_t kmain(void* ctx)
 {
+#ifdef KERNEL_BENCHMARKS
+    TmPrintfInf("\nRunning benchmarks...\n");
+    BenchRunAll();
+#endif
+
     TmPrintfInf("\nTesting PCI stuff...\n");
+    ProfBegin("PciDiscoverDevices");
     PciInitialize();
   //PciRegisterDiscoverCallback(k_TestAhci, NULL);
     PciRegisterDiscoverCallback(k_TestVirtio, NULL);
     PciDiscoverDevices();
+    ProfEnd();
+
+    TmPrintfInf("\nBoot profile...\n");
+    ProfDump();
+    ProfExport();
     SchSleep(5000);
 
     TmPrintfInf("\nTesting IRQL stuff...\n");
@@ -246,19 +309,11 @@ static uint32_t kmonitor(void* ctx)
     SchSleep(10 * 1000);
     while (true)
     {
-        uint32_t irqLock = IntEnterCriticalSection();
         TmPushColor(TM_COLOR_LTBLUE, TM_COLOR_BLACK);
-        {
-            TmPrintf("    T%llu    ACTIVE TASKS:    ", PitCurrentTick);
-            SchTask* task = SchCurrentTask;
-            do
-            {
-                TmPrintf(task->next == SchCurrentTask ? "%s\n" : "%s, ", task->name);
-                task = task->next;
-            } while (task != SchCurrentTask);
-        }
+        SchDebugDump();
+        IntDebugDump();
         TmPopColor();
-        IntLeaveCriticalSection(irqLock);
+        IntExportStats();
         SchSleep(2500);
     }
 
@@ -23,6 +23,12 @@ static inline void pg_flushtlb(uintptr_t addr)
     asm volatile("invlpg (%0)":: "r"(addr): "memory");
 }
 
+static inline void pg_flushall()
+{
+    uintptr_t cr3Value;
+    asm volatile("mov %%cr3, %0; mov %0, %%cr3": "=r"(cr3Value):: "memory");
+}
+
 static inline uint64_t rdtsc()
 {
     uint64_t ret;
@@ -30,6 +36,20 @@ static inline uint64_t rdtsc()
     return ret;
 }
 
+static inline uint32_t bsf(uint32_t value)
+{
+    uint32_t index;
+    asm("bsf %1, %0": "=r"(index): "rm"(value));
+    return index;
+}
+
+static inline uint32_t bsr(uint32_t value)
+{
+    uint32_t index;
+    asm("bsr %1, %0": "=r"(index): "rm"(value));
+    return index;
+}
+
 static inline uint64_t rdmsr(uint32_t msrId)
 {
     uint64_t msrValue;
@@ -49,6 +69,18 @@ static inline void* rdcr2()
     return cr2Value;
 }
 
+static inline uint32_t rdcr4()
+{
+    uint32_t cr4Value;
+    asm volatile("mov %%cr4, %0": "=r"(cr4Value));
+    return cr4Value;
+}
+
+static inline void wrcr4(uint32_t cr4Value)
+{
+    asm volatile("mov %0, %%cr4":: "r"(cr4Value): "memory");
+}
+
 static inline uint8_t inb(uint16_t __port)
 {
     uint8_t _v;
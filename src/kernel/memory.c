@@ -1,26 +1,38 @@
 #include "memory.h"
+#include "profiler.h"
 #include "textmode.h"
 
 void MemInitialize(multiboot_info_t* info)
 {
     TmPrintfInf("\nInitializing physical memory manager (early)...\n");
+    ProfBegin("PhysInitializeEarly");
     PhysInitializeEarly(info);
+    ProfEnd();
 
     TmPrintfInf("\nInitializing virtual memory manager (early)...\n");
+    ProfBegin("VirtInitializeEarly");
     VirtInitializeEarly();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing kernel heap...\n");
+    ProfBegin("KHeapInitialize");
     KHeapInitialize();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing physical memory manager (full)...\n");
+    ProfBegin("PhysInitializeFull");
     PhysInitializeFull();
+    ProfEnd();
 
     TmPrintfInf("\nInitializing virtual memory manager (full)...\n");
+    ProfBegin("VirtInitializeFull");
     VirtInitializeFull();
+    ProfEnd();
 }
 
 void MemDebugDump()
 {
     PhysDebugDump();
+    PhysZeroDebugDump();
     VirtDebugDump();
 }
@@ -58,6 +58,7 @@ void MemDebugDump();
 #define PHYS_REGION_TYPE_KERNEL_PAGE_DIR     402
 #define PHYS_REGION_TYPE_KERNEL_HEAP         403
 #define PHYS_REGION_TYPE_KERNEL_TASK_STACK   404
+#define PHYS_REGION_TYPE_KERNEL_PAGE_FRAMES  405
 
 #define PHYS_REGION_TYPE_HARDWARE            500
 
@@ -65,6 +66,25 @@ void MemDebugDump();
 #define PHYS_REGION_TYPE_USER_STACK          601
 #define PHYS_REGION_TYPE_USER_IMAGE          602
 
+#define PHYS_BUDDY_ORDERS 12 // Buddy blocks of 1 page up to 2048 pages (8 MiB)
+
+#define PHYS_PAGE_FLAG_FREE     (1 << 0) // First page of a free buddy block
+#define PHYS_PAGE_FLAG_ALLOC    (1 << 1) // Allocated with PhysAlloc
+#define PHYS_PAGE_FLAG_HEAD     (1 << 2) // First page of an allocation
+#define PHYS_PAGE_FLAG_RESERVED (1 << 3) // Firmware, hardware, or in use before the buddy allocator was set up
+#define PHYS_PAGE_FLAG_CACHED   (1 << 4) // Free, sitting in a per-CPU page cache
+
+typedef struct
+{
+    uint32_t Next;     // Free buddy block: next and previous free block of the same order
+    uint32_t Prev;
+    const char* Owner; // Description of the allocation or region
+    uint16_t Type;     // PHYS_REGION_TYPE_*
+    uint16_t RefCount;
+    uint8_t Order;     // Free buddy block: order of the block
+    uint8_t Flags;
+} PhysPage;
+
 typedef struct
 {
     ListEntry ListEntry;
@@ -82,11 +102,40 @@ void PhysDebugDump();
 void PhysMark(kphys_t start, size_t pages, int type, const char* description);
 kphys_t PhysAlloc(size_t pages, int type, const char* description);
 void PhysFree(kphys_t start);
+void PhysFreeRange(kphys_t start, size_t pages);
+void PhysFreeBoot(kphys_t start, size_t pages);
+void PhysRef(kphys_t start, size_t pages);
+
+PhysPage* PhysGetPage(kphys_t phys);
+int PhysGetType(kphys_t phys);
+
+typedef struct
+{
+    size_t TotalPages;
+    size_t FreePages;
+    size_t CachedPages;                   // Free pages held by the per-CPU page caches, not part of FreePages
+    size_t FreeBlocks[PHYS_BUDDY_ORDERS]; // Free buddy blocks of each order
+} PhysStats;
+
+void PhysGetStats(PhysStats* stats);
+void PhysSetOwner(kphys_t start, size_t pages, int type, const char* description);
+
+void PhysZeroInitialize();
+void PhysZeroDebugDump();
+void PhysZeroDrain();
+kphys_t PhysAllocZeroed(size_t pages, int type, const char* description);
 
 // --------------------------------------------------------------------
 // Virtual Memory Manager
 // --------------------------------------------------------------------
 
+// RAM is mapped linearly at VIRT_DIRECT_MAP_BASE, up to VIRT_DIRECT_MAP_LIMIT bytes of it. Firmware ranges and holes
+// below VirtDirectMapEnd are left unmapped. The rest of the kernel half is left to VirtAlloc.
+#define VIRT_DIRECT_MAP_BASE  0xC0000000
+#define VIRT_DIRECT_MAP_LIMIT 0x30000000
+
+extern kphys_t VirtDirectMapEnd;
+
 #define VIRT_PROT_READONLY  (1 << 0)
 #define VIRT_PROT_READWRITE (1 << 1)
 #define VIRT_PROT_NOCACHE   (1 << 2)
@@ -98,6 +147,7 @@ void PhysFree(kphys_t start);
 #define VIRT_REGION_TYPE_KERNEL_HEAP    4
 #define VIRT_REGION_TYPE_TASK_STACK     5
 #define VIRT_REGION_TYPE_FAULT          6
+#define VIRT_REGION_TYPE_SCRATCH        7
 
 #define VIRT_REGION_TYPE_USER_NULL      10
 #define VIRT_REGION_TYPE_USER_STACK     11
@@ -115,9 +165,15 @@ typedef struct
 } PageTable;
 #pragma pack(pop)
 
-typedef struct
+typedef struct VirtRegion
 {
     ListEntry ListEntry;
+    struct VirtRegion* Left;
+    struct VirtRegion* Right;
+    int Height;
+    kvirt_t SubtreeBeg;
+    kvirt_t SubtreeEnd;
+    size_t MaxGap;
     int Protection;
     int Type;
     kphys_t Physical;
@@ -127,6 +183,31 @@ typedef struct
     const char* Description;
 } VirtRegion;
 
+// Non-overlapping regions, balanced by address for O(log n) lookups and gap searches, and also linked in address
+// order for walks
+typedef struct
+{
+    ListHead List;
+    VirtRegion* Root;
+} VirtRegionTree;
+
+void VirtRegionTreeInitialize(VirtRegionTree* tree);
+void VirtRegionTreeInsert(VirtRegionTree* tree, VirtRegion* region);
+void VirtRegionTreeRemove(VirtRegionTree* tree, VirtRegion* region);
+VirtRegion* VirtRegionTreeFind(VirtRegionTree* tree, kvirt_t addr);
+bool VirtRegionTreeOverlaps(VirtRegionTree* tree, kvirt_t beg, kvirt_t end);
+kvirt_t VirtRegionTreeFindGap(VirtRegionTree* tree, kvirt_t lo, kvirt_t hi, size_t size);
+
+static inline VirtRegion* VirtRegionTreeFirst(VirtRegionTree* tree)
+{
+    return ListIsEmpty(&tree->List) ? NULL : CONTAINING_RECORD(tree->List.Next, VirtRegion, ListEntry);
+}
+
+static inline VirtRegion* VirtRegionTreeNext(VirtRegionTree* tree, VirtRegion* region)
+{
+    return region->ListEntry.Next == &tree->List ? NULL : CONTAINING_RECORD(region->ListEntry.Next, VirtRegion, ListEntry);
+}
+
 void VirtInitializeEarly();
 void VirtInitializeFull();
 void VirtDebugDump();
@@ -134,6 +215,11 @@ void VirtDebugDump();
 void VirtMapMemory(kphys_t physical, kvirt_t virtual, size_t pages, int protection, const char* reason);
 void VirtUnmapMemory(kvirt_t virtual, size_t pages, const char* reason);
 
+// Map and unmap operations invalidate their whole range once they are done: page by page up to
+// VIRT_TLB_FLUSH_THRESHOLD pages, with a single full flush above that
+#define VIRT_TLB_FLUSH_THRESHOLD 32
+void VirtFlushTlb(kvirt_t virtual, size_t pages);
+
 void* PhysToVirt(kphys_t phys);
 kphys_t VirtToPhys(void* virt);
 
@@ -150,7 +236,7 @@ typedef struct
     kphys_t PageDirPhys;
     PageDirectory* PageDir;
     PageTable* PageTables;
-    ListHead Regions;
+    VirtRegionTree Regions;
     VirtRegion* BeginAlloc;
 } VirtSpace;
 
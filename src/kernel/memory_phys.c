@@ -1,6 +1,8 @@
 #include <string.h>
+#include "irql.h"
 #include "memory.h"
 #include "bitmap.h"
+#include "lowlevel.h"
 #include "textmode.h"
 #include "interrupts.h"
 
@@ -19,10 +21,62 @@ static Bitmap* PhysPageBitmap = NULL;
 static kvirt_t PhysMemoryMapAddr = 0;
 static size_t PhysMemoryMapSize = 0;
 
-static void PhysMarkBitmap(kphys_t beg, kphys_t end, bool free, const char* description);
+// Without PAE the kernel can't address physical memory above 4 GiB
+#define PHYS_MAX_ADDR 0x100000000ull
+
+static void PhysMarkBitmap(uint64_t beg, uint64_t end, bool free, const char* description);
 static void* k_sbrk(intptr_t inc, size_t align);
 
+// Buddy allocator, it takes over from the bitmap once the kernel heap is available. The bitmap is only used for the
+// allocations made during early initialization (page tables, kernel heap) and isn't kept up to date afterwards.
+// The page frame array holds one PhysPage per physical page, it also serves as the buddy allocator's list nodes.
+#define PHYS_BUDDY_NONE UINT32_MAX
+
+static PhysPage* PhysPageFrames = NULL;
+static uint32_t PhysBuddyFree[PHYS_BUDDY_ORDERS];
+static size_t PhysBuddyFreeBlocks[PHYS_BUDDY_ORDERS];
+static size_t PhysFreePages = 0;
+
+static void PhysBuddyInitialize();
+static uint32_t PhysBuddyAlloc(uint32_t pages);
+static void PhysBuddyFreeRange(uint32_t pfn, uint32_t pages);
+static bool PhysBuddyClaimPage(uint32_t pfn);
+static void PhysReleasePages(uint32_t pfn, uint32_t pages);
+
+// Per-CPU caches of free single pages in front of the buddy allocator. Each is a ring: pages freed last (hot, likely
+// still in the CPU cache) are handed out first, refills from the buddy allocator go to the cold end, which is also
+// the end drained back when the cache fills up. They are only protected by the IRQL, PhysAlloc and PhysFree must not
+// be called above IRQL_DEVICE_HI.
+#define PHYS_MAX_CPUS        1  // The kernel only runs on the boot processor so far
+#define PHYS_PCP_HIGH        64 // Pages a cache holds at most
+#define PHYS_PCP_BATCH       16 // Pages moved between a cache and the buddy allocator at once
+
+typedef struct
+{
+    uint32_t Head;  // Coldest page
+    uint32_t Count;
+    uint32_t Pages[PHYS_PCP_HIGH];
+    uint64_t Hits;
+    uint64_t Refills;
+    uint64_t Drains;
+} PhysPageCache;
+
+static PhysPageCache PhysPageCaches[PHYS_MAX_CPUS];
+
+static inline PhysPageCache* PhysGetPageCache()
+{
+    return &PhysPageCaches[0];
+}
+
+static uint32_t PhysPageCacheAlloc();
+static bool PhysPageCacheFree(uint32_t pfn);
+static void PhysPageCacheRemove(uint32_t pfn);
+static void PhysPageCacheDrainAll();
+
 static bool PhysFullyInitialized = false;
+
+// Memory map, fixed regions and PhysMark ranges. Allocations are only tracked in the page frame array, PhysDebugDump
+// builds its view of RAM from there.
 static ListHead PhysRegionList;
 static inline PhysRegion* PhysRegionListFirst();
 static inline PhysRegion* PhysRegionListNext(PhysRegion* region);
@@ -53,6 +107,8 @@ void PhysInitializeEarly(multiboot_info_t* info)
 
     // Allocate physical page bitmap
     PhysMaxAddr = KPAGE_ALIGN_UP64(PhysMaxAddr);
+    if (PhysMaxAddr > PHYS_MAX_ADDR)
+        PhysMaxAddr = PHYS_MAX_ADDR;
     PhysPages = PhysMaxAddr / KPAGE_SIZE;
     PhysPageBitmap = k_sbrk(BitmapCalcSize(PhysPages), KPAGE_SIZE);
     BitmapInitialize(PhysPageBitmap, PhysPages);
@@ -96,6 +152,16 @@ void PhysInitializeEarly(multiboot_info_t* info)
 
 void PhysInitializeFull()
 {
+    // The page frame array is too big for the kernel heap on machines with a lot of RAM. It gets pages of its own,
+    // mapped where the direct map will have them.
+    size_t framePages = KPAGE_COUNT(sizeof(PhysPage) * PhysPages);
+    kphys_t framePhys = PhysAlloc(framePages, PHYS_REGION_TYPE_KERNEL_PAGE_FRAMES, "pframes");
+    DbgAssert(framePhys != 0);
+    DbgAssert(framePhys + framePages * KPAGE_SIZE <= VIRT_DIRECT_MAP_LIMIT);
+    VirtMapMemory(framePhys, KEARLY_PHYS_TO_VIRT(framePhys), framePages, VIRT_PROT_READWRITE, "pframes");
+    PhysPageFrames = (PhysPage*)KEARLY_PHYS_TO_VIRT(framePhys);
+    memset(PhysPageFrames, 0, framePages * KPAGE_SIZE);
+
     ListInitialize(&PhysRegionList);
 
     // Add E820 regions
@@ -133,53 +199,116 @@ void PhysInitializeFull()
     PhysRegionListInsert(PHYS_REGION_TYPE_KERNEL_SBRK, KEARLY_VIRT_TO_PHYS(&__kernel_end), KEARLY_VIRT_TO_PHYS(__kernel_brk), "k_sbrk"); //"kernel sbrk");
     PhysRegionListInsert2(PHYS_REGION_TYPE_KERNEL_PAGE_DIR, KEARLY_VIRT_TO_PHYS(VirtPageDirectory), 1025 * KPAGE_SIZE, "vpagedir"); //"kernel page dir");
     PhysRegionListInsert2(PHYS_REGION_TYPE_KERNEL_HEAP, KEARLY_VIRT_TO_PHYS(KHeap), KHeapSize, "kheap"); //"kernel heap");
+    PhysRegionListInsert2(PHYS_REGION_TYPE_KERNEL_PAGE_FRAMES, framePhys, framePages * KPAGE_SIZE, "pframes");
 
     // Sort and resolve overlaps
     PhysRegionListCoalesce();
+
+    // Hand all free memory to the buddy allocator
+    PhysBuddyInitialize();
     PhysFullyInitialized = true;
 
     // Debug dump
     PhysDebugDump();
 }
 
+static void PhysDebugDumpRegion(uint64_t beg, uint64_t end, const char* description, int type)
+{
+    uint64_t size = end - beg;
+    TmPrintf(
+        "%12llX | %12llX | %-8s (%u) | %llu KiB + %llu bytes (%llu MiB)\n",
+        beg,
+        end,
+        description, type,
+        size / 1024, size % 1024, size / 1048576);
+}
+
 void PhysDebugDump()
 {
     uint32_t irqLock = IntEnterCriticalSection();
 
-    if (PhysFullyInitialized && !ListIsEmpty(&PhysRegionList))
+    if (PhysFullyInitialized)
     {
         TmPrintf("Start        | End          | Status         | Size\n");
         TmPrintf("-------------+--------------+----------------+---------------------------------\n");
 
-        PhysRegion* region = PhysRegionListFirst();
-        do
+        // RAM as the page frame array sees it, runs of pages with the same type and owner
+        size_t pfn = 0;
+        while (pfn < PhysPages)
         {
-            TmPrintf(
-                "%12llX | %12llX | %-8s (%u) | %llu KiB + %llu bytes (%llu MiB)\n",
-                region->Beg,
-                region->End,
-                region->Description, region->Type,
-                region->Size / 1024, region->Size % 1024, region->Size / 1048576);
-            region = PhysRegionListNext(region);
-        } while (region != NULL);
+            PhysPage* first = &PhysPageFrames[pfn];
+            size_t end = pfn + 1;
+            while (end < PhysPages && PhysPageFrames[end].Type == first->Type && PhysPageFrames[end].Owner == first->Owner)
+                end++;
+            PhysDebugDumpRegion((uint64_t)pfn * KPAGE_SIZE, (uint64_t)end * KPAGE_SIZE, first->Owner, first->Type);
+            pfn = end;
+        }
+
+        // Beyond the end of RAM only the memory map and PhysMark know what's there
+        for (PhysRegion* region = PhysRegionListFirst(); region != NULL; region = PhysRegionListNext(region))
+        {
+            if (region->End > PhysMaxAddr)
+                PhysDebugDumpRegion(region->Beg > PhysMaxAddr ? region->Beg : PhysMaxAddr, region->End, region->Description, region->Type);
+        }
 
         TmPrintf("\n");
     }
 
-    size_t free = BitmapCountSetBits(PhysPageBitmap);
+    size_t cached = 0;
+    for (size_t cpu = 0; cpu < PHYS_MAX_CPUS; cpu++)
+        cached += PhysPageCaches[cpu].Count;
+    size_t free = PhysFullyInitialized ? PhysFreePages + cached : BitmapCountSetBits(PhysPageBitmap);
     size_t used = PhysPages - free;
     TmPrintfDbg("Max physical address:  0x%08llX\n", PhysMaxAddr);
-    TmPrintfDbg("Total physical memory: %u MiB (%u KiB, %u pages)\n", (PhysPages*KPAGE_SIZE) / 1048576, (PhysPages*KPAGE_SIZE) / 1024, PhysPages);
-    TmPrintfDbg("Total free memory:     %u MiB (%u KiB, %u pages)\n", (free*KPAGE_SIZE) / 1048576, (free*KPAGE_SIZE) / 1024, free);
-    TmPrintfDbg("Total used memory:     %u MiB (%u KiB, %u pages)\n", (used*KPAGE_SIZE) / 1048576, (used*KPAGE_SIZE) / 1024, used);
+    TmPrintfDbg("Total physical memory: %u MiB (%u KiB, %u pages)\n", PhysPages / 256, PhysPages * 4, PhysPages);
+    TmPrintfDbg("Total free memory:     %u MiB (%u KiB, %u pages)\n", free / 256, free * 4, free);
+    TmPrintfDbg("Total used memory:     %u MiB (%u KiB, %u pages)\n", used / 256, used * 4, used);
+    if (PhysFullyInitialized)
+    {
+        TmPrintfDbg("Free blocks by order: ");
+        for (size_t order = 0; order < PHYS_BUDDY_ORDERS; order++)
+            TmPrintfDbg(" %u", PhysBuddyFreeBlocks[order]);
+        TmPrintfDbg("\n");
+        for (size_t cpu = 0; cpu < PHYS_MAX_CPUS; cpu++)
+        {
+            PhysPageCache* cache = &PhysPageCaches[cpu];
+            TmPrintfDbg("CPU %u page cache:     %u pages, %llu hits, %llu refills, %llu drains\n", cpu, cache->Count, cache->Hits, cache->Refills, cache->Drains);
+        }
+
+        // Memory usage by page type, straight from the page frame array
+        int types[32];
+        size_t counts[32];
+        size_t numTypes = 0;
+        for (size_t pfn = 0; pfn < PhysPages; pfn++)
+        {
+            int type = PhysPageFrames[pfn].Type;
+            size_t idx = 0;
+            while (idx < numTypes && types[idx] != type)
+                idx++;
+            if (idx == numTypes)
+            {
+                if (numTypes == 32)
+                    continue;
+                types[numTypes] = type;
+                counts[numTypes++] = 0;
+            }
+            counts[idx]++;
+        }
+        for (size_t idx = 0; idx < numTypes; idx++)
+            TmPrintfDbg("Type %3d: %u KiB (%u pages)\n", types[idx], counts[idx] * 4, counts[idx]);
+    }
 
     IntLeaveCriticalSection(irqLock);
 }
 
-static void PhysMarkBitmap(kphys_t beg, kphys_t end, bool free, const char* description)
+static void PhysMarkBitmap(uint64_t beg, uint64_t end, bool free, const char* description)
 {
-    beg = free ? KPAGE_ALIGN_UP(beg) : KPAGE_ALIGN_DOWN(beg);
-    end = free ? KPAGE_ALIGN_DOWN(end) : KPAGE_ALIGN_UP(end);
+    beg = free ? KPAGE_ALIGN_UP64(beg) : KPAGE_ALIGN_DOWN64(beg);
+    end = free ? KPAGE_ALIGN_DOWN64(end) : KPAGE_ALIGN_UP64(end);
+    if (end > PhysMaxAddr)
+        end = PhysMaxAddr;
+    if (beg >= end)
+        return;
 
     size_t off = beg / KPAGE_SIZE;
     size_t len = (end - beg) / KPAGE_SIZE;
@@ -191,9 +320,9 @@ static void PhysMarkBitmap(kphys_t beg, kphys_t end, bool free, const char* desc
             len -= (off + len) - PhysPageBitmap->Size;
 
         if (free)
-            TmPrintfVrb("Pfree   %8X to %8X    %-20s [%u MiB, %u KiB]\n", beg, end, description, (len * 4) / 1024, len * 4);
+            TmPrintfVrb("Pfree   %8llX to %8llX    %-20s [%u MiB, %u KiB]\n", beg, end, description, (len * 4) / 1024, len * 4);
         else
-            TmPrintfVrb("Pused   %8X to %8X    %-20s [%u MiB, %u KiB]\n", beg, end, description, (len * 4) / 1024, len * 4);
+            TmPrintfVrb("Pused   %8llX to %8llX    %-20s [%u MiB, %u KiB]\n", beg, end, description, (len * 4) / 1024, len * 4);
 
         BitmapSetBits(PhysPageBitmap, off, len, free);
     }
@@ -208,64 +337,218 @@ void PhysMark(kphys_t start, size_t pages, int type, const char* description)
 
     uint32_t irqLock = IntEnterCriticalSection();
     {
+        // Marked pages (usually MMIO beyond the end of RAM) are never handed out or freed
         kphys_t end = start + pages * KPAGE_SIZE;
-        PhysMarkBitmap(start, end, false, description);
+        for (size_t pfn = start / KPAGE_SIZE; pfn < end / KPAGE_SIZE && pfn < PhysPages; pfn++)
+        {
+            PhysPage* page = &PhysPageFrames[pfn];
+            if (page->Flags & PHYS_PAGE_FLAG_CACHED)
+                PhysPageCacheRemove(pfn);
+            else
+                PhysBuddyClaimPage(pfn);
+            page->Type = type;
+            page->Owner = description;
+            page->Flags = PHYS_PAGE_FLAG_RESERVED;
+        }
         PhysRegionListInsert(type, start, end, description);
         PhysRegionListCoalesce();
     }
     IntLeaveCriticalSection(irqLock);
 }
 
+static void PhysTrackAlloc(uint32_t pfn, size_t pages, int type, const char* description)
+{
+    for (uint32_t idx = pfn; idx < pfn + pages; idx++)
+    {
+        PhysPage* page = &PhysPageFrames[idx];
+        page->Type = type;
+        page->Owner = description;
+        page->RefCount = 1;
+        page->Flags = PHYS_PAGE_FLAG_ALLOC;
+    }
+    PhysPageFrames[pfn].Flags |= PHYS_PAGE_FLAG_HEAD;
+}
+
 kphys_t PhysAlloc(size_t pages, int type, const char* description)
 {
     DbgAssert(pages > 0);
 
+    // Single pages come from this CPU's page cache without touching the buddy allocator
+    if (pages == 1 && PhysFullyInitialized)
+    {
+        irql_t irql = IrqlRaise(IRQL_DEVICE_HI);
+        uint32_t pfn = PhysPageCacheAlloc();
+        if (pfn != PHYS_BUDDY_NONE)
+            PhysTrackAlloc(pfn, 1, type, description);
+        IrqlLower(irql);
+        if (pfn != PHYS_BUDDY_NONE)
+            return pfn * KPAGE_SIZE;
+    }
+
     uint32_t irqLock = IntEnterCriticalSection();
-    size_t start = (1024 * 1024) / KPAGE_SIZE;
-    size_t off = BitmapFindFirstRegion(PhysPageBitmap, start, pages, true);
-    if (off == BITMAP_INVALID_OFFSET)
+    if (!PhysFullyInitialized)
+    {
+        size_t start = (1024 * 1024) / KPAGE_SIZE;
+        size_t off = BitmapFindFirstRegion(PhysPageBitmap, start, pages, true);
+        if (off == BITMAP_INVALID_OFFSET)
+        {
+            IntLeaveCriticalSection(irqLock);
+            return 0;
+        }
+
+        kphys_t beg = off * KPAGE_SIZE;
+        PhysMarkBitmap(beg, beg + pages * KPAGE_SIZE, false, description);
+        IntLeaveCriticalSection(irqLock);
+        return beg;
+    }
+
+    uint32_t pfn = PhysBuddyAlloc(pages);
+    if (pfn == PHYS_BUDDY_NONE)
+    {
+        // The pages sitting in the page caches might be what keeps a large enough block from forming, the zeroed
+        // page pools are given up as well
+        PhysPageCacheDrainAll();
+        pfn = PhysBuddyAlloc(pages);
+        if (pfn == PHYS_BUDDY_NONE)
+        {
+            IntLeaveCriticalSection(irqLock);
+            PhysZeroDrain();
+            irqLock = IntEnterCriticalSection();
+            PhysPageCacheDrainAll();
+            pfn = PhysBuddyAlloc(pages);
+        }
+    }
+    if (pfn == PHYS_BUDDY_NONE)
     {
         IntLeaveCriticalSection(irqLock);
         return 0;
     }
 
-    kphys_t beg = off * KPAGE_SIZE;
-    kphys_t end = beg + pages * KPAGE_SIZE;
-    PhysMarkBitmap(beg, end, false, description);
+    PhysTrackAlloc(pfn, pages, type, description);
+    IntLeaveCriticalSection(irqLock);
+    return pfn * KPAGE_SIZE;
+}
 
-    if (PhysFullyInitialized)
+void PhysFree(kphys_t start)
+{
+    DbgAssert(PhysFullyInitialized);
+    DbgAssert(start % KPAGE_SIZE == 0);
+
+    uint32_t pfn = start / KPAGE_SIZE;
+    if (pfn >= PhysPages || !(PhysPageFrames[pfn].Flags & PHYS_PAGE_FLAG_HEAD))
+        DbgPanic("PhysFree called with invalid address");
+
+    // Unshared single pages go back to this CPU's page cache
+    irql_t irql = IrqlRaise(IRQL_DEVICE_HI);
+    bool cached = PhysPageCacheFree(pfn);
+    IrqlLower(irql);
+    if (cached)
+        return;
+
+    uint32_t irqLock = IntEnterCriticalSection();
+    // The allocation extends up to the next page that isn't allocated or starts an allocation of its own
+    uint32_t pages = 1;
+    while (pfn + pages < PhysPages && (PhysPageFrames[pfn + pages].Flags & (PHYS_PAGE_FLAG_ALLOC | PHYS_PAGE_FLAG_HEAD)) == PHYS_PAGE_FLAG_ALLOC)
+        pages++;
+    PhysReleasePages(pfn, pages);
+    IntLeaveCriticalSection(irqLock);
+}
+
+void PhysFreeRange(kphys_t start, size_t pages)
+{
+    DbgAssert(PhysFullyInitialized);
+    DbgAssert(start % KPAGE_SIZE == 0);
+    DbgAssert(pages > 0);
+
+    uint32_t irqLock = IntEnterCriticalSection();
+    uint32_t pfn = start / KPAGE_SIZE;
+    DbgAssert(pfn + pages <= PhysPages);
+    PhysReleasePages(pfn, pages);
+    IntLeaveCriticalSection(irqLock);
+}
+
+void PhysFreeBoot(kphys_t start, size_t pages)
+{
+    // Gives back part of an allocation made before the buddy allocator took over. Those never went through
+    // PhysTrackAlloc, their frames are reserved rather than allocated.
+    DbgAssert(PhysFullyInitialized);
+    DbgAssert(start % KPAGE_SIZE == 0);
+    DbgAssert(pages > 0);
+
+    uint32_t irqLock = IntEnterCriticalSection();
+    uint32_t pfn = start / KPAGE_SIZE;
+    DbgAssert(pfn + pages <= PhysPages);
+    for (uint32_t idx = pfn; idx < pfn + pages; idx++)
     {
-        PhysRegionListInsert(type, beg, end, description);
-        PhysRegionListCoalesce();
+        PhysPage* page = &PhysPageFrames[idx];
+        DbgAssert(page->Flags == PHYS_PAGE_FLAG_RESERVED);
+        page->Type = PHYS_REGION_TYPE_E820_AVAILABLE;
+        page->Owner = "free";
+        page->Flags = 0;
     }
+    PhysBuddyFreeRange(pfn, pages);
+    IntLeaveCriticalSection(irqLock);
+}
+
+void PhysRef(kphys_t start, size_t pages)
+{
+    DbgAssert(PhysFullyInitialized);
+    DbgAssert(start % KPAGE_SIZE == 0);
 
+    uint32_t irqLock = IntEnterCriticalSection();
+    for (uint32_t pfn = start / KPAGE_SIZE; pfn < start / KPAGE_SIZE + pages; pfn++)
+    {
+        PhysPage* page = PhysGetPage(pfn * KPAGE_SIZE);
+        DbgAssert(page->Flags & PHYS_PAGE_FLAG_ALLOC);
+        DbgAssert(page->RefCount < UINT16_MAX);
+        page->RefCount++;
+    }
     IntLeaveCriticalSection(irqLock);
-    return beg;
 }
 
-void PhysFree(kphys_t start)
+PhysPage* PhysGetPage(kphys_t phys)
 {
+    DbgAssert(PhysFullyInitialized);
+    size_t pfn = phys / KPAGE_SIZE;
+    DbgAssert(pfn < PhysPages);
+    return &PhysPageFrames[pfn];
+}
+
+int PhysGetType(kphys_t phys)
+{
+    // Beyond the end of RAM only the region list knows what's there
+    DbgAssert(PhysFullyInitialized);
+    size_t pfn = phys / KPAGE_SIZE;
+    return pfn < PhysPages ? PhysPageFrames[pfn].Type : PHYS_REGION_TYPE_HARDWARE;
+}
+
+void PhysSetOwner(kphys_t start, size_t pages, int type, const char* description)
+{
+    // Hands an allocation over to a new owner, e.g. a block out of the zeroed page pools
     DbgAssert(PhysFullyInitialized);
     DbgAssert(start % KPAGE_SIZE == 0);
 
     uint32_t irqLock = IntEnterCriticalSection();
-    PhysRegion* region = PhysRegionListFirst();
-    while (region)
+    for (uint32_t pfn = start / KPAGE_SIZE; pfn < start / KPAGE_SIZE + pages; pfn++)
     {
-        if (region->Beg == start)
-        {
-            DbgAssert(region->Type != PHYS_REGION_TYPE_E820_AVAILABLE);
-            region->Type = PHYS_REGION_TYPE_E820_AVAILABLE;
-            region->Description = "free";
-            PhysRegionListCoalesce();
-            PhysMarkBitmap(region->Beg, region->End, true, "free");
-            IntLeaveCriticalSection(irqLock);
-            return;
-        }
-        region = PhysRegionListNext(region);
+        PhysPage* page = PhysGetPage(pfn * KPAGE_SIZE);
+        DbgAssert(page->Flags & PHYS_PAGE_FLAG_ALLOC);
+        page->Type = type;
+        page->Owner = description;
     }
+    IntLeaveCriticalSection(irqLock);
+}
 
-    DbgPanic("PhysFree called with invalid address");
+void PhysGetStats(PhysStats* stats)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    stats->TotalPages = PhysPages;
+    stats->FreePages = PhysFreePages;
+    stats->CachedPages = 0;
+    for (size_t cpu = 0; cpu < PHYS_MAX_CPUS; cpu++)
+        stats->CachedPages += PhysPageCaches[cpu].Count;
+    memcpy(stats->FreeBlocks, PhysBuddyFreeBlocks, sizeof(stats->FreeBlocks));
+    IntLeaveCriticalSection(irqLock);
 }
 
 void* k_sbrk(intptr_t inc, size_t align)
@@ -283,6 +566,308 @@ void* k_sbrk(intptr_t inc, size_t align)
     return ret;
 }
 
+// --------------------------------------------------------------------------------
+// Buddy allocator
+// --------------------------------------------------------------------------------
+
+static void PhysBuddyPush(uint32_t pfn, uint32_t order)
+{
+    PhysPage* page = &PhysPageFrames[pfn];
+    page->Flags = PHYS_PAGE_FLAG_FREE;
+    page->Order = order;
+    page->Prev = PHYS_BUDDY_NONE;
+    page->Next = PhysBuddyFree[order];
+    if (page->Next != PHYS_BUDDY_NONE)
+        PhysPageFrames[page->Next].Prev = pfn;
+    PhysBuddyFree[order] = pfn;
+    PhysBuddyFreeBlocks[order]++;
+}
+
+static void PhysBuddyUnlink(uint32_t pfn)
+{
+    PhysPage* page = &PhysPageFrames[pfn];
+    if (page->Prev != PHYS_BUDDY_NONE)
+        PhysPageFrames[page->Prev].Next = page->Next;
+    else
+        PhysBuddyFree[page->Order] = page->Next;
+    if (page->Next != PHYS_BUDDY_NONE)
+        PhysPageFrames[page->Next].Prev = page->Prev;
+    page->Flags = 0;
+    PhysBuddyFreeBlocks[page->Order]--;
+}
+
+static void PhysBuddyFreeBlock(uint32_t pfn, uint32_t order)
+{
+    // Merge with the buddy for as long as it is a free block of the same order
+    while (order < PHYS_BUDDY_ORDERS - 1)
+    {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= PhysPages)
+            break;
+        PhysPage* page = &PhysPageFrames[buddy];
+        if (!(page->Flags & PHYS_PAGE_FLAG_FREE) || page->Order != order)
+            break;
+        PhysBuddyUnlink(buddy);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    PhysBuddyPush(pfn, order);
+}
+
+static void PhysBuddyFreeRange(uint32_t pfn, uint32_t pages)
+{
+    // Split the range into the largest naturally aligned blocks
+    PhysFreePages += pages;
+    while (pages > 0)
+    {
+        uint32_t order = pfn == 0 ? PHYS_BUDDY_ORDERS - 1 : bsf(pfn);
+        if (order > PHYS_BUDDY_ORDERS - 1)
+            order = PHYS_BUDDY_ORDERS - 1;
+        while ((1u << order) > pages)
+            order--;
+        PhysBuddyFreeBlock(pfn, order);
+        pfn += 1u << order;
+        pages -= 1u << order;
+    }
+}
+
+static uint32_t PhysBuddyAlloc(uint32_t pages)
+{
+    uint32_t order = pages == 1 ? 0 : bsr(pages - 1) + 1;
+    if (order >= PHYS_BUDDY_ORDERS)
+        return PHYS_BUDDY_NONE;
+
+    uint32_t found = order;
+    while (found < PHYS_BUDDY_ORDERS && PhysBuddyFree[found] == PHYS_BUDDY_NONE)
+        found++;
+    if (found == PHYS_BUDDY_ORDERS)
+        return PHYS_BUDDY_NONE;
+
+    // Split the block down to the requested order, the upper halves go back on the free lists
+    uint32_t pfn = PhysBuddyFree[found];
+    PhysBuddyUnlink(pfn);
+    while (found > order)
+    {
+        found--;
+        PhysBuddyPush(pfn + (1u << found), found);
+    }
+    PhysFreePages -= 1u << order;
+
+    // Give back the unused tail of the block, an allocation of 1025 pages shouldn't cost 2048
+    if ((1u << order) > pages)
+        PhysBuddyFreeRange(pfn + pages, (1u << order) - pages);
+    return pfn;
+}
+
+static bool PhysBuddyClaimPage(uint32_t pfn)
+{
+    // Find the free block containing the page, if any, and split it until only the page itself is taken out
+    for (uint32_t order = 0; order < PHYS_BUDDY_ORDERS; order++)
+    {
+        uint32_t head = pfn & ~((1u << order) - 1);
+        PhysPage* page = &PhysPageFrames[head];
+        if (!(page->Flags & PHYS_PAGE_FLAG_FREE) || page->Order != order)
+            continue;
+
+        PhysBuddyUnlink(head);
+        while (order > 0)
+        {
+            order--;
+            uint32_t half = 1u << order;
+            if (pfn & half)
+            {
+                PhysBuddyPush(head, order);
+                head += half;
+            }
+            else
+                PhysBuddyPush(head + half, order);
+        }
+        PhysFreePages--;
+        return true;
+    }
+    return false;
+}
+
+static void PhysReleasePages(uint32_t pfn, uint32_t pages)
+{
+    // Drop one reference on each page, the ones that aren't shared anymore go back to the buddy allocator in runs
+    uint32_t end = pfn + pages;
+    uint32_t runBeg = pfn;
+    for (uint32_t idx = pfn; idx <= end; idx++)
+    {
+        bool release = false;
+        if (idx < end)
+        {
+            PhysPage* page = &PhysPageFrames[idx];
+            if (!(page->Flags & PHYS_PAGE_FLAG_ALLOC))
+                DbgPanic("PhysFree called on a page that isn't allocated");
+            release = --page->RefCount == 0;
+            if (release)
+            {
+                page->Type = PHYS_REGION_TYPE_E820_AVAILABLE;
+                page->Owner = "free";
+                page->Flags = 0;
+            }
+            else if (idx > pfn && !(PhysPageFrames[idx - 1].Flags & PHYS_PAGE_FLAG_ALLOC))
+                page->Flags |= PHYS_PAGE_FLAG_HEAD; // A shared page survives as an allocation of its own
+        }
+
+        if (!release)
+        {
+            if (idx > runBeg)
+                PhysBuddyFreeRange(runBeg, idx - runBeg);
+            runBeg = idx + 1;
+        }
+    }
+
+    // Freeing the front of an allocation leaves the rest as an allocation of its own
+    if (end < PhysPages && !(PhysPageFrames[end - 1].Flags & PHYS_PAGE_FLAG_ALLOC) && (PhysPageFrames[end].Flags & PHYS_PAGE_FLAG_ALLOC))
+        PhysPageFrames[end].Flags |= PHYS_PAGE_FLAG_HEAD;
+}
+
+// --------------------------------------------------------------------------------
+// Per-CPU page caches
+// --------------------------------------------------------------------------------
+
+static inline uint32_t PhysPageCacheSlot(PhysPageCache* cache, uint32_t idx)
+{
+    return (cache->Head + idx) % PHYS_PCP_HIGH;
+}
+
+static void PhysPageCacheRefill(PhysPageCache* cache)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    while (cache->Count < PHYS_PCP_BATCH)
+    {
+        uint32_t pfn = PhysBuddyAlloc(1);
+        if (pfn == PHYS_BUDDY_NONE)
+            break;
+        PhysPageFrames[pfn].Flags = PHYS_PAGE_FLAG_CACHED;
+        cache->Head = PhysPageCacheSlot(cache, PHYS_PCP_HIGH - 1);
+        cache->Pages[cache->Head] = pfn;
+        cache->Count++;
+    }
+    cache->Refills++;
+    IntLeaveCriticalSection(irqLock);
+}
+
+static void PhysPageCacheDrain(PhysPageCache* cache, uint32_t count)
+{
+    // Caller holds the global critical section
+    while (count-- > 0 && cache->Count > 0)
+    {
+        uint32_t pfn = cache->Pages[cache->Head];
+        cache->Head = PhysPageCacheSlot(cache, 1);
+        cache->Count--;
+        PhysPageFrames[pfn].Flags = 0;
+        PhysBuddyFreeRange(pfn, 1);
+    }
+    cache->Drains++;
+}
+
+static uint32_t PhysPageCacheAlloc()
+{
+    PhysPageCache* cache = PhysGetPageCache();
+    if (cache->Count == 0)
+        PhysPageCacheRefill(cache);
+    else
+        cache->Hits++;
+    if (cache->Count == 0)
+        return PHYS_BUDDY_NONE;
+    return cache->Pages[PhysPageCacheSlot(cache, --cache->Count)];
+}
+
+static bool PhysPageCacheFree(uint32_t pfn)
+{
+    PhysPage* page = &PhysPageFrames[pfn];
+    if (page->RefCount != 1 || (pfn + 1 < PhysPages && (PhysPageFrames[pfn + 1].Flags & (PHYS_PAGE_FLAG_ALLOC | PHYS_PAGE_FLAG_HEAD)) == PHYS_PAGE_FLAG_ALLOC))
+        return false;
+
+    PhysPageCache* cache = PhysGetPageCache();
+    if (cache->Count == PHYS_PCP_HIGH)
+    {
+        uint32_t irqLock = IntEnterCriticalSection();
+        PhysPageCacheDrain(cache, PHYS_PCP_BATCH);
+        IntLeaveCriticalSection(irqLock);
+    }
+
+    page->Type = PHYS_REGION_TYPE_E820_AVAILABLE;
+    page->Owner = "free";
+    page->RefCount = 0;
+    page->Flags = PHYS_PAGE_FLAG_CACHED;
+    cache->Pages[PhysPageCacheSlot(cache, cache->Count++)] = pfn;
+    return true;
+}
+
+static void PhysPageCacheRemove(uint32_t pfn)
+{
+    // Caller holds the global critical section, only used by PhysMark
+    for (size_t cpu = 0; cpu < PHYS_MAX_CPUS; cpu++)
+    {
+        PhysPageCache* cache = &PhysPageCaches[cpu];
+        for (uint32_t idx = 0; idx < cache->Count; idx++)
+        {
+            if (cache->Pages[PhysPageCacheSlot(cache, idx)] != pfn)
+                continue;
+            for (; idx + 1 < cache->Count; idx++)
+                cache->Pages[PhysPageCacheSlot(cache, idx)] = cache->Pages[PhysPageCacheSlot(cache, idx + 1)];
+            cache->Count--;
+            PhysPageFrames[pfn].Flags = 0;
+            return;
+        }
+    }
+}
+
+static void PhysPageCacheDrainAll()
+{
+    // Caller holds the global critical section
+    for (size_t cpu = 0; cpu < PHYS_MAX_CPUS; cpu++)
+        PhysPageCacheDrain(&PhysPageCaches[cpu], PHYS_PCP_HIGH);
+}
+
+static void PhysBuddyInitialize()
+{
+    for (size_t order = 0; order < PHYS_BUDDY_ORDERS; order++)
+        PhysBuddyFree[order] = PHYS_BUDDY_NONE;
+
+    // Page types start out as what the coalesced region list says, pages outside of it are holes
+    for (size_t pfn = 0; pfn < PhysPages; pfn++)
+    {
+        PhysPageFrames[pfn].Type = PHYS_REGION_TYPE_E820_RESERVED;
+        PhysPageFrames[pfn].Owner = "hole";
+        PhysPageFrames[pfn].Flags = PHYS_PAGE_FLAG_RESERVED;
+    }
+    for (PhysRegion* region = PhysRegionListFirst(); region != NULL; region = PhysRegionListNext(region))
+    {
+        uint64_t end = KPAGE_ALIGN_UP64(region->End) / KPAGE_SIZE;
+        for (uint64_t pfn = region->Beg / KPAGE_SIZE; pfn < end && pfn < PhysPages; pfn++)
+        {
+            PhysPageFrames[pfn].Type = region->Type;
+            PhysPageFrames[pfn].Owner = region->Description;
+        }
+    }
+
+    // Everything still free in the early bitmap above 1 MiB goes to the buddy allocator
+    size_t pfn = (1024 * 1024) / KPAGE_SIZE;
+    while (pfn < PhysPages)
+    {
+        size_t beg = BitmapFindFirstBit(PhysPageBitmap, pfn, true);
+        if (beg == BITMAP_INVALID_OFFSET)
+            break;
+        size_t end = BitmapFindFirstBit(PhysPageBitmap, beg, false);
+        if (end == BITMAP_INVALID_OFFSET)
+            end = PhysPages;
+        for (size_t idx = beg; idx < end; idx++)
+        {
+            PhysPageFrames[idx].Type = PHYS_REGION_TYPE_E820_AVAILABLE;
+            PhysPageFrames[idx].Owner = "free";
+            PhysPageFrames[idx].Flags = 0;
+        }
+        PhysBuddyFreeRange(beg, end - beg);
+        pfn = end;
+    }
+}
+
 // --------------------------------------------------------------------------------
 // Full implementation
 // --------------------------------------------------------------------------------
@@ -20,21 +20,74 @@
 #define PT_FLAG_CACHEDISABLE (1 << 4)
 #define PT_FLAG_ACCESSED     (1 << 5)
 #define PT_FLAG_DIRTY        (1 << 7)
-#define PT_FLAG_GLOBAL       (1 << 9)
+#define PT_FLAG_GLOBAL       (1 << 8)
+
+#define CPUID_GETFEATURES    1
+#define CPUID_FEAT_EDX_PSE   (1 << 3)
+#define CPUID_FEAT_EDX_PGE   (1 << 13)
+#define CR4_PSE              (1 << 4)
+#define CR4_PGE              (1 << 7)
+
+#define VIRT_LARGE_PAGE_SIZE  0x400000
+#define VIRT_LARGE_PAGE_PAGES 1024
+
+// The last page stays unmapped so that region ends don't wrap around
+#define VIRT_ALLOC_END       0xFFFFF000
 
 extern int __kernel_beg;
 extern uint8_t* __kernel_brk;
-extern Heap* KHeap;
-extern const size_t KHeapSize;
 
 PageDirectory* VirtPageDirectory;
 PageTable* VirtPageTables;
-ListHead VirtRegions;
+VirtRegionTree VirtRegions;
+kphys_t VirtDirectMapEnd = 0;
 
 static bool VirtFullyInitialized = false;
+static bool VirtLargePages = false;
+static bool VirtGlobalPages = false;
 static VirtRegion* VirtBeginAlloc;
-static inline VirtRegion* VirtRegionListFirst();
-static inline VirtRegion* VirtRegionListNext(VirtRegion* region);
+
+// 4 MiB pages are only used inside the direct map, which is never unmapped and whose page directory entries are in
+// place before any address space copies them. VirtAlloc hands out addresses above it, those keep 4 KiB pages.
+static inline bool VirtCanMapLarge(kphys_t phys, kvirt_t virt, size_t pages)
+{
+    return VirtLargePages
+        && pages >= VIRT_LARGE_PAGE_PAGES
+        && phys % VIRT_LARGE_PAGE_SIZE == 0
+        && virt % VIRT_LARGE_PAGE_SIZE == 0
+        && virt >= VIRT_DIRECT_MAP_BASE
+        && virt - VIRT_DIRECT_MAP_BASE + VIRT_LARGE_PAGE_SIZE <= VirtDirectMapEnd;
+}
+
+static bool VirtIsMapped(kvirt_t virt)
+{
+    if (VirtPageDirectory->Entries[virt >> 22] & PD_FLAG_SIZELARGE)
+        return true;
+    return (VirtPageTables[virt >> 22].Entries[(virt >> 12) & 0x3FF] & PT_FLAG_PRESENT) != 0;
+}
+
+static bool VirtIsDirectMapRam(kphys_t phys)
+{
+    // Only used while nothing but the kernel itself has allocated memory: RAM pages are still free or belong to the
+    // kernel, the other types are firmware ranges, the legacy BIOS and video areas and holes in the memory map
+    int type = PhysGetType(phys);
+    return type == PHYS_REGION_TYPE_E820_AVAILABLE || (type >= PHYS_REGION_TYPE_KERNEL_IMAGE && type < PHYS_REGION_TYPE_HARDWARE);
+}
+
+static void VirtFlushTlbAll()
+{
+    // Reloading cr3 keeps global entries, toggling CR4.PGE drops them as well
+    if (VirtGlobalPages)
+    {
+        uint32_t cr4 = rdcr4();
+        wrcr4(cr4 & ~CR4_PGE);
+        wrcr4(cr4);
+    }
+    else
+    {
+        pg_flushall();
+    }
+}
 
 void VirtInitializeEarly()
 {
@@ -45,6 +98,21 @@ void VirtInitializeEarly()
         // you can increase this limit by adding more early page tables
         DbgPanic("new page tables not completely mapped by early page tables");
 
+    uint32_t eax, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &edx);
+    if (edx & CPUID_FEAT_EDX_PSE)
+    {
+        wrcr4(rdcr4() | CR4_PSE);
+        VirtLargePages = true;
+    }
+
+    // Kernel half mappings are the same in every address space, global ones survive the cr3 reload of a switch
+    if (edx & CPUID_FEAT_EDX_PGE)
+    {
+        wrcr4(rdcr4() | CR4_PGE);
+        VirtGlobalPages = true;
+    }
+
     for (size_t i = 0; i < 1024; i++)
     {
         PageTable* table = VirtPageTables + i;
@@ -66,12 +134,12 @@ void VirtDebugDump()
 {
     uint32_t irqLock = IntEnterCriticalSection();
 
-    if (!ListIsEmpty(&VirtRegions))
+    if (VirtRegions.Root != NULL)
     {
         TmPrintf("Physical | Virtual  | End      | Size        | Description\n");
         TmPrintf("---------+----------+----------+-------------+-------------------------------\n");
 
-        VirtRegion* region = VirtRegionListFirst();
+        VirtRegion* region = VirtRegionTreeFirst(&VirtRegions);
         do
         {
             TmPrintf(
@@ -82,7 +150,7 @@ void VirtDebugDump()
                 region->Size / 1024,
                 region->Description,
                 region->Type);
-            region = VirtRegionListNext(region);
+            region = VirtRegionTreeNext(&VirtRegions, region);
         } while (region != NULL);
 
         TmPrintf("\n");
@@ -91,6 +159,26 @@ void VirtDebugDump()
     IntLeaveCriticalSection(irqLock);
 }
 
+void VirtFlushTlb(kvirt_t virtual, size_t pages)
+{
+    if (pages > VIRT_TLB_FLUSH_THRESHOLD)
+    {
+        // Only the kernel half has global entries that survive a cr3 reload
+        if (virtual + pages * KPAGE_SIZE > 0xC0000000)
+            VirtFlushTlbAll();
+        else
+            pg_flushall();
+        return;
+    }
+
+    kvirt_t virt = virtual;
+    for (size_t i = 0; i < pages; i++)
+    {
+        pg_flushtlb(virt);
+        virt += KPAGE_SIZE;
+    }
+}
+
 void VirtMapMemory(kphys_t physical, kvirt_t virtual, size_t pages, int protection, const char* reason)
 {
     kphys_t phys = physical;
@@ -102,17 +190,33 @@ void VirtMapMemory(kphys_t physical, kvirt_t virtual, size_t pages, int protecti
         flags |= PT_FLAG_PRESENT | PT_FLAG_READWRITE;
     if (protection & VIRT_PROT_NOCACHE)
         flags |= PT_FLAG_CACHEDISABLE;
+    if (VirtGlobalPages && virtual >= 0xC0000000)
+        flags |= PT_FLAG_GLOBAL;
 
-    for (size_t i = 0; i < pages; i++)
+    size_t i = 0;
+    while (i < pages)
     {
         size_t pdIdx = virt >> 22;
+        if (VirtCanMapLarge(phys, virt, pages - i))
+        {
+            // Any 4 KiB translations cached for the old page table have to go too, a large page is always above the
+            // flush threshold
+            VirtPageDirectory->Entries[pdIdx] = phys | flags | PD_FLAG_SIZELARGE;
+            phys += VIRT_LARGE_PAGE_SIZE;
+            virt += VIRT_LARGE_PAGE_SIZE;
+            i += VIRT_LARGE_PAGE_PAGES;
+            continue;
+        }
+
+        DbgAssert(!(VirtPageDirectory->Entries[pdIdx] & PD_FLAG_SIZELARGE));
         size_t ptIdx = (virt >> 12) & 0x3FF;
         PageTable* table = VirtPageTables + pdIdx;
         table->Entries[ptIdx] = phys | flags;
-        pg_flushtlb(virt);
         phys += KPAGE_SIZE;
         virt += KPAGE_SIZE;
+        i++;
     }
+    VirtFlushTlb(virtual, pages);
     TmPrintfVrb("Vmap    %8X to %8X    %-20s [%u MiB, %u KiB]\n", physical, virtual, reason, (pages * 4) / 1024, pages * 4);
 }
 
@@ -126,11 +230,12 @@ void VirtUnmapMemory(kvirt_t virtual, size_t pages, const char* reason)
         size_t pdIdx = virt >> 22;
         size_t ptIdx = (virt >> 12) & 0x3FF;
         PageTable* table = VirtPageTables + pdIdx;
+        DbgAssert(!(VirtPageDirectory->Entries[pdIdx] & PD_FLAG_SIZELARGE));
         if (i == 0) phys = table->Entries[ptIdx] & 0xFFFFF000;
         table->Entries[ptIdx] = 0;
-        pg_flushtlb(virt);
         virt += KPAGE_SIZE;
     }
+    VirtFlushTlb(virtual, pages);
     TmPrintfVrb("Vunmap  %8X to %8X    %-20s [%u MiB, %u KiB]\n", phys, virtual, reason, (pages * 4) / 1024, pages * 4);
 }
 
@@ -138,47 +243,11 @@ void VirtUnmapMemory(kvirt_t virtual, size_t pages, const char* reason)
 // Full implementation
 // --------------------------------------------------------------------------------
 
-static inline bool VirtRegionOverlaps(VirtRegion* a, VirtRegion* b)
-{
-    return a->Beg < b->End && b->Beg < a->End;
-}
-
-static inline bool VirtRegionContainsVirt(VirtRegion* r, kvirt_t addr)
-{
-    return addr >= r->Beg && addr < r->End;
-}
-
 static inline bool VirtRegionContainsPhys(VirtRegion* r, kphys_t addr)
 {
     return addr >= r->Physical && addr < (r->Physical + r->Size);
 }
 
-static inline VirtRegion* VirtRegionListFirst()
-{
-    return ListIsEmpty(&VirtRegions) ? NULL : CONTAINING_RECORD(VirtRegions.Next, VirtRegion, ListEntry);
-}
-
-static inline VirtRegion* VirtRegionListNext(VirtRegion* region)
-{
-    return region->ListEntry.Next == &VirtRegions ? NULL : CONTAINING_RECORD(region->ListEntry.Next, VirtRegion, ListEntry);
-}
-
-static void VirtRegionInsert(VirtRegion* entry)
-{
-    VirtRegion* region = VirtRegionListFirst();
-    while (region)
-    {
-        if (entry->Beg <= region->Beg)
-        {
-            ListInsertBefore(&region->ListEntry, &entry->ListEntry);
-            return;
-        }
-        region = VirtRegionListNext(region);
-    }
-
-    ListPushBack(&VirtRegions, &entry->ListEntry);
-}
-
 static VirtRegion* VirtRegionCreate(kphys_t phys, kvirt_t virt, size_t pages, int protection, int type, const char* description)
 {
     VirtRegion* region = kalloc(sizeof(VirtRegion));
@@ -194,49 +263,51 @@ static VirtRegion* VirtRegionCreate(kphys_t phys, kvirt_t virt, size_t pages, in
 
 void VirtInitializeFull()
 {
-    ListInitialize(&VirtRegions);
+    VirtRegionTreeInitialize(&VirtRegions);
+
+    // The direct map takes over the early mappings of the kernel image, page tables and heap, which already are at
+    // the same place. Only RAM is mapped, firmware ranges and holes in the window stay unmapped so nothing reaches
+    // them through a cacheable mapping. Video memory keeps its uncached mapping.
+    PhysStats stats;
+    PhysGetStats(&stats);
+    kphys_t directMapEnd = VIRT_DIRECT_MAP_LIMIT;
+    if (stats.TotalPages < VIRT_DIRECT_MAP_LIMIT / KPAGE_SIZE)
+        directMapEnd = stats.TotalPages * KPAGE_SIZE;
+    // Set first, it also bounds where VirtMapMemory may use large pages
+    VirtDirectMapEnd = directMapEnd;
+    kphys_t runBeg = 0;
+    for (kphys_t phys = 0; phys <= directMapEnd; phys += KPAGE_SIZE)
+    {
+        if (phys < directMapEnd && VirtIsDirectMapRam(phys))
+            continue;
+        // Runs are mapped at once, VirtMapMemory uses 4 MiB pages wherever a run covers one
+        if (phys > runBeg)
+            VirtMapMemory(runBeg, VIRT_DIRECT_MAP_BASE + runBeg, (phys - runBeg) / KPAGE_SIZE, VIRT_PROT_READWRITE, "direct map");
+        runBeg = phys + KPAGE_SIZE;
+    }
 
-    kvirt_t kernelBeg = KVIRT(&__kernel_beg);
-    kvirt_t kernelBrk = KVIRT(__kernel_brk);
-    size_t kernelPages = KPAGE_COUNT(kernelBrk - kernelBeg);
+    // Page tables replaced by 4 MiB pages aren't needed anymore
+    size_t freedTables = 0;
+    for (size_t i = 768; i < 1024; i++)
+    {
+        if (VirtPageDirectory->Entries[i] & PD_FLAG_SIZELARGE)
+        {
+            PhysFreeBoot(KEARLY_VIRT_TO_PHYS(VirtPageTables + i), 1);
+            freedTables++;
+        }
+    }
+    TmPrintfDbg("Direct map uses %u large pages\n", freedTables);
 
-    VirtRegion* vga = VirtRegionCreate(
-        0x000A0000,
-        0xC00A0000,
-        32,
-        VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE,
-        VIRT_REGION_TYPE_HARDWARE,
-        "VGA RAM");
-    VirtRegionInsert(vga);
-
-    VirtRegion* kernel = VirtRegionCreate(
-        KEARLY_VIRT_TO_PHYS(kernelBeg),
-        kernelBeg,
-        kernelPages,
+    VirtRegion* directMap = VirtRegionCreate(
+        0,
+        VIRT_DIRECT_MAP_BASE,
+        directMapEnd / KPAGE_SIZE,
         VIRT_PROT_READWRITE,
         VIRT_REGION_TYPE_KERNEL_IMAGE,
-        "kernel");
-    VirtRegionInsert(kernel);
-
-    VirtRegion* pageTables = VirtRegionCreate(
-        KEARLY_VIRT_TO_PHYS(VirtPageDirectory),
-        KVIRT(VirtPageDirectory),
-        1025,
-        VIRT_PROT_READWRITE,
-        VIRT_REGION_TYPE_KERNEL_PAGEDIR,
-        "kernel pagedir");
-    VirtRegionInsert(pageTables);
-
-    VirtRegion* kernelHeap = VirtRegionCreate(
-        KEARLY_VIRT_TO_PHYS(KHeap),
-        KVIRT(KHeap),
-        KPAGE_COUNT(KHeapSize),
-        VIRT_PROT_READWRITE,
-        VIRT_REGION_TYPE_KERNEL_HEAP,
-        "kernel heap");
-    VirtRegionInsert(kernelHeap);
+        "direct map");
+    VirtRegionTreeInsert(&VirtRegions, directMap);
 
-    VirtBeginAlloc = kernelHeap;
+    VirtBeginAlloc = directMap;
     VirtFullyInitialized = true;
 
     VirtDebugDump();
@@ -244,8 +315,13 @@ void VirtInitializeFull()
 
 void* PhysToVirt(kphys_t addr)
 {
+    if (addr < VirtDirectMapEnd && VirtIsMapped(addr + VIRT_DIRECT_MAP_BASE))
+        return (void*)(addr + VIRT_DIRECT_MAP_BASE);
+
+    // Only RAM beyond the direct map, device memory and firmware ranges need a search. They are all mapped by
+    // VirtAlloc, above the direct map.
     uint32_t irqLock = IntEnterCriticalSection();
-    VirtRegion* region = VirtRegionListFirst();
+    VirtRegion* region = VirtBeginAlloc ? VirtRegionTreeNext(&VirtRegions, VirtBeginAlloc) : NULL;
     while (region)
     {
         if (VirtRegionContainsPhys(region, addr))
@@ -255,7 +331,7 @@ void* PhysToVirt(kphys_t addr)
             IntLeaveCriticalSection(irqLock);
             return result;
         }
-        region = VirtRegionListNext(region);
+        region = VirtRegionTreeNext(&VirtRegions, region);
     }
     IntLeaveCriticalSection(irqLock);
     return NULL;
@@ -263,22 +339,18 @@ void* PhysToVirt(kphys_t addr)
 
 kphys_t VirtToPhys(void* virt)
 {
-    uint32_t irqLock = IntEnterCriticalSection();
     kvirt_t addr = KVIRT(virt);
-    VirtRegion* region = VirtRegionListFirst();
-    while (region)
-    {
-        if (VirtRegionContainsVirt(region, addr))
-        {
-            size_t offset = addr - region->Beg;
-            kphys_t result = region->Physical + offset;
-            IntLeaveCriticalSection(irqLock);
-            return result;
-        }
-        region = VirtRegionListNext(region);
-    }
-    IntLeaveCriticalSection(irqLock);
-    return 0;
+    if (addr >= VIRT_DIRECT_MAP_BASE && addr - VIRT_DIRECT_MAP_BASE < VirtDirectMapEnd && VirtIsMapped(addr))
+        return addr - VIRT_DIRECT_MAP_BASE;
+
+    // VirtAlloc mappings, the kernel page tables are shared by all address spaces
+    uint32_t dirEntry = VirtPageDirectory->Entries[addr >> 22];
+    if (dirEntry & PD_FLAG_SIZELARGE)
+        return (dirEntry & ~(VIRT_LARGE_PAGE_SIZE - 1)) | (addr & (VIRT_LARGE_PAGE_SIZE - 1));
+    uint32_t entry = VirtPageTables[addr >> 22].Entries[(addr >> 12) & 0x3FF];
+    if (!(entry & PT_FLAG_PRESENT))
+        return 0;
+    return (entry & KPAGE_MASK) | (addr & ~KPAGE_MASK);
 }
 
 void* VirtAlloc(kphys_t physical, size_t pages, int protection, int type, const char* description)
@@ -287,29 +359,18 @@ void* VirtAlloc(kphys_t physical, size_t pages, int protection, int type, const
     DbgAssert(pages > 0);
 
     uint32_t irqLock = IntEnterCriticalSection();
-    VirtRegion* newRegion = VirtRegionCreate(physical, 0, pages, protection, type, description);
-    VirtRegion* region = VirtBeginAlloc;
-    while (region)
+    kvirt_t virt = VirtRegionTreeFindGap(&VirtRegions, VirtBeginAlloc->End, VIRT_ALLOC_END, pages * KPAGE_SIZE);
+    if (virt == 0)
     {
-        VirtRegion* nextRegion = VirtRegionListNext(region);
-
-        newRegion->Beg = region->End;
-        newRegion->End = region->End + newRegion->Size;
-
-        if (nextRegion && VirtRegionOverlaps(newRegion, nextRegion))
-        {
-            region = nextRegion;
-            continue;
-        }
-
-        VirtMapMemory(physical, newRegion->Beg, pages, protection, description);
-        ListInsertAfter(&region->ListEntry, &newRegion->ListEntry);
         IntLeaveCriticalSection(irqLock);
-        return (void*)newRegion->Beg;
+        return NULL;
     }
 
+    VirtRegion* newRegion = VirtRegionCreate(physical, virt, pages, protection, type, description);
+    VirtMapMemory(physical, virt, pages, protection, description);
+    VirtRegionTreeInsert(&VirtRegions, newRegion);
     IntLeaveCriticalSection(irqLock);
-    return NULL;
+    return (void*)virt;
 }
 
 void* VirtAllocUnaligned(kphys_t physical, size_t pages, int protection, int type, const char* description)
@@ -325,19 +386,12 @@ void* VirtAllocUnaligned(kphys_t physical, size_t pages, int protection, int typ
 void VirtFree(void* virtual)
 {
     uint32_t irqLock = IntEnterCriticalSection();
-    kvirt_t addr = KVIRT(virtual);
-    VirtRegion* region = VirtRegionListFirst();
-    while (region)
-    {
-        if (VirtRegionContainsVirt(region, addr))
-        {
-            VirtUnmapMemory(region->Beg, region->Size / KPAGE_SIZE, region->Description);
-            ListRemove(&region->ListEntry);
-            kfree(region);
-            IntLeaveCriticalSection(irqLock);
-            return;
-        }
-        region = VirtRegionListNext(region);
-    }
-    DbgPanic("VmmExFree failed, couldn't find virtual memory region");
+    VirtRegion* region = VirtRegionTreeFind(&VirtRegions, KVIRT(virtual));
+    if (region == NULL)
+        DbgPanic("VmmExFree failed, couldn't find virtual memory region");
+
+    VirtUnmapMemory(region->Beg, region->Size / KPAGE_SIZE, region->Description);
+    VirtRegionTreeRemove(&VirtRegions, region);
+    kfree(region);
+    IntLeaveCriticalSection(irqLock);
 }
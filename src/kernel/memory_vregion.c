@@ -0,0 +1,224 @@
+#include "debug.h"
+#include "memory.h"
+
+// Regions are kept in an AVL tree ordered by address. Every node also knows the span of its subtree and the largest
+// free gap between two regions of that subtree, which lets the gap search skip whole subtrees that can't fit a request.
+
+static inline int VirtRegionHeight(VirtRegion* region)
+{
+    return region ? region->Height : 0;
+}
+
+static void VirtRegionUpdate(VirtRegion* region)
+{
+    VirtRegion* left = region->Left;
+    VirtRegion* right = region->Right;
+    int leftHeight = VirtRegionHeight(left);
+    int rightHeight = VirtRegionHeight(right);
+    size_t maxGap = 0;
+
+    region->Height = 1 + (leftHeight > rightHeight ? leftHeight : rightHeight);
+    region->SubtreeBeg = left ? left->SubtreeBeg : region->Beg;
+    region->SubtreeEnd = right ? right->SubtreeEnd : region->End;
+
+    if (left)
+    {
+        size_t gap = region->Beg - left->SubtreeEnd;
+        maxGap = left->MaxGap > gap ? left->MaxGap : gap;
+    }
+    if (right)
+    {
+        size_t gap = right->SubtreeBeg - region->End;
+        if (gap > maxGap)
+            maxGap = gap;
+        if (right->MaxGap > maxGap)
+            maxGap = right->MaxGap;
+    }
+    region->MaxGap = maxGap;
+}
+
+static VirtRegion* VirtRegionRotateLeft(VirtRegion* region)
+{
+    VirtRegion* right = region->Right;
+    region->Right = right->Left;
+    right->Left = region;
+    VirtRegionUpdate(region);
+    VirtRegionUpdate(right);
+    return right;
+}
+
+static VirtRegion* VirtRegionRotateRight(VirtRegion* region)
+{
+    VirtRegion* left = region->Left;
+    region->Left = left->Right;
+    left->Right = region;
+    VirtRegionUpdate(region);
+    VirtRegionUpdate(left);
+    return left;
+}
+
+static VirtRegion* VirtRegionBalance(VirtRegion* region)
+{
+    VirtRegionUpdate(region);
+    int balance = VirtRegionHeight(region->Left) - VirtRegionHeight(region->Right);
+    if (balance > 1)
+    {
+        if (VirtRegionHeight(region->Left->Left) < VirtRegionHeight(region->Left->Right))
+            region->Left = VirtRegionRotateLeft(region->Left);
+        return VirtRegionRotateRight(region);
+    }
+    if (balance < -1)
+    {
+        if (VirtRegionHeight(region->Right->Right) < VirtRegionHeight(region->Right->Left))
+            region->Right = VirtRegionRotateRight(region->Right);
+        return VirtRegionRotateLeft(region);
+    }
+    return region;
+}
+
+static VirtRegion* VirtRegionInsertNode(VirtRegion* node, VirtRegion* entry, VirtRegion** prev)
+{
+    if (node == NULL)
+        return entry;
+
+    if (entry->Beg < node->Beg)
+    {
+        node->Left = VirtRegionInsertNode(node->Left, entry, prev);
+    }
+    else
+    {
+        *prev = node;
+        node->Right = VirtRegionInsertNode(node->Right, entry, prev);
+    }
+    return VirtRegionBalance(node);
+}
+
+static VirtRegion* VirtRegionRemoveMin(VirtRegion* node, VirtRegion** min)
+{
+    if (node->Left == NULL)
+    {
+        *min = node;
+        return node->Right;
+    }
+    node->Left = VirtRegionRemoveMin(node->Left, min);
+    return VirtRegionBalance(node);
+}
+
+static VirtRegion* VirtRegionRemoveNode(VirtRegion* node, VirtRegion* entry)
+{
+    DbgAssert(node != NULL);
+
+    if (node != entry)
+    {
+        if (entry->Beg < node->Beg)
+            node->Left = VirtRegionRemoveNode(node->Left, entry);
+        else
+            node->Right = VirtRegionRemoveNode(node->Right, entry);
+        return VirtRegionBalance(node);
+    }
+
+    if (node->Left == NULL)
+        return node->Right;
+    if (node->Right == NULL)
+        return node->Left;
+
+    VirtRegion* min;
+    VirtRegion* right = VirtRegionRemoveMin(node->Right, &min);
+    min->Left = node->Left;
+    min->Right = right;
+    return VirtRegionBalance(min);
+}
+
+// Lowest gap between two regions of the subtree that starts at or above lo and is at least size bytes long
+static kvirt_t VirtRegionFindGapNode(VirtRegion* node, kvirt_t lo, size_t size)
+{
+    if (node == NULL || node->MaxGap < size || node->SubtreeEnd <= lo)
+        return 0;
+
+    kvirt_t result = VirtRegionFindGapNode(node->Left, lo, size);
+    if (result != 0)
+        return result;
+
+    if (node->Left && node->Left->SubtreeEnd >= lo && node->Beg - node->Left->SubtreeEnd >= size)
+        return node->Left->SubtreeEnd;
+
+    if (node->Right && node->End >= lo && node->Right->SubtreeBeg - node->End >= size)
+        return node->End;
+
+    return VirtRegionFindGapNode(node->Right, lo, size);
+}
+
+void VirtRegionTreeInitialize(VirtRegionTree* tree)
+{
+    ListInitialize(&tree->List);
+    tree->Root = NULL;
+}
+
+void VirtRegionTreeInsert(VirtRegionTree* tree, VirtRegion* region)
+{
+    DbgAssert(!VirtRegionTreeOverlaps(tree, region->Beg, region->End));
+
+    VirtRegion* prev = NULL;
+    region->Left = NULL;
+    region->Right = NULL;
+    VirtRegionUpdate(region);
+    tree->Root = VirtRegionInsertNode(tree->Root, region, &prev);
+
+    if (prev)
+        ListInsertAfter(&prev->ListEntry, &region->ListEntry);
+    else
+        ListPushFront(&tree->List, &region->ListEntry);
+}
+
+void VirtRegionTreeRemove(VirtRegionTree* tree, VirtRegion* region)
+{
+    tree->Root = VirtRegionRemoveNode(tree->Root, region);
+    ListRemove(&region->ListEntry);
+}
+
+VirtRegion* VirtRegionTreeFind(VirtRegionTree* tree, kvirt_t addr)
+{
+    VirtRegion* node = tree->Root;
+    while (node)
+    {
+        if (addr < node->Beg)
+            node = node->Left;
+        else if (addr >= node->End)
+            node = node->Right;
+        else
+            return node;
+    }
+    return NULL;
+}
+
+bool VirtRegionTreeOverlaps(VirtRegionTree* tree, kvirt_t beg, kvirt_t end)
+{
+    VirtRegion* node = tree->Root;
+    while (node)
+    {
+        if (end <= node->Beg)
+            node = node->Left;
+        else if (beg >= node->End)
+            node = node->Right;
+        else
+            return true;
+    }
+    return false;
+}
+
+kvirt_t VirtRegionTreeFindGap(VirtRegionTree* tree, kvirt_t lo, kvirt_t hi, size_t size)
+{
+    VirtRegion* root = tree->Root;
+    if (root == NULL)
+        return hi - lo >= size ? lo : 0;
+
+    kvirt_t result = VirtRegionFindGapNode(root, lo, size);
+    if (result != 0)
+        return result;
+
+    // Space after the last region
+    kvirt_t tail = root->SubtreeEnd > lo ? root->SubtreeEnd : lo;
+    if (tail < hi && hi - tail >= size)
+        return tail;
+    return 0;
+}
@@ -20,58 +20,17 @@
 #define PT_FLAG_CACHEDISABLE (1 << 4)
 #define PT_FLAG_ACCESSED     (1 << 5)
 #define PT_FLAG_DIRTY        (1 << 7)
-#define PT_FLAG_GLOBAL       (1 << 9)
+#define PT_FLAG_GLOBAL       (1 << 8)
 
 extern PageDirectory* VirtPageDirectory;
 extern PageTable* VirtPageTables;
-extern ListHead VirtRegions;
+extern VirtRegionTree VirtRegions;
 
 VirtSpace* VirtSpaceActive = NULL;
 
 
 
 
-static inline bool VirtRegionOverlaps(VirtRegion* a, VirtRegion* b)
-{
-    return a->Beg < b->End && b->Beg < a->End;
-}
-
-static inline bool VirtRegionContainsVirt(VirtRegion* r, kvirt_t addr)
-{
-    return addr >= r->Beg && addr < r->End;
-}
-
-static inline bool VirtRegionContainsPhys(VirtRegion* r, kphys_t addr)
-{
-    return addr >= r->Physical && addr < (r->Physical + r->Size);
-}
-
-static inline VirtRegion* VirtSpaceFirstRegion(VirtSpace* space)
-{
-    return ListIsEmpty(&space->Regions) ? NULL : CONTAINING_RECORD(space->Regions.Next, VirtRegion, ListEntry);
-}
-
-static inline VirtRegion* VirtSpaceNextRegion(VirtSpace* space, VirtRegion* region)
-{
-    return region->ListEntry.Next == &space->Regions ? NULL : CONTAINING_RECORD(region->ListEntry.Next, VirtRegion, ListEntry);
-}
-
-static void VirtSpaceInsertRegion(VirtSpace* space, VirtRegion* entry)
-{
-    VirtRegion* region = VirtSpaceFirstRegion(space);
-    while (region)
-    {
-        if (entry->Beg <= region->Beg)
-        {
-            ListInsertBefore(&region->ListEntry, &entry->ListEntry);
-            return;
-        }
-        region = VirtSpaceNextRegion(space, region);
-    }
-
-    ListPushBack(&space->Regions, &entry->ListEntry);
-}
-
 static VirtRegion* VirtRegionCreate(kphys_t phys, kvirt_t virt, size_t pages, int protection, int type, const char* description)
 {
     VirtRegion* region = kalloc(sizeof(VirtRegion));
@@ -106,17 +65,34 @@ static void VirtSpaceMapMemory(VirtSpace* space, kphys_t physical, kvirt_t virtu
         size_t ptIdx = (virt >> 12) & 0x3FF;
         PageTable* table = space->PageTables + pdIdx;
         table->Entries[ptIdx] = phys | flags;
-
-        if (VirtSpaceActive == space)
-            pg_flushtlb(virt);
-
         phys += KPAGE_SIZE;
         virt += KPAGE_SIZE;
     }
 
+    if (VirtSpaceActive == space)
+        VirtFlushTlb(virtual, pages);
+
     TmPrintfVrb("VSmap   %8X to %8X    %-20s [%u MiB, %u KiB]\n", physical, virtual, reason, (pages * 4) / 1024, pages * 4);
 }
 
+static void VirtSpaceUnmapMemory(VirtSpace* space, kvirt_t virtual, size_t pages, const char* reason)
+{
+    kvirt_t virt = virtual;
+    for (size_t i = 0; i < pages; i++)
+    {
+        size_t pdIdx = virt >> 22;
+        size_t ptIdx = (virt >> 12) & 0x3FF;
+        PageTable* table = space->PageTables + pdIdx;
+        table->Entries[ptIdx] = 0;
+        virt += KPAGE_SIZE;
+    }
+
+    if (VirtSpaceActive == space)
+        VirtFlushTlb(virtual, pages);
+
+    TmPrintfVrb("VSunmap %8X          %-20s [%u MiB, %u KiB]\n", virtual, reason, (pages * 4) / 1024, pages * 4);
+}
+
 
 
 
@@ -129,10 +105,10 @@ VirtSpace* VirtSpaceCreate()
     space->PageDirPhys = pageDirPhys;
     space->PageDir = VirtAlloc(pageDirPhys, 1025, VIRT_PROT_READWRITE, VIRT_REGION_TYPE_KERNEL_PAGEDIR, "upagedir");
     space->PageTables = (PageTable*)(space->PageDir + 1);
-    ListInitialize(&space->Regions);
-    VirtSpaceInsertRegion(space, VirtRegionCreate(0, 0x00000000, 1, 0, VIRT_REGION_TYPE_USER_NULL, "u.null"));
-    VirtSpaceInsertRegion(space, VirtRegionCreate(0, 0x001FF000, 1, 0, VIRT_REGION_TYPE_USER_NULL, "u.alloc"));
-    space->BeginAlloc = CONTAINING_RECORD(space->Regions.Prev, VirtRegion, ListEntry);
+    VirtRegionTreeInitialize(&space->Regions);
+    VirtRegionTreeInsert(&space->Regions, VirtRegionCreate(0, 0x00000000, 1, 0, VIRT_REGION_TYPE_USER_NULL, "u.null"));
+    space->BeginAlloc = VirtRegionCreate(0, 0x001FF000, 1, 0, VIRT_REGION_TYPE_USER_NULL, "u.alloc");
+    VirtRegionTreeInsert(&space->Regions, space->BeginAlloc);
 
     kphys_t pageTablePhys = pageDirPhys + sizeof(PageDirectory);
     for (size_t i = 0; i < 768; i++)
@@ -143,11 +119,9 @@ VirtSpace* VirtSpaceCreate()
         pageTablePhys += KPAGE_SIZE;
     }
 
+    // Kernel page tables are shared, 4 MiB pages of the direct map are copied as they are
     for (size_t i = 768; i < 1024; i++)
-    {
-        PageTable* table = VirtPageTables + i;
-        space->PageDir->Entries[i] = KEARLY_VIRT_TO_PHYS(table) | PD_FLAG_READWRITE | PD_FLAG_PRESENT;
-    }
+        space->PageDir->Entries[i] = VirtPageDirectory->Entries[i];
 
     return space;
 }
@@ -177,7 +151,7 @@ void VirtSpaceDebugDump(VirtSpace* space)
     TmPrintf("Physical | Virtual  | End      | Size        | Description\n");
     TmPrintf("---------+----------+----------+-------------+-------------------------------\n");
 
-    VirtRegion* region = VirtSpaceFirstRegion(space);
+    VirtRegion* region = VirtRegionTreeFirst(&space->Regions);
     while (region)
     {
         TmPrintf(
@@ -188,13 +162,12 @@ void VirtSpaceDebugDump(VirtSpace* space)
             region->Size / 1024,
             region->Description,
             region->Type);
-        region = VirtSpaceNextRegion(space, region);
+        region = VirtRegionTreeNext(&space->Regions, region);
     }
 
-    ListEntry* entry = VirtRegions.Next;
-    while (entry != &VirtRegions)
+    region = VirtRegionTreeFirst(&VirtRegions);
+    while (region)
     {
-        region = CONTAINING_RECORD(entry, VirtRegion, ListEntry);
         TmPrintf(
             "%8X | %8X | %8X | %7u KiB | K  %s (%d)\n",
             region->Physical,
@@ -203,7 +176,7 @@ void VirtSpaceDebugDump(VirtSpace* space)
             region->Size / 1024,
             region->Description,
             region->Type);
-        entry = entry->Next;
+        region = VirtRegionTreeNext(&VirtRegions, region);
     }
     
     TmPrintf("\n");
@@ -218,15 +191,10 @@ void* VirtSpaceMap(VirtSpace* space, kphys_t physical, kvirt_t virtual, size_t p
 
     uint32_t irqLock = IntEnterCriticalSection();
     VirtRegion* newRegion = VirtRegionCreate(physical, virtual, pages, protection, type, description);
-    VirtRegion* region = VirtSpaceFirstRegion(space);
-    while (region)
-    {
-        DbgAssert(!VirtRegionOverlaps(region, newRegion));
-        region = VirtSpaceNextRegion(space, region);
-    }
+    DbgAssert(!VirtRegionTreeOverlaps(&space->Regions, newRegion->Beg, newRegion->End));
 
     VirtSpaceMapMemory(space, physical, virtual, pages, protection, description);
-    VirtSpaceInsertRegion(space, newRegion);
+    VirtRegionTreeInsert(&space->Regions, newRegion);
     IntLeaveCriticalSection(irqLock);
     return (void*)virtual;
 }
@@ -237,32 +205,29 @@ void* VirtSpaceAlloc(VirtSpace* space, kphys_t physical, size_t pages, int prote
     DbgAssert(pages > 0);
 
     uint32_t irqLock = IntEnterCriticalSection();
-    VirtRegion* newRegion = VirtRegionCreate(physical, 0, pages, protection, type, description);
-    VirtRegion* region = space->BeginAlloc;
-    while (region)
+    kvirt_t virt = VirtRegionTreeFindGap(&space->Regions, space->BeginAlloc->End, 0xC0000000, pages * KPAGE_SIZE);
+    if (virt == 0)
     {
-        VirtRegion* nextRegion = VirtSpaceNextRegion(space, region);
-
-        newRegion->Beg = region->End;
-        newRegion->End = region->End + newRegion->Size;
-
-        if (nextRegion && VirtRegionOverlaps(newRegion, nextRegion))
-        {
-            region = nextRegion;
-            continue;
-        }
-
-        VirtSpaceMapMemory(space, physical, newRegion->Beg, pages, protection, description);
-        ListInsertAfter(&region->ListEntry, &newRegion->ListEntry);
         IntLeaveCriticalSection(irqLock);
-        return (void*)newRegion->Beg;
+        return NULL;
     }
 
+    VirtRegion* newRegion = VirtRegionCreate(physical, virt, pages, protection, type, description);
+    VirtSpaceMapMemory(space, physical, virt, pages, protection, description);
+    VirtRegionTreeInsert(&space->Regions, newRegion);
     IntLeaveCriticalSection(irqLock);
-    return NULL;
+    return (void*)virt;
 }
 
 void VirtSpaceFree(VirtSpace* space, void* virtual)
 {
-    DbgPanic("not implemented");
+    uint32_t irqLock = IntEnterCriticalSection();
+    VirtRegion* region = VirtRegionTreeFind(&space->Regions, KVIRT(virtual));
+    if (region == NULL)
+        DbgPanic("VirtSpaceFree failed, couldn't find virtual memory region");
+
+    VirtSpaceUnmapMemory(space, region->Beg, region->Size / KPAGE_SIZE, region->Description);
+    VirtRegionTreeRemove(&space->Regions, region);
+    kfree(region);
+    IntLeaveCriticalSection(irqLock);
 }
@@ -0,0 +1,198 @@
+#include <string.h>
+#include "debug.h"
+#include "memory.h"
+#include "lowlevel.h"
+#include "textmode.h"
+#include "scheduler.h"
+#include "interrupts.h"
+
+// --------------------------------------------------------------------------------
+// Pools of pre-zeroed physical blocks, kept topped up by a low priority background
+// task, so PhysAllocZeroed doesn't have to clear memory on the caller's time.
+// --------------------------------------------------------------------------------
+
+#define PHYS_ZERO_POOL_MAX  32
+#define CPUID_GETFEATURES   1
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+
+typedef struct
+{
+    size_t Pages;  // Block size of this pool
+    size_t Target; // Blocks the background task keeps in the pool
+    size_t Count;
+    kphys_t Blocks[PHYS_ZERO_POOL_MAX];
+    uint64_t Hits;
+    uint64_t Misses;
+} PhysZeroPool;
+
+// Single pages (page tables, DMA headers), small virtqueues and default sized task stacks
+static PhysZeroPool PhysZeroPools[] =
+{
+    { .Pages = 1,   .Target = 32 },
+    { .Pages = 4,   .Target = 8  },
+    { .Pages = 256, .Target = 2  },
+};
+
+#define PHYS_ZERO_POOL_COUNT (sizeof(PhysZeroPools) / sizeof(PhysZeroPools[0]))
+
+static SchEvent* PhysZeroEvent = NULL;
+static bool PhysZeroNonTemporal = false;
+
+static void PhysZeroMemory(void* dst, size_t bytes)
+{
+    // movnti stores bypass the caches, clearing a 1 MiB stack doesn't evict everybody else's working set
+    if (!PhysZeroNonTemporal)
+    {
+        memset(dst, 0, bytes);
+        return;
+    }
+
+    uint32_t* ptr = dst;
+    uint32_t* end = ptr + bytes / sizeof(uint32_t);
+    for (; ptr < end; ptr += 8)
+    {
+        asm volatile(
+            "movnti %1, 0(%0)\n"
+            "movnti %1, 4(%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 12(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 20(%0)\n"
+            "movnti %1, 24(%0)\n"
+            "movnti %1, 28(%0)\n"
+            : : "r"(ptr), "r"(0) : "memory");
+    }
+    asm volatile("sfence": : :"memory");
+}
+
+static void PhysZeroPages(kphys_t phys, size_t pages)
+{
+    if (phys + pages * KPAGE_SIZE <= VirtDirectMapEnd)
+    {
+        PhysZeroMemory(PhysToVirt(phys), pages * KPAGE_SIZE);
+        return;
+    }
+
+    void* virt = VirtAlloc(phys, pages, VIRT_PROT_READWRITE, VIRT_REGION_TYPE_SCRATCH, "zero");
+    DbgAssert(virt != NULL);
+    PhysZeroMemory(virt, pages * KPAGE_SIZE);
+    VirtFree(virt);
+}
+
+static void PhysZeroRefill()
+{
+    // Only this task adds blocks, PhysAllocZeroed only takes them out
+    for (size_t i = 0; i < PHYS_ZERO_POOL_COUNT; i++)
+    {
+        PhysZeroPool* pool = &PhysZeroPools[i];
+        while (pool->Count < pool->Target)
+        {
+            kphys_t phys = PhysAlloc(pool->Pages, PHYS_REGION_TYPE_KERNEL_HEAP, "zeropool");
+            if (phys == 0)
+                return;
+            PhysZeroPages(phys, pool->Pages);
+
+            uint32_t irqLock = IntEnterCriticalSection();
+            pool->Blocks[pool->Count++] = phys;
+            IntLeaveCriticalSection(irqLock);
+            SchYield();
+        }
+    }
+}
+
+static uint32_t PhysZeroTask(void* ctx)
+{
+    while (true)
+    {
+        SchEventWait(PhysZeroEvent);
+        SchEventReset(PhysZeroEvent);
+        PhysZeroRefill();
+    }
+    return 0;
+}
+
+void PhysZeroInitialize()
+{
+    uint32_t eax, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &edx);
+    PhysZeroNonTemporal = (edx & CPUID_FEAT_EDX_SSE2) != 0;
+
+    PhysZeroEvent = SchCreateEvent();
+    SchTask* task = SchCreateTask("kzero", 0, PhysZeroTask, NULL);
+    SchSetPriority(task, SCH_PRIORITY_LOW);
+    SchEventSignal(PhysZeroEvent);
+}
+
+kphys_t PhysAllocZeroed(size_t pages, int type, const char* description)
+{
+    DbgAssert(pages > 0);
+
+    // Take a block from the smallest pool that fits and give back what isn't needed of it. A block more than twice
+    // the request is left alone, splitting it would cost more than clearing the pages here and the pool would
+    // run dry for the requests it is sized for.
+    for (size_t i = 0; i < PHYS_ZERO_POOL_COUNT; i++)
+    {
+        PhysZeroPool* pool = &PhysZeroPools[i];
+        if (pool->Pages < pages)
+            continue;
+        if (pool->Pages > pages * 2)
+            break;
+
+        kphys_t phys = 0;
+        uint32_t irqLock = IntEnterCriticalSection();
+        if (pool->Count > 0)
+        {
+            phys = pool->Blocks[--pool->Count];
+            pool->Hits++;
+        }
+        else
+            pool->Misses++;
+        IntLeaveCriticalSection(irqLock);
+
+        if (PhysZeroEvent != NULL)
+            SchEventSignal(PhysZeroEvent);
+        if (phys == 0)
+            break;
+
+        if (pool->Pages > pages)
+            PhysFreeRange(phys + pages * KPAGE_SIZE, pool->Pages - pages);
+        PhysSetOwner(phys, pages, type, description);
+        return phys;
+    }
+
+    // Nothing pooled for this size, clear it here
+    kphys_t phys = PhysAlloc(pages, type, description);
+    if (phys != 0)
+        PhysZeroPages(phys, pages);
+    return phys;
+}
+
+void PhysZeroDrain()
+{
+    // Memory is tight, the pooled blocks are worth more as free memory than as zeroed memory
+    for (size_t i = 0; i < PHYS_ZERO_POOL_COUNT; i++)
+    {
+        PhysZeroPool* pool = &PhysZeroPools[i];
+        while (true)
+        {
+            kphys_t phys = 0;
+            uint32_t irqLock = IntEnterCriticalSection();
+            if (pool->Count > 0)
+                phys = pool->Blocks[--pool->Count];
+            IntLeaveCriticalSection(irqLock);
+            if (phys == 0)
+                break;
+            PhysFree(phys);
+        }
+    }
+}
+
+void PhysZeroDebugDump()
+{
+    TmPrintfDbg("Zeroed page pools (%s):\n", PhysZeroNonTemporal ? "movnti" : "memset");
+    for (size_t i = 0; i < PHYS_ZERO_POOL_COUNT; i++)
+    {
+        PhysZeroPool* pool = &PhysZeroPools[i];
+        TmPrintfDbg("  %3u pages: %2u/%2u blocks, %llu hits, %llu misses\n", pool->Pages, pool->Count, pool->Target, pool->Hits, pool->Misses);
+    }
+}
@@ -0,0 +1,103 @@
+#include <string.h>
+#include "debug.h"
+#include "memory.h"
+#include "minheap.h"
+
+#define MINHEAP_INITIAL_CAPACITY 16
+
+static inline void MinHeapPlace(MinHeap* heap, size_t index, MinHeapEntry* entry)
+{
+    heap->Entries[index] = entry;
+    entry->Index = index;
+}
+
+static void MinHeapSiftUp(MinHeap* heap, size_t index)
+{
+    MinHeapEntry* entry = heap->Entries[index];
+    while (index > 0)
+    {
+        size_t parent = (index - 1) / 2;
+        if (heap->Entries[parent]->Key <= entry->Key)
+            break;
+        MinHeapPlace(heap, index, heap->Entries[parent]);
+        index = parent;
+    }
+    MinHeapPlace(heap, index, entry);
+}
+
+static void MinHeapSiftDown(MinHeap* heap, size_t index)
+{
+    MinHeapEntry* entry = heap->Entries[index];
+    while (true)
+    {
+        size_t child = index * 2 + 1;
+        if (child >= heap->Count)
+            break;
+        if (child + 1 < heap->Count && heap->Entries[child + 1]->Key < heap->Entries[child]->Key)
+            child++;
+        if (entry->Key <= heap->Entries[child]->Key)
+            break;
+        MinHeapPlace(heap, index, heap->Entries[child]);
+        index = child;
+    }
+    MinHeapPlace(heap, index, entry);
+}
+
+static void MinHeapGrow(MinHeap* heap)
+{
+    size_t capacity = heap->Capacity ? heap->Capacity * 2 : MINHEAP_INITIAL_CAPACITY;
+    MinHeapEntry** entries = kalloc(sizeof(MinHeapEntry*) * capacity);
+    DbgAssert(entries != NULL);
+    if (heap->Entries != NULL)
+    {
+        memcpy(entries, heap->Entries, sizeof(MinHeapEntry*) * heap->Count);
+        kfree(heap->Entries);
+    }
+    heap->Entries = entries;
+    heap->Capacity = capacity;
+}
+
+void MinHeapInitialize(MinHeap* heap)
+{
+    heap->Entries = NULL;
+    heap->Count = 0;
+    heap->Capacity = 0;
+}
+
+void MinHeapInsert(MinHeap* heap, MinHeapEntry* entry, uint64_t key)
+{
+    DbgAssert(!MinHeapEntryIsQueued(entry));
+    if (heap->Count == heap->Capacity)
+        MinHeapGrow(heap);
+
+    entry->Key = key;
+    MinHeapPlace(heap, heap->Count++, entry);
+    MinHeapSiftUp(heap, entry->Index);
+}
+
+void MinHeapRemove(MinHeap* heap, MinHeapEntry* entry)
+{
+    DbgAssert(MinHeapEntryIsQueued(entry) && entry->Index < heap->Count);
+    DbgAssert(heap->Entries[entry->Index] == entry);
+
+    size_t index = entry->Index;
+    MinHeapEntry* last = heap->Entries[--heap->Count];
+    entry->Index = MINHEAP_INVALID_INDEX;
+    if (last == entry)
+        return;
+
+    // Move the last entry into the hole and restore the heap property in whichever direction it's violated
+    MinHeapPlace(heap, index, last);
+    if (index > 0 && heap->Entries[(index - 1) / 2]->Key > last->Key)
+        MinHeapSiftUp(heap, index);
+    else
+        MinHeapSiftDown(heap, index);
+}
+
+MinHeapEntry* MinHeapPop(MinHeap* heap)
+{
+    MinHeapEntry* first = MinHeapPeek(heap);
+    if (first != NULL)
+        MinHeapRemove(heap, first);
+    return first;
+}
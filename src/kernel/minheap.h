@@ -0,0 +1,46 @@
+#ifndef KERNEL_MINHEAP_H
+#define KERNEL_MINHEAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MINHEAP_INVALID_INDEX ((size_t)~0u)
+
+// Intrusive binary min-heap keyed on a 64-bit value. Entries remember their
+// slot so they can be removed from the middle of the heap in O(log n).
+typedef struct MinHeapEntry_s
+{
+    uint64_t Key;
+    size_t Index;
+} MinHeapEntry;
+
+typedef struct MinHeap_s
+{
+    MinHeapEntry** Entries;
+    size_t Count;
+    size_t Capacity;
+} MinHeap;
+
+void MinHeapInitialize(MinHeap* heap);
+void MinHeapInsert(MinHeap* heap, MinHeapEntry* entry, uint64_t key);
+void MinHeapRemove(MinHeap* heap, MinHeapEntry* entry);
+MinHeapEntry* MinHeapPop(MinHeap* heap);
+
+static inline void MinHeapEntryInitialize(MinHeapEntry* entry)
+{
+    entry->Key = 0;
+    entry->Index = MINHEAP_INVALID_INDEX;
+}
+
+static inline bool MinHeapEntryIsQueued(MinHeapEntry* entry)
+{
+    return entry->Index != MINHEAP_INVALID_INDEX;
+}
+
+static inline MinHeapEntry* MinHeapPeek(MinHeap* heap)
+{
+    return heap->Count != 0 ? heap->Entries[0] : NULL;
+}
+
+#endif
@@ -1,11 +1,42 @@
 #include <acpi/acpi.h>
 #include "pci.h"
+#include "apic.h"
 #include "list.h"
 #include "debug.h"
+#include "ioapic.h"
 #include "memory.h"
 #include "textmode.h"
 #include "interrupts.h"
 
+// MSI capability registers, relative to the capability pointer
+#define PCI_MSI_CONTROL           0x02
+#define PCI_MSI_ADDRESS_LO        0x04
+#define PCI_MSI_ADDRESS_HI        0x08 // Only present with PCI_MSI_CONTROL_64BIT
+#define PCI_MSI_DATA_32           0x08
+#define PCI_MSI_DATA_64           0x0C
+#define PCI_MSI_CONTROL_ENABLE    (1 << 0)
+#define PCI_MSI_CONTROL_MME_MASK  (7 << 4) // Multiple Message Enable
+#define PCI_MSI_CONTROL_64BIT     (1 << 7)
+
+// MSI-X capability registers, relative to the capability pointer
+#define PCI_MSIX_CONTROL          0x02
+#define PCI_MSIX_TABLE            0x04 // Table offset in bits 31:3, BAR index in bits 2:0
+#define PCI_MSIX_CONTROL_SIZE     0x7FF
+#define PCI_MSIX_CONTROL_MASKALL  (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE   (1 << 15)
+
+// MSI-X table entries are 4 dwords
+#define PCI_MSIX_ENTRY_ADDRESS_LO 0
+#define PCI_MSIX_ENTRY_ADDRESS_HI 1
+#define PCI_MSIX_ENTRY_DATA       2
+#define PCI_MSIX_ENTRY_CONTROL    3
+#define PCI_MSIX_ENTRY_MASKED     (1 << 0)
+
+// Messages are written to the local APIC of the destination CPU and carry the vector in the data, using fixed
+// delivery and edge triggering
+#define PCI_MSI_ADDRESS(apicId)   (0xFEE00000 | ((uint32_t)(apicId) << 12))
+#define PCI_MSI_DATA(vector)      ((uint32_t)(vector))
+
 typedef struct PciDiscoverCallbackRecord_s
 {
     ListEntry List;
@@ -36,6 +67,14 @@ void PciInitialize()
     PciAcpiPrtSize = prtBuf.Length;
 }
 
+static uint8_t PciMapGsi(uint32_t gsi, uint8_t triggering, uint8_t polarity)
+{
+    // In APIC mode the interrupt numbers of link devices are GSIs, not ISA IRQs
+    uint8_t isr = IoApicMapGsi(gsi, IRQL_DEVICE_LO, polarity == ACPI_ACTIVE_LOW, triggering == ACPI_LEVEL_SENSITIVE);
+    DbgAssertMsg(isr != 0, "couldn't route GSI %u", gsi);
+    return isr;
+}
+
 uint8_t PciLookupIntPinISR(uint32_t bus, uint32_t device, uint8_t pciIntPin)
 {
     DbgAssert(bus == 0 /* PCI0 */);
@@ -52,7 +91,10 @@ uint8_t PciLookupIntPinISR(uint32_t bus, uint32_t device, uint8_t pciIntPin)
             TmPrintf("PRT Entry PCI Pin: INT%c#\n", 'A' + entry->Pin);
             TmPrintf("PRT Entry SrcName: %s\n", entry->Source);
             TmPrintf("PRT Entry SrcIdx:  %u\n", entry->SourceIndex);
-            DbgAssertMsg(entry->Source[0] != '\0', "currently only indirect PRT entries are supported");
+
+            // Entries without a source are hardwired to the GSI in SourceIndex, PCI interrupts are level triggered, active low
+            if (entry->Source[0] == '\0')
+                return PciMapGsi(entry->SourceIndex, ACPI_LEVEL_SENSITIVE, ACPI_ACTIVE_LOW);
 
             ACPI_HANDLE src = NULL;
             DbgAssert(ACPI_SUCCESS(AcpiGetHandle(NULL, entry->Source, &src)));
@@ -71,8 +113,9 @@ uint8_t PciLookupIntPinISR(uint32_t bus, uint32_t device, uint8_t pciIntPin)
                     if (irq->InterruptCount != 0)
                     {
                         DbgAssert(irq->InterruptCount == 1);
+                        uint8_t isr = PciMapGsi(irq->Interrupts[0], irq->Triggering, irq->Polarity);
                         ACPI_FREE(buf.Pointer);
-                        return IntApicIrqToIsr(irq->Interrupts[0]); // TODO: are these ISA IRQs or IOAPIC GSIs?
+                        return isr;
                     }
                 }
                 else if (res->Type == ACPI_RESOURCE_TYPE_EXTENDED_IRQ)
@@ -82,8 +125,9 @@ uint8_t PciLookupIntPinISR(uint32_t bus, uint32_t device, uint8_t pciIntPin)
                     if (irq->InterruptCount != 0)
                     {
                         DbgAssert(irq->InterruptCount == 1);
+                        uint8_t isr = PciMapGsi(irq->Interrupts[0], irq->Triggering, irq->Polarity);
                         ACPI_FREE(buf.Pointer);
-                        return IntApicIrqToIsr(irq->Interrupts[0]); // TODO: are these ISA IRQs or IOAPIC GSIs?
+                        return isr;
                     }
                 }
                 res = (ACPI_RESOURCE*)((uint8_t*)res + res->Length);
@@ -135,6 +179,132 @@ void PciDiscoverDevices()
     PciCheckAllBuses();
 }
 
+uint8_t PciFindCapability(uint32_t bus, uint32_t device, uint32_t function, uint8_t capId)
+{
+    if ((PciReadWord(bus, device, function, PCI_OFFSET_STATUS) & PCI_STATUS_CAP_LIST) == 0)
+        return 0x00;
+
+    uint8_t capPtr = PciReadByte(bus, device, function, PCI_OFFSET_CAP_PTR) & 0xFC;
+    for (int guard = 0; capPtr != 0x00 && guard < 48; guard++)
+    {
+        if (PciReadByte(bus, device, function, capPtr) == capId)
+            return capPtr;
+        capPtr = PciReadByte(bus, device, function, capPtr + 1) & 0xFC;
+    }
+    return 0x00;
+}
+
+static void PciSetIntxDisabled(uint32_t bus, uint32_t device, uint32_t function, bool disabled)
+{
+    uint16_t command = PciReadWord(bus, device, function, PCI_OFFSET_COMMAND);
+    command = disabled ? command | PCI_COMMAND_INTX_DISABLE : command & ~PCI_COMMAND_INTX_DISABLE;
+    PciWriteWord(bus, device, function, PCI_OFFSET_COMMAND, command);
+}
+
+bool PciMsiEnable(uint32_t bus, uint32_t device, uint32_t function, uint8_t vector)
+{
+    uint8_t cap = PciFindCapability(bus, device, function, PCI_CAP_ID_MSI);
+    if (cap == 0x00)
+        return false;
+
+    // Only a single message is used, so Multiple Message Enable stays 0
+    uint16_t control = PciReadWord(bus, device, function, cap + PCI_MSI_CONTROL);
+    control &= ~(PCI_MSI_CONTROL_ENABLE | PCI_MSI_CONTROL_MME_MASK);
+    PciWriteWord(bus, device, function, cap + PCI_MSI_CONTROL, control);
+
+    PciWriteLong(bus, device, function, cap + PCI_MSI_ADDRESS_LO, PCI_MSI_ADDRESS(ApicGetId()));
+    if (control & PCI_MSI_CONTROL_64BIT)
+    {
+        PciWriteLong(bus, device, function, cap + PCI_MSI_ADDRESS_HI, 0);
+        PciWriteWord(bus, device, function, cap + PCI_MSI_DATA_64, PCI_MSI_DATA(vector));
+    }
+    else
+        PciWriteWord(bus, device, function, cap + PCI_MSI_DATA_32, PCI_MSI_DATA(vector));
+
+    PciSetIntxDisabled(bus, device, function, true);
+    PciWriteWord(bus, device, function, cap + PCI_MSI_CONTROL, control | PCI_MSI_CONTROL_ENABLE);
+    TmPrintfVrb("PCI %u:%u.%u using MSI with ISR%02Xh\n", bus, device, function, vector);
+    return true;
+}
+
+void PciMsiDisable(uint32_t bus, uint32_t device, uint32_t function)
+{
+    uint8_t cap = PciFindCapability(bus, device, function, PCI_CAP_ID_MSI);
+    if (cap == 0x00)
+        return;
+
+    uint16_t control = PciReadWord(bus, device, function, cap + PCI_MSI_CONTROL);
+    PciWriteWord(bus, device, function, cap + PCI_MSI_CONTROL, control & ~PCI_MSI_CONTROL_ENABLE);
+    PciSetIntxDisabled(bus, device, function, false);
+}
+
+bool PciMsiXInitialize(PciMsiX* msix, uint32_t bus, uint32_t device, uint32_t function)
+{
+    uint8_t cap = PciFindCapability(bus, device, function, PCI_CAP_ID_MSIX);
+    if (cap == 0x00)
+        return false;
+
+    uint16_t control = PciReadWord(bus, device, function, cap + PCI_MSIX_CONTROL);
+    uint32_t table = PciReadLong(bus, device, function, cap + PCI_MSIX_TABLE);
+    uint32_t bir = table & 7;
+    if (bir > 5)
+        return false;
+    uint32_t bar = PciReadLong(bus, device, function, PCI_OFFSET_BAR0 + bir * 4);
+    if ((bar & 1) != 0)
+        return false; // The table must live in a memory BAR
+
+    msix->Bus = bus;
+    msix->Device = device;
+    msix->Function = function;
+    msix->CapPtr = cap;
+    msix->TableSize = (control & PCI_MSIX_CONTROL_SIZE) + 1;
+
+    kphys_t tablePhys = (bar & 0xFFFFFFF0) + (table & ~7);
+    size_t tableBytes = (tablePhys & (KPAGE_SIZE - 1)) + msix->TableSize * 16;
+    msix->Table = VirtAllocUnaligned(tablePhys, KPAGE_COUNT(tableBytes), VIRT_PROT_READWRITE | VIRT_PROT_NOCACHE, VIRT_REGION_TYPE_HARDWARE, "msix");
+
+    // Every entry starts out masked until a vector is assigned to it
+    for (uint16_t entry = 0; entry < msix->TableSize; entry++)
+        msix->Table[entry * 4 + PCI_MSIX_ENTRY_CONTROL] |= PCI_MSIX_ENTRY_MASKED;
+    return true;
+}
+
+void PciMsiXSetVector(PciMsiX* msix, uint16_t entry, uint8_t vector)
+{
+    DbgAssert(entry < msix->TableSize);
+    volatile uint32_t* slot = &msix->Table[entry * 4];
+    slot[PCI_MSIX_ENTRY_CONTROL] |= PCI_MSIX_ENTRY_MASKED;
+    slot[PCI_MSIX_ENTRY_ADDRESS_LO] = PCI_MSI_ADDRESS(ApicGetId());
+    slot[PCI_MSIX_ENTRY_ADDRESS_HI] = 0;
+    slot[PCI_MSIX_ENTRY_DATA] = PCI_MSI_DATA(vector);
+    slot[PCI_MSIX_ENTRY_CONTROL] &= ~PCI_MSIX_ENTRY_MASKED;
+}
+
+void PciMsiXMaskEntry(PciMsiX* msix, uint16_t entry, bool mask)
+{
+    DbgAssert(entry < msix->TableSize);
+    volatile uint32_t* control = &msix->Table[entry * 4 + PCI_MSIX_ENTRY_CONTROL];
+    *control = mask ? *control | PCI_MSIX_ENTRY_MASKED : *control & ~PCI_MSIX_ENTRY_MASKED;
+}
+
+void PciMsiXEnable(PciMsiX* msix)
+{
+    uint16_t control = PciReadWord(msix->Bus, msix->Device, msix->Function, msix->CapPtr + PCI_MSIX_CONTROL);
+    control = (control | PCI_MSIX_CONTROL_ENABLE) & ~PCI_MSIX_CONTROL_MASKALL;
+    PciSetIntxDisabled(msix->Bus, msix->Device, msix->Function, true);
+    PciWriteWord(msix->Bus, msix->Device, msix->Function, msix->CapPtr + PCI_MSIX_CONTROL, control);
+}
+
+void PciMsiXDestroy(PciMsiX* msix)
+{
+    uint16_t control = PciReadWord(msix->Bus, msix->Device, msix->Function, msix->CapPtr + PCI_MSIX_CONTROL);
+    PciWriteWord(msix->Bus, msix->Device, msix->Function, msix->CapPtr + PCI_MSIX_CONTROL, control & ~PCI_MSIX_CONTROL_ENABLE);
+    PciSetIntxDisabled(msix->Bus, msix->Device, msix->Function, false);
+    VirtFree((void*)msix->Table);
+    msix->Table = NULL;
+    msix->TableSize = 0;
+}
+
 static void PciCheckAllBuses()
 {
     uint8_t headerType = PciReadByte(0, 0, 0, PCI_OFFSET_HEADER_TYPE);
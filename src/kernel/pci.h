@@ -1,6 +1,7 @@
 #ifndef KERNEL_PCI_H
 #define KERNEL_PCI_H
 
+#include <stdbool.h>
 #include "lowlevel.h"
 
 #define PCI_ADDRESS_PORT 0xCF8
@@ -31,6 +32,23 @@
 #define PCI_INT_PIN_INTC         0x03
 #define PCI_INT_PIN_INTD         0x04
 
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAP_LIST      (1 << 4)
+
+#define PCI_CAP_ID_MSI           0x05
+#define PCI_CAP_ID_VNDR          0x09
+#define PCI_CAP_ID_MSIX          0x11
+
+typedef struct PciMsiX_s
+{
+    uint32_t Bus;
+    uint32_t Device;
+    uint32_t Function;
+    uint8_t CapPtr;
+    uint16_t TableSize;
+    volatile uint32_t* Table;
+} PciMsiX;
+
 typedef struct PciDeviceInfo_s
 {
     uint32_t Bus;
@@ -49,6 +67,14 @@ uint8_t PciLookupIntPinISR(uint32_t bus, uint32_t device, uint8_t pciIntPin);
 void PciRegisterDiscoverCallback(PciDiscoverCallbackFn fn, void* ctx);
 void PciUnregisterDiscoverCallback(PciDiscoverCallbackFn fn);
 void PciDiscoverDevices();
+uint8_t PciFindCapability(uint32_t bus, uint32_t device, uint32_t function, uint8_t capId);
+bool PciMsiEnable(uint32_t bus, uint32_t device, uint32_t function, uint8_t vector);
+void PciMsiDisable(uint32_t bus, uint32_t device, uint32_t function);
+bool PciMsiXInitialize(PciMsiX* msix, uint32_t bus, uint32_t device, uint32_t function);
+void PciMsiXSetVector(PciMsiX* msix, uint16_t entry, uint8_t vector);
+void PciMsiXMaskEntry(PciMsiX* msix, uint16_t entry, bool mask);
+void PciMsiXEnable(PciMsiX* msix);
+void PciMsiXDestroy(PciMsiX* msix);
 
 static inline uint8_t PciReadByte(uint32_t bus, uint32_t device, uint32_t function, uint32_t offset)
 {
@@ -1,14 +1,46 @@
 #include "pit.h"
 #include "lowlevel.h"
 
+#define PIT_PORT_CH0_DATA 0x40
+#define PIT_PORT_CH2_DATA 0x42
+#define PIT_PORT_COMMAND  0x43
+#define PIT_PORT_CH2_GATE 0x61 // NMI status and control port, bits 0/1/5 belong to channel 2
+
+#define PIT_CH2_GATE    (1 << 0) // Channel 2 counts while set
+#define PIT_CH2_SPEAKER (1 << 1) // Connects channel 2 output to the PC speaker
+#define PIT_CH2_OUT     (1 << 5) // Channel 2 output (read only)
+
 uint32_t PitFrequency = 0;
+uint32_t PitDivisor = 0;
 uint64_t PitCurrentTick = 0;
 
 void PitInitialize(uint32_t frequency)
 {
     PitFrequency = frequency;
-    uint32_t divisor = 1193180 / frequency;
-    outb(0x43, 0x36);
-    outb(0x40, divisor & 0xFF);
-    outb(0x40, (divisor >> 8) & 0xFF);
+    PitDivisor = PIT_BASE_FREQUENCY / frequency;
+    outb(PIT_PORT_COMMAND, 0x36);
+    outb(PIT_PORT_CH0_DATA, PitDivisor & 0xFF);
+    outb(PIT_PORT_CH0_DATA, (PitDivisor >> 8) & 0xFF);
+}
+
+void PitChannel2Start(uint16_t reload)
+{
+    // Square wave (mode 3) on channel 2 with the speaker disconnected. The output toggles every reload/2
+    // PIT clocks, which can be polled without interrupts.
+    uint8_t control = inb(PIT_PORT_CH2_GATE);
+    outb(PIT_PORT_CH2_GATE, control & ~(PIT_CH2_GATE | PIT_CH2_SPEAKER));
+    outb(PIT_PORT_COMMAND, 0xB6); // channel 2, lobyte/hibyte, mode 3, binary
+    outb(PIT_PORT_CH2_DATA, reload & 0xFF);
+    outb(PIT_PORT_CH2_DATA, (reload >> 8) & 0xFF);
+    outb(PIT_PORT_CH2_GATE, (control & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+}
+
+void PitChannel2Stop()
+{
+    outb(PIT_PORT_CH2_GATE, inb(PIT_PORT_CH2_GATE) & ~(PIT_CH2_GATE | PIT_CH2_SPEAKER));
+}
+
+bool PitChannel2ReadOut()
+{
+    return (inb(PIT_PORT_CH2_GATE) & PIT_CH2_OUT) != 0;
 }
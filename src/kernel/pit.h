@@ -2,11 +2,32 @@
 #define KERNEL_PIT_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#define PIT_BASE_FREQUENCY 1193182 // Hz
 
 extern uint32_t PitFrequency;
+extern uint32_t PitDivisor;
 extern uint64_t PitCurrentTick;
 
 void PitInitialize(uint32_t frequency);
+void PitChannel2Start(uint16_t reload);
+void PitChannel2Stop();
+bool PitChannel2ReadOut();
+
+// PitCurrentTick is only written by the timer interrupt, but 32-bit code reads it in two halves.
+// Retry if the high half changed while we read the low half.
+static inline uint64_t PitReadCurrentTick()
+{
+    volatile uint32_t* halves = (volatile uint32_t*)&PitCurrentTick;
+    uint32_t hi, lo;
+    do
+    {
+        hi = halves[1];
+        lo = halves[0];
+    } while (hi != halves[1]);
+    return ((uint64_t)hi << 32) | lo;
+}
 
 static inline uint64_t PitTicksToMs(uint64_t ticks)
 {
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "tsc.h"
+#include "clock.h"
+#include "debug.h"
+#include "comport.h"
+#include "profiler.h"
+#include "textmode.h"
+#include "interrupts.h"
+
+// --------------------------------------------------------------------------------
+// Boot time profiler. Spans record raw TSC timestamps, which only get converted to
+// time when dumped, so spans can be opened before the TSC is calibrated (and before
+// the heap exists, hence the static storage).
+// --------------------------------------------------------------------------------
+
+#define PROF_MAX_SPANS 64
+#define PROF_MAX_DEPTH 8
+#define PROF_NO_PARENT -1
+
+typedef struct ProfSpan_s
+{
+    const char* name;
+    int parent;
+    int depth;
+    uint64_t start;
+    uint64_t end;
+    uint64_t children; // total cycles spent in child spans
+} ProfSpan;
+
+static ProfSpan ProfSpans[PROF_MAX_SPANS];
+static int ProfSpanCount = 0;
+static int ProfOpen[PROF_MAX_DEPTH];
+static int ProfOpenCount = 0;
+
+void ProfBegin(const char* name)
+{
+    uint64_t now = rdtsc();
+    uint32_t irqLock = IntEnterCriticalSection();
+    DbgAssert(ProfOpenCount < PROF_MAX_DEPTH);
+    if (ProfSpanCount == PROF_MAX_SPANS)
+    {
+        // Out of spans, still track nesting so ProfEnd stays balanced
+        ProfOpen[ProfOpenCount++] = PROF_NO_PARENT;
+        IntLeaveCriticalSection(irqLock);
+        return;
+    }
+
+    ProfSpan* span = &ProfSpans[ProfSpanCount];
+    span->name = name;
+    span->parent = ProfOpenCount > 0 ? ProfOpen[ProfOpenCount - 1] : PROF_NO_PARENT;
+    span->depth = ProfOpenCount;
+    span->start = now;
+    span->end = 0;
+    span->children = 0;
+    ProfOpen[ProfOpenCount++] = ProfSpanCount++;
+    IntLeaveCriticalSection(irqLock);
+}
+
+void ProfEnd()
+{
+    uint64_t now = rdtsc();
+    uint32_t irqLock = IntEnterCriticalSection();
+    DbgAssert(ProfOpenCount > 0);
+    int index = ProfOpen[--ProfOpenCount];
+    if (index != PROF_NO_PARENT)
+    {
+        ProfSpan* span = &ProfSpans[index];
+        span->end = now;
+        if (span->parent != PROF_NO_PARENT)
+            ProfSpans[span->parent].children += span->end - span->start;
+    }
+    IntLeaveCriticalSection(irqLock);
+}
+
+static size_t ProfFormatPath(int index, char* buf, size_t cap)
+{
+    size_t len = 0;
+    if (ProfSpans[index].parent != PROF_NO_PARENT)
+    {
+        len = ProfFormatPath(ProfSpans[index].parent, buf, cap);
+        if (len + 1 < cap)
+            buf[len++] = '/';
+    }
+    for (const char* c = ProfSpans[index].name; *c && len + 1 < cap; c++)
+        buf[len++] = *c;
+    buf[len] = '\0';
+    return len;
+}
+
+static uint64_t ProfSpanCycles(const ProfSpan* span)
+{
+    // Spans that are still open are measured up to now
+    return (span->end != 0 ? span->end : rdtsc()) - span->start;
+}
+
+void ProfDump()
+{
+    // Sort by total time, longest first
+    int order[PROF_MAX_SPANS];
+    for (int i = 0; i < ProfSpanCount; i++)
+    {
+        int j = i;
+        uint64_t cycles = ProfSpanCycles(&ProfSpans[i]);
+        while (j > 0 && ProfSpanCycles(&ProfSpans[order[j - 1]]) < cycles)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    TmPrintf("Boot profile (%d spans):\n", ProfSpanCount);
+    TmPrintf("    total ms     self ms   span\n");
+    for (int i = 0; i < ProfSpanCount; i++)
+    {
+        const ProfSpan* span = &ProfSpans[order[i]];
+        uint64_t totalUs = ClockCyclesToNs(ProfSpanCycles(span)) / 1000;
+        uint64_t selfUs = ClockCyclesToNs(ProfSpanCycles(span) - span->children) / 1000;
+        char path[128];
+        ProfFormatPath(order[i], path, sizeof(path));
+        TmPrintf("  %6llu.%03llu  %6llu.%03llu   %s\n", totalUs / 1000, totalUs % 1000, selfUs / 1000, selfUs % 1000, path);
+    }
+}
+
+void ProfExport()
+{
+    // One line per span in the order they were opened, times in nanoseconds relative to the first span
+    uint64_t origin = ProfSpanCount > 0 ? ProfSpans[0].start : 0;
+    ComWriteString("BOOTPROF,span,depth,start_ns,total_ns,self_ns\n");
+    for (int i = 0; i < ProfSpanCount; i++)
+    {
+        const ProfSpan* span = &ProfSpans[i];
+        char path[128];
+        ProfFormatPath(i, path, sizeof(path));
+        ComPrintf("BOOTPROF,%s,%d,%llu,%llu,%llu\n", path, span->depth,
+                  ClockCyclesToNs(span->start - origin),
+                  ClockCyclesToNs(ProfSpanCycles(span)),
+                  ClockCyclesToNs(ProfSpanCycles(span) - span->children));
+    }
+}
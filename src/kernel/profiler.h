@@ -0,0 +1,14 @@
+#ifndef KERNEL_PROFILER_H
+#define KERNEL_PROFILER_H
+
+// Boot time profiler. Spans can be nested, e.g.:
+//     ProfBegin("MemInitialize");
+//     MemInitialize(info);
+//     ProfEnd();
+
+void ProfBegin(const char* name);
+void ProfEnd();
+void ProfDump();
+void ProfExport();
+
+#endif
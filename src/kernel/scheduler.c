@@ -1,6 +1,7 @@
-#include <string.h>
 #include "pit.h"
 #include "tsc.h"
+#include "apic.h"
+#include "timer.h"
 #include "debug.h"
 #include "memory.h"
 #include "textmode.h"
@@ -9,76 +10,125 @@
 
 SchTask SchKernelTask = {0};
 SchTask* SchCurrentTask = NULL;
-SchTask* SchFirstSleepTask = NULL;
 SListHead SchDeadTaskListHead;
 static uint32_t SchNextTaskId = 1;
 
+// Sleeping tasks and waiters with a timeout, ordered by wake-up time (TSC)
+static MinHeap SchSleepQueue;
+
+// Tick accounting. The APIC timer runs in one-shot mode and is armed for the earliest of the next preemption
+// tick, sleeper and kernel timer, so the tick count is derived from the TSC.
+static uint64_t SchTickBase = 0;
+static uint64_t SchTickBaseTsc = 0;
+static uint64_t SchTscPerTick = 0;
+static uint64_t SchNextTickTsc = 0;
+static uint64_t SchTimerDeadline = 0; // what the APIC timer is armed for, 0 if it needs re-arming
+
+// Waits shorter than this are spun instead of blocking, see SchDelay
+#define SCH_DELAY_SPIN_MICROSECS 50
+
+// One FIFO per priority level, plus a bitmap of which levels are non-empty.
+// Runnable tasks (including the current one) are always in their run queue.
+static ListHead SchRunQueues[SCH_PRIORITY_COUNT];
+static uint32_t SchRunQueueBitmap = 0;
+
 static void SchRunListInsert(SchTask* task)
 {
-    task->next = SchKernelTask.next;
-    SchKernelTask.next = task;
+    ListPushBack(&SchRunQueues[task->priority], &task->runList);
+    SchRunQueueBitmap |= 1u << task->priority;
 }
 
-static SchTask* SchRunListRemove(SchTask* task)
+static void SchRunListRemove(SchTask* task)
 {
-    SchTask* next = task->next;
-    SchTask* prev = &SchKernelTask;
-    while (prev->next != task)
-        prev = prev->next;
-    prev->next = next;
-    task->next = NULL;
-    return next;
+    ListRemove(&task->runList);
+    task->runList.Next = NULL;
+    task->runList.Prev = NULL;
+    if (ListIsEmpty(&SchRunQueues[task->priority]))
+        SchRunQueueBitmap &= ~(1u << task->priority);
 }
 
-static void SchSleepListInsert(SchTask* task, uint64_t sleepUntil)
+static inline bool SchRunListContains(SchTask* task)
 {
-    task->sleepUntil = sleepUntil;
+    return task->runList.Next != NULL;
+}
 
-    SchTask** prevNext = &SchFirstSleepTask;
-    SchTask* entry = SchFirstSleepTask;
-    while (entry)
-    {
-        if (task->sleepUntil < entry->sleepUntil)
-        {
-            *prevNext = task;
-            task->sleepNext = entry;
-            break;
-        }
+static SchTask* SchRunListPickNext()
+{
+    if (SchRunQueueBitmap == 0)
+        return NULL;
+    ListHead* queue = &SchRunQueues[bsr(SchRunQueueBitmap)];
+    return CONTAINING_RECORD(queue->Next, SchTask, runList);
+}
 
-        prevNext = &entry->sleepNext;
-        entry = entry->sleepNext;
-    }
+static void SchSwitchTo(SchTask* task)
+{
+    // We may be called from an interrupt handler, stop timing it before running another task. The IRQL belongs
+    // to the task, the one switching back to us may have run at a different level.
+    irql_t irql = IrqlGetCurrent();
+    IntStatsEnd();
+    SchSwitchTask(task);
+    IrqlSetCurrent(irql);
+}
 
-    if (!entry)
+static void SchSwitchToNext()
+{
+    // If nothing is runnable we wait here (on the stack of the task that just blocked) until an
+    // interrupt makes something runnable. The timer handler will switch away from us when it does.
+    SchTask* next;
+    while ((next = SchRunListPickNext()) == NULL)
     {
-        *prevNext = task;
-        task->sleepNext = NULL;
+        SchUpdateTimer();
+        asm volatile("sti\n\thlt\n\tcli");
     }
+    SchUpdateTimer();
+    SchSwitchTo(next);
+}
+
+static void SchSleepListInsert(SchTask* task, uint64_t sleepUntil)
+{
+    MinHeapInsert(&SchSleepQueue, &task->sleepEntry, sleepUntil);
 }
 
 static void SchSleepListRemove(SchTask* task)
 {
-    SchTask** prevNext = &SchFirstSleepTask;
-    while (*prevNext)
-    {
-        if (*prevNext == task)
-        {
-            *prevNext = task->sleepNext;
-            break;
-        }
-        prevNext = &(*prevNext)->next;
-    }
-    task->sleepNext = NULL;
-    task->sleepUntil = 0;
+    if (MinHeapEntryIsQueued(&task->sleepEntry))
+        MinHeapRemove(&SchSleepQueue, &task->sleepEntry);
+}
+
+static SchTask* SchSleepListPopExpired(uint64_t now)
+{
+    MinHeapEntry* first = MinHeapPeek(&SchSleepQueue);
+    if (first == NULL || first->Key > now)
+        return NULL;
+    MinHeapRemove(&SchSleepQueue, first);
+    return CONTAINING_RECORD(first, SchTask, sleepEntry);
 }
 
-static SchTask* SchSleepListPop()
+void SchUpdateTimer()
 {
-    SchTask* sleeper = SchFirstSleepTask;
-    SchFirstSleepTask = sleeper->sleepNext;
-    sleeper->sleepNext = NULL;
-    sleeper->sleepUntil = 0;
-    return sleeper;
+    uint64_t deadline = TimerNextDeadline();
+    MinHeapEntry* firstSleeper = MinHeapPeek(&SchSleepQueue);
+    if (firstSleeper && firstSleeper->Key < deadline)
+        deadline = firstSleeper->Key;
+
+    // Something other than the idle task is runnable, we need the preemption tick. Otherwise we're
+    // tickless and only wake up for the next sleeper or timer.
+    if ((SchRunQueueBitmap & ~(1u << SCH_PRIORITY_IDLE)) != 0)
+    {
+        uint64_t now = rdtsc();
+        if (SchNextTickTsc <= now)
+            SchNextTickTsc = now + SchTscPerTick;
+        if (SchNextTickTsc < deadline)
+            deadline = SchNextTickTsc;
+    }
+
+    if (deadline == SchTimerDeadline)
+        return;
+    if (deadline != TIMER_NO_DEADLINE)
+        ApicTimerStartOneShot(deadline);
+    else
+        ApicTimerStop();
+    SchTimerDeadline = deadline;
 }
 
 static void SchWaitListAppend(SchWaitList* list, SchTask* task)
@@ -101,7 +151,7 @@ static void SchWaitListRemove(SchTask* task, bool timeout)
             *prevNext = task->waitNext;
             break;
         }
-        prevNext = &(*prevNext)->next;
+        prevNext = &(*prevNext)->waitNext;
     }
     task->waitNext = NULL;
     task->waitList = NULL;
@@ -121,31 +171,40 @@ static SchTask* SchWaitListPop(SchWaitList* list, bool timeout)
 SchTask* SchInitialize(const char* name)
 {
     SListInitialize(&SchDeadTaskListHead);
-    SchKernelTask.next = &SchKernelTask;
+    MinHeapInitialize(&SchSleepQueue);
+    for (size_t i = 0; i < SCH_PRIORITY_COUNT; i++)
+        ListInitialize(&SchRunQueues[i]);
+
     SchKernelTask.id = SchNextTaskId++;
     SchKernelTask.name = name;
     SchKernelTask.esp = 0;
     SchKernelTask.status = SCH_STATUS_RUNNING;
-    SchKernelTask.sleepNext = NULL;
-    SchKernelTask.sleepUntil = 0;
+    SchKernelTask.priority = SCH_PRIORITY_NORMAL; // Boot continues on this task, it drops to idle in SchIdle
+    MinHeapEntryInitialize(&SchKernelTask.sleepEntry);
     SchKernelTask.waitNext = NULL;
     SchKernelTask.waitList = NULL;
     SchKernelTask.waitTimeout = false;
+    SchRunListInsert(&SchKernelTask);
     SchCurrentTask = &SchKernelTask;
+    SchTickBase = PitCurrentTick;
+    SchTickBaseTsc = rdtsc();
+    SchTscPerTick = TscFrequency / PitFrequency;
+    SchNextTickTsc = SchTickBaseTsc + SchTscPerTick;
     return &SchKernelTask;
 }
 
 static void SchTaskFnWrapper(SchTaskFn fn, void* ctx)
 {
+    IrqlSetCurrent(IRQL_STANDARD);
     TmPrintfVrb("Task #%d - %s started\n", SchCurrentTask->id, SchCurrentTask->name);
     uint32_t ret = fn(ctx);
     TmPrintfVrb("Task #%d - %s finished with return code: %u (0x%08X)\n", SchCurrentTask->id, SchCurrentTask->name, ret, ret);
 
     IntDisableIRQs();
-    SchTask* next = SchRunListRemove(SchCurrentTask);
+    SchRunListRemove(SchCurrentTask);
     SchCurrentTask->status = SCH_STATUS_DEAD;
     SListPushFront(&SchDeadTaskListHead, &SchCurrentTask->deadList);
-    SchSwitchTask(next);
+    SchSwitchToNext();
 }
 
 SchTask* SchCreateTask(const char* name, size_t stackSize, SchTaskFn fn, void* ctx)
@@ -155,10 +214,9 @@ SchTask* SchCreateTask(const char* name, size_t stackSize, SchTaskFn fn, void* c
 
     // alloc stack
     size_t stackPages = (stackSize + (KPAGE_SIZE - 1)) / KPAGE_SIZE;
-    kphys_t stackPhys = PhysAlloc(stackPages, PHYS_REGION_TYPE_KERNEL_TASK_STACK, "TaskStack");
+    kphys_t stackPhys = PhysAllocZeroed(stackPages, PHYS_REGION_TYPE_KERNEL_TASK_STACK, "TaskStack");
     uint8_t* stackVirt = VirtAlloc(stackPhys, stackPages, VIRT_PROT_READWRITE, VIRT_REGION_TYPE_TASK_STACK, "TaskStack");
     uint8_t* stack = stackVirt;
-    memset(stack, 0, stackPages * KPAGE_SIZE);
 
     // fill stack
     stack += stackSize - 32;
@@ -177,8 +235,8 @@ SchTask* SchCreateTask(const char* name, size_t stackSize, SchTaskFn fn, void* c
     task->name = name;
     task->esp = (uint32_t)stack;
     task->status = SCH_STATUS_RUNNING;
-    task->sleepNext = NULL;
-    task->sleepUntil = 0;
+    task->priority = SCH_PRIORITY_NORMAL;
+    MinHeapEntryInitialize(&task->sleepEntry);
     task->waitNext = NULL;
     task->waitList = NULL;
     task->waitTimeout = false;
@@ -195,7 +253,7 @@ SchTask* SchCreateTask(const char* name, size_t stackSize, SchTaskFn fn, void* c
 
 void SchYield()
 {
-    IntDisableIRQs();
+    uint32_t irqLock = IntEnterCriticalSection();
 
     // Process dead list
     while (!SListIsEmpty(&SchDeadTaskListHead) && SchDeadTaskListHead.Next != &SchCurrentTask->deadList)
@@ -209,11 +267,9 @@ void SchYield()
     }
 
     // Process sleep list
-    while (SchFirstSleepTask && SchFirstSleepTask->sleepUntil <= PitCurrentTick)
+    SchTask* sleeper;
+    while ((sleeper = SchSleepListPopExpired(rdtsc())) != NULL)
     {
-        // Remove from sleep list
-        SchTask* sleeper = SchSleepListPop();
-
         // Remove from wait list
         if (sleeper->waitList || sleeper->status == SCH_STATUS_WAITING)
             SchWaitListRemove(sleeper, true);
@@ -223,35 +279,132 @@ void SchYield()
         sleeper->status = SCH_STATUS_RUNNING;
     }
 
-    // Switch to next run task
-    if (SchCurrentTask->next != SchCurrentTask)
-        SchSwitchTask(SchCurrentTask->next);
+    // Round-robin within the current priority level, then pick the highest priority runnable task
+    if (SchRunListContains(SchCurrentTask))
+    {
+        SchRunListRemove(SchCurrentTask);
+        SchRunListInsert(SchCurrentTask);
+    }
+
+    SchTask* next = SchRunListPickNext();
+    SchUpdateTimer();
+    if (next != NULL && next != SchCurrentTask)
+        SchSwitchTo(next);
+    else
+        IntLeaveCriticalSection(irqLock);
 }
 
-void SchSleep(uint32_t ms)
+void SchTick()
 {
-    if (ms == 0)
-        return SchYield();
+    // Called from the APIC timer interrupt. We may have skipped any number of ticks while idle, and the
+    // one-shot that fired has to be re-armed (it may also have fired early, see ApicTimerStartOneShot).
+    uint64_t now = rdtsc();
+    SchTimerDeadline = 0;
+    PitCurrentTick = SchTickBase + (now - SchTickBaseTsc) / SchTscPerTick;
+    TimerProcessExpired(now);
+    SchYield();
+}
+
+void SchIdle()
+{
+    // Body of the idle task. Every interrupt may have made a task runnable, so reschedule after each one. The run
+    // queues are checked with interrupts disabled and sti only takes effect after the hlt, so a task woken up in
+    // between can't be missed.
+    while (true)
+    {
+        IntDisableIRQs();
+        if ((SchRunQueueBitmap & ~(1u << SCH_PRIORITY_IDLE)) == 0)
+        {
+            SchUpdateTimer();
+            asm volatile("sti\n\thlt");
+        }
+        else
+        {
+            IntEnableIRQs();
+        }
+        SchYield();
+    }
+}
 
+static void SchSleepUntil(uint64_t tscDeadline)
+{
     IntDisableIRQs();
     SchCurrentTask->status = SCH_STATUS_SLEEPING;
-    SchSleepListInsert(SchCurrentTask, PitCurrentTick + PitMsToTicks(ms));
-    SchTask* next = SchRunListRemove(SchCurrentTask);
-    SchSwitchTask(next);
+    SchSleepListInsert(SchCurrentTask, tscDeadline);
+    SchRunListRemove(SchCurrentTask);
+    SchSwitchToNext();
+}
+
+void SchSleep(uint32_t ms)
+{
+    if (ms == 0)
+        return SchYield();
+    SchSleepUntil(rdtsc() + TscMsToTicks(ms));
 }
 
 void SchStall(uint32_t microsecs)
 {
     if (microsecs == 0)
         return;
-    uint64_t ticksPerMicrosec = TscFrequency / 1000000;
-    uint64_t stallUntil = rdtsc() + microsecs * ticksPerMicrosec;
+    uint64_t stallUntil = rdtsc() + TscUsToTicks(microsecs);
     do
     {
-        asm volatile("nop");
+        asm volatile("pause");
     } while (rdtsc() < stallUntil);
 }
 
+void SchDelay(uint32_t microsecs)
+{
+    // Blocking costs two task switches and a timer interrupt, so very short waits are cheaper to spin.
+    // We also have to spin if we can't block (early boot, interrupts disabled, or a DPC running above
+    // IRQL_STANDARD with interrupts enabled, possibly on the stack of the task it interrupted).
+    if (microsecs < SCH_DELAY_SPIN_MICROSECS || SchCurrentTask == NULL || !IntAreIRQsEnabled() || IrqlGetCurrent() > IRQL_STANDARD)
+        return SchStall(microsecs);
+    SchSleepUntil(rdtsc() + TscUsToTicks(microsecs));
+}
+
+void SchSetPriority(SchTask* task, uint32_t priority)
+{
+    DbgAssert(priority < SCH_PRIORITY_COUNT);
+    uint32_t irqLock = IntEnterCriticalSection();
+    if (SchRunListContains(task))
+    {
+        SchRunListRemove(task);
+        task->priority = priority;
+        SchRunListInsert(task);
+    }
+    else
+    {
+        task->priority = priority;
+    }
+    IntLeaveCriticalSection(irqLock);
+}
+
+uint32_t SchGetPriority(SchTask* task)
+{
+    return task->priority;
+}
+
+void SchDebugDump()
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    TmPrintf("    T%llu    ACTIVE TASKS:    ", PitCurrentTick);
+    bool first = true;
+    for (int prio = SCH_PRIORITY_COUNT - 1; prio >= 0; prio--)
+    {
+        ListEntry* entry = SchRunQueues[prio].Next;
+        while (entry != &SchRunQueues[prio])
+        {
+            SchTask* task = CONTAINING_RECORD(entry, SchTask, runList);
+            TmPrintf(first ? "%s/%u" : ", %s/%u", task->name, task->priority);
+            first = false;
+            entry = entry->Next;
+        }
+    }
+    TmPrintf("\n");
+    IntLeaveCriticalSection(irqLock);
+}
+
 SchSemaphore* SchCreateSemaphore(int initial, int max)
 {
     SchSemaphore* semaphore = kcalloc(sizeof(SchSemaphore));
@@ -290,16 +443,16 @@ bool SchSemaphoreTryWait(SchSemaphore* semaphore, uint32_t timeoutMs)
 
         // add to sleep list if we have a timeout
         if (timeoutMs != SCH_INFINITE)
-            SchSleepListInsert(task, PitCurrentTick + PitMsToTicks(timeoutMs));
+            SchSleepListInsert(task, rdtsc() + TscMsToTicks(timeoutMs));
 
         // append to wait list
         SchWaitListAppend(&semaphore->waiters, task);
 
         // remove from run list
-        SchTask* next = SchRunListRemove(task);
+        SchRunListRemove(task);
 
         // switch to next task in run list
-        SchSwitchTask(next);
+        SchSwitchToNext();
 
         // when the above function returns we have either been woken by a signal or due to timeout
         bool result = !task->waitTimeout;
@@ -312,7 +465,7 @@ bool SchSemaphoreTryWait(SchSemaphore* semaphore, uint32_t timeoutMs)
 
 void SchSemaphoreSignal(SchSemaphore* semaphore, int count)
 {
-    IntDisableIRQs();
+    uint32_t irqLock = IntEnterCriticalSection();
     while (count-- && semaphore->count != semaphore->max)
     {
         int result = semaphore->count++;
@@ -323,14 +476,13 @@ void SchSemaphoreSignal(SchSemaphore* semaphore, int count)
             waiter->status = SCH_STATUS_RUNNING;
 
             // remove from sleep list
-            if (waiter->sleepUntil != 0)
-                SchSleepListRemove(waiter);
+            SchSleepListRemove(waiter);
 
             // add to run list
             SchRunListInsert(waiter);
         }
     }
-    IntEnableIRQs();
+    IntLeaveCriticalSection(irqLock);
 }
 
 SchMutex* SchCreateMutex()
@@ -366,16 +518,16 @@ bool SchMutexTryLock(SchMutex* mutex, uint32_t timeoutMs)
 
         // add to sleep list if we have a timeout
         if (timeoutMs != SCH_INFINITE)
-            SchSleepListInsert(task, PitCurrentTick + PitMsToTicks(timeoutMs));
+            SchSleepListInsert(task, rdtsc() + TscMsToTicks(timeoutMs));
 
         // append to wait list
         SchWaitListAppend(&mutex->waiters, task);
 
         // remove from run list
-        SchTask* next = SchRunListRemove(task);
+        SchRunListRemove(task);
 
         // switch to next task in run list
-        SchSwitchTask(next);
+        SchSwitchToNext();
 
         // when the above function returns we have either been woken by an unlock or due to timeout
         bool result = !task->waitTimeout;
@@ -398,14 +550,13 @@ void SchMutexUnlock(SchMutex* mutex)
         waiter->status = SCH_STATUS_RUNNING;
 
         // remove from sleep list
-        if (waiter->sleepUntil != 0)
-            SchSleepListRemove(waiter);
+        SchSleepListRemove(waiter);
 
         // add to run list
         SchRunListInsert(waiter);
 
         // switch to waiter
-        SchSwitchTask(waiter);
+        SchSwitchTo(waiter);
         return;
     }
     mutex->held = false;
@@ -445,16 +596,16 @@ bool SchEventTryWait(SchEvent* event, uint32_t timeoutMs)
 
         // add to sleep list if we have a timeout
         if (timeoutMs != SCH_INFINITE)
-            SchSleepListInsert(task, PitCurrentTick + PitMsToTicks(timeoutMs));
+            SchSleepListInsert(task, rdtsc() + TscMsToTicks(timeoutMs));
 
         // append to wait list
         SchWaitListAppend(&event->waiters, task);
 
         // remove from run list
-        SchTask* next = SchRunListRemove(task);
+        SchRunListRemove(task);
 
         // switch to next task in run list
-        SchSwitchTask(next);
+        SchSwitchToNext();
 
         // when the above function returns we have either been woken by a signal or due to timeout
         bool result = !task->waitTimeout;
@@ -467,7 +618,7 @@ bool SchEventTryWait(SchEvent* event, uint32_t timeoutMs)
 
 void SchEventSignal(SchEvent* event)
 {
-    IntDisableIRQs();
+    uint32_t irqLock = IntEnterCriticalSection();
     event->signaled = true;
     while (event->waiters.first)
     {
@@ -476,13 +627,19 @@ void SchEventSignal(SchEvent* event)
         waiter->status = SCH_STATUS_RUNNING;
 
         // remove from sleep list
-        if (waiter->sleepUntil != 0)
-            SchSleepListRemove(waiter);
+        SchSleepListRemove(waiter);
 
         // add to run list
         SchRunListInsert(waiter);
     }
-    IntEnableIRQs();
+    IntLeaveCriticalSection(irqLock);
+}
+
+void SchEventReset(SchEvent* event)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    event->signaled = false;
+    IntLeaveCriticalSection(irqLock);
 }
 
 SchQueue* SchCreateQueue()
@@ -501,7 +658,7 @@ void SchDestroyQueue(SchQueue* queue)
 
 void SchQueuePush(SchQueue* queue, ListEntry* entry)
 {
-    IntDisableIRQs();
+    uint32_t irqLock = IntEnterCriticalSection();
     if (queue->waiters.first == NULL)
     {
         ListPushBack(&queue->entries, entry);
@@ -514,13 +671,12 @@ void SchQueuePush(SchQueue* queue, ListEntry* entry)
         waiter->status = SCH_STATUS_RUNNING;
 
         // remove from sleep list
-        if (waiter->sleepUntil != 0)
-            SchSleepListRemove(waiter);
+        SchSleepListRemove(waiter);
 
         // add to run list
         SchRunListInsert(waiter);
     }
-    IntEnableIRQs();
+    IntLeaveCriticalSection(irqLock);
 }
 
 ListEntry* SchQueuePop(SchQueue* queue)
@@ -540,16 +696,16 @@ ListEntry* SchQueueTryPop(SchQueue* queue, uint32_t timeoutMs)
 
         // add to sleep list if we have a timeout
         if (timeoutMs != SCH_INFINITE)
-            SchSleepListInsert(task, PitCurrentTick + PitMsToTicks(timeoutMs));
+            SchSleepListInsert(task, rdtsc() + TscMsToTicks(timeoutMs));
 
         // append to wait list
         SchWaitListAppend(&queue->waiters, task);
 
         // remove from run list
-        SchTask* next = SchRunListRemove(task);
+        SchRunListRemove(task);
 
         // switch to next task in run list
-        SchSwitchTask(next);
+        SchSwitchToNext();
 
         // when the above function returns we have either been woken by a signal or due to timeout
         bool success = !task->waitTimeout;
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "list.h"
+#include "minheap.h"
 
 #define SCH_INFINITE ((uint32_t)-1)
 
@@ -13,6 +14,13 @@
 #define SCH_STATUS_SLEEPING 2
 #define SCH_STATUS_WAITING  3
 
+#define SCH_PRIORITY_COUNT    32
+#define SCH_PRIORITY_IDLE     0  // Only runs when nothing else is runnable
+#define SCH_PRIORITY_LOW      8  // Background work
+#define SCH_PRIORITY_NORMAL   16 // Default for new tasks
+#define SCH_PRIORITY_HIGH     24 // Latency sensitive tasks, e.g. I/O completion
+#define SCH_PRIORITY_REALTIME 31
+
 #pragma pack(push, 1)
 typedef struct SchTask_s SchTask;
 typedef struct SchWaitList_s SchWaitList;
@@ -20,13 +28,13 @@ typedef struct SchWaitList_s SchWaitList;
 // NOTE: if you change this also change in asm
 typedef struct SchTask_s
 {
-    SchTask* next;
+    ListEntry runList;
     uint32_t id;
     const char* name;
     uint32_t esp;
     uint32_t status;
-    SchTask* sleepNext;
-    uint64_t sleepUntil;
+    uint32_t priority;
+    MinHeapEntry sleepEntry;
     SchTask* waitNext;
     SchWaitList* waitList;
     bool waitTimeout;
@@ -80,8 +88,15 @@ SchTask* SchInitialize();
 SchTask* SchCreateTask(const char* name, size_t stackSize, SchTaskFn fn, void* ctx);
 void SchSwitchTask(SchTask* target);
 void SchYield();
+void SchTick();
+void SchIdle();
 void SchSleep(uint32_t ms);
 void SchStall(uint32_t microsecs);
+void SchDelay(uint32_t microsecs);
+void SchUpdateTimer();
+void SchSetPriority(SchTask* task, uint32_t priority);
+uint32_t SchGetPriority(SchTask* task);
+void SchDebugDump();
 
 SchSemaphore* SchCreateSemaphore(int initial, int max);
 void SchDestroySemaphore(SchSemaphore* semaphore);
@@ -100,6 +115,7 @@ void SchDestroyEvent(SchEvent* event);
 void SchEventWait(SchEvent* event);
 bool SchEventTryWait(SchEvent* event, uint32_t timeoutMs);
 void SchEventSignal(SchEvent* event);
+void SchEventReset(SchEvent* event);
 
 SchQueue* SchCreateQueue();
 void SchDestroyQueue(SchQueue* queue);
@@ -0,0 +1,95 @@
+#include "tsc.h"
+#include "timer.h"
+#include "debug.h"
+#include "memory.h"
+#include "lowlevel.h"
+#include "scheduler.h"
+#include "interrupts.h"
+
+// Armed timers ordered by deadline. The scheduler programs the APIC timer for the earliest one.
+static MinHeap TimerQueue;
+
+void TimerInitialize()
+{
+    MinHeapInitialize(&TimerQueue);
+}
+
+Timer* TimerCreate(TimerCallbackFn* callback, void* ctx)
+{
+    DbgAssert(callback != NULL);
+    Timer* timer = kalloc(sizeof(Timer));
+    MinHeapEntryInitialize(&timer->entry);
+    timer->period = 0;
+    timer->callback = callback;
+    timer->ctx = ctx;
+    return timer;
+}
+
+void TimerDestroy(Timer* timer)
+{
+    TimerCancel(timer);
+    kfree(timer);
+}
+
+void TimerArm(Timer* timer, uint64_t microsecs)
+{
+    TimerArmDeadline(timer, rdtsc() + TscUsToTicks(microsecs), 0);
+}
+
+void TimerArmPeriodic(Timer* timer, uint64_t microsecs, uint64_t periodMicrosecs)
+{
+    DbgAssert(periodMicrosecs != 0);
+    TimerArmDeadline(timer, rdtsc() + TscUsToTicks(microsecs), TscUsToTicks(periodMicrosecs));
+}
+
+void TimerArmDeadline(Timer* timer, uint64_t tscDeadline, uint64_t tscPeriod)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    if (TimerIsArmed(timer))
+        MinHeapRemove(&TimerQueue, &timer->entry);
+    timer->period = tscPeriod;
+    MinHeapInsert(&TimerQueue, &timer->entry, tscDeadline);
+
+    // Reprogram the APIC timer if this is the new earliest deadline
+    if (SchCurrentTask && MinHeapPeek(&TimerQueue) == &timer->entry)
+        SchUpdateTimer();
+    IntLeaveCriticalSection(irqLock);
+}
+
+bool TimerCancel(Timer* timer)
+{
+    uint32_t irqLock = IntEnterCriticalSection();
+    bool wasArmed = TimerIsArmed(timer);
+    if (wasArmed)
+        MinHeapRemove(&TimerQueue, &timer->entry);
+    timer->period = 0;
+    IntLeaveCriticalSection(irqLock);
+    return wasArmed;
+}
+
+uint64_t TimerNextDeadline()
+{
+    MinHeapEntry* first = MinHeapPeek(&TimerQueue);
+    return first ? first->Key : TIMER_NO_DEADLINE;
+}
+
+void TimerProcessExpired(uint64_t now)
+{
+    MinHeapEntry* first;
+    while ((first = MinHeapPeek(&TimerQueue)) != NULL && first->Key <= now)
+    {
+        Timer* timer = CONTAINING_RECORD(first, Timer, entry);
+        MinHeapRemove(&TimerQueue, first);
+
+        // Periodic timers keep their phase, unless we fell more than a period behind
+        if (timer->period != 0)
+        {
+            uint64_t deadline = first->Key + timer->period;
+            if (deadline <= now)
+                deadline = now + timer->period;
+            MinHeapInsert(&TimerQueue, &timer->entry, deadline);
+        }
+
+        timer->callback(timer, timer->ctx);
+    }
+}
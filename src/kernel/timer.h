@@ -0,0 +1,40 @@
+#ifndef KERNEL_TIMER_H
+#define KERNEL_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "minheap.h"
+
+#define TIMER_NO_DEADLINE ((uint64_t)-1)
+
+typedef struct Timer_s Timer;
+
+// Timer callbacks run at IRQL_SCHEDULER with interrupts disabled, from the APIC timer interrupt or from its replay
+// once the IRQL drops below IRQL_SCHEDULER. They must not block or lower the IRQL below IRQL_SCHEDULER.
+// They may re-arm or cancel any timer, including their own.
+typedef void TimerCallbackFn(Timer* timer, void* ctx);
+
+typedef struct Timer_s
+{
+    MinHeapEntry entry; // key is the deadline in TSC ticks
+    uint64_t period;    // in TSC ticks, 0 for one-shot timers
+    TimerCallbackFn* callback;
+    void* ctx;
+} Timer;
+
+void TimerInitialize();
+Timer* TimerCreate(TimerCallbackFn* callback, void* ctx);
+void TimerDestroy(Timer* timer);
+void TimerArm(Timer* timer, uint64_t microsecs);
+void TimerArmPeriodic(Timer* timer, uint64_t microsecs, uint64_t periodMicrosecs);
+void TimerArmDeadline(Timer* timer, uint64_t tscDeadline, uint64_t tscPeriod);
+bool TimerCancel(Timer* timer);
+uint64_t TimerNextDeadline();
+void TimerProcessExpired(uint64_t now);
+
+static inline bool TimerIsArmed(Timer* timer)
+{
+    return MinHeapEntryIsQueued(&timer->entry);
+}
+
+#endif
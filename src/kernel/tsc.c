@@ -1,16 +1,207 @@
+#include "pit.h"
 #include "tsc.h"
+#include "hpet.h"
+#include "apic.h"
 #include "textmode.h"
+#include "scheduler.h"
+
+#define CPUID_GETVENDOR 0
+#define CPUID_GETTSCCRYSTAL 0x15
+#define CPUID_GETFREQUENCY 0x16
+#define CPUID_GETEXTFEATURES 0x80000000
+#define CPUID_GETPOWERFEATURES 0x80000007
+#define CPUID_FEAT_EDX_INVARIANT_TSC (1 << 8)
+
+#define TSC_CALIBRATE_FAST_MS    10
+#define TSC_CALIBRATE_PRECISE_MS 500
+#define TSC_CALIBRATE_APIC_US    1000 // APIC timer window when the TSC frequency comes from CPUID
 
 uint64_t TscFrequency = 0;
+bool TscIsInvariant = false;
+
+// One calibration window, measured against the HPET or the PIT
+typedef struct TscWindow_s
+{
+    const char* reference;
+    uint64_t referenceFrequency;
+    uint64_t referenceElapsed;
+    uint64_t tscElapsed;
+    uint64_t tscUncertainty; // TSC cycles we can't attribute to either side of the start and end edges
+    uint32_t apicElapsed;
+} TscWindow;
+
+static bool TscCpuHasInvariantTsc()
+{
+    uint32_t eax, edx;
+    cpuid(CPUID_GETEXTFEATURES, &eax, &edx);
+    if (eax < CPUID_GETPOWERFEATURES)
+        return false;
+    cpuid(CPUID_GETPOWERFEATURES, &eax, &edx);
+    return (edx & CPUID_FEAT_EDX_INVARIANT_TSC) != 0;
+}
+
+static bool TscCalibrateCpuid(bool allowNominal)
+{
+    uint32_t maxLeaf, eax, ebx, ecx, edx;
+    cpuid2(CPUID_GETVENDOR, &maxLeaf, &ebx, &ecx, &edx);
+
+    // TSC/crystal ratio and crystal frequency, this is exact
+    if (maxLeaf >= CPUID_GETTSCCRYSTAL)
+    {
+        cpuid2(CPUID_GETTSCCRYSTAL, &eax, &ebx, &ecx, &edx);
+        if (eax != 0 && ebx != 0 && ecx != 0)
+        {
+            TscFrequency = (uint64_t)ecx * ebx / eax;
+            TmPrintfDbg("TSC frequency: %llu Hz (CPUID 15h, crystal %u Hz * %u/%u)\n", TscFrequency, ecx, ebx, eax);
+            return true;
+        }
+    }
 
-extern void TscCalibrate();
+    // Nominal base frequency in MHz. Only good to +-0.5 MHz and not guaranteed to match the TSC.
+    if (allowNominal && maxLeaf >= CPUID_GETFREQUENCY)
+    {
+        cpuid2(CPUID_GETFREQUENCY, &eax, &ebx, &ecx, &edx);
+        uint32_t baseMhz = eax & 0xFFFF;
+        if (baseMhz != 0)
+        {
+            TscFrequency = baseMhz * 1000000ull;
+            TmPrintfDbg("TSC frequency: %llu Hz (CPUID 16h, nominal, error < %u ppm)\n", TscFrequency, 500000 / baseMhz + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t TscSampleHpet(uint64_t* hpet, uint64_t* uncertainty)
+{
+    uint64_t before = rdtsc();
+    *hpet = HpetReadCounter();
+    uint64_t after = rdtsc();
+    *uncertainty += after - before;
+    return before + (after - before) / 2;
+}
+
+static void TscMeasureHpet(uint32_t ms, TscWindow* window)
+{
+    window->reference = "HPET";
+    window->referenceFrequency = HpetFrequency;
+
+    uint64_t length = HpetFrequency * ms / 1000;
+    uint64_t hpetStart, hpetEnd;
+    uint64_t startUncertainty = 0, endUncertainty;
+    uint64_t tscStart = TscSampleHpet(&hpetStart, &startUncertainty);
+    ApicTimerStartCount();
+    uint64_t tscEnd;
+    do
+    {
+        endUncertainty = 0;
+        tscEnd = TscSampleHpet(&hpetEnd, &endUncertainty);
+    } while (((hpetEnd - hpetStart) & HpetCounterMask) < length);
+    window->apicElapsed = ApicTimerReadCount();
+    window->tscUncertainty = startUncertainty + endUncertainty;
 
-void TscInitialize()
+    window->referenceElapsed = (hpetEnd - hpetStart) & HpetCounterMask;
+    window->tscElapsed = tscEnd - tscStart;
+}
+
+static uint64_t TscWaitPitEdge(bool* level, uint64_t* uncertainty)
 {
-    TscCalibrate();
-    uint64_t rawHz = TscFrequency;
-    uint64_t rawMhz = rawHz / 1000000;
-    uint64_t roundMhz = ((rawMhz + 50) / 100) * 100;
-    TscFrequency = roundMhz * 1000000;
-    TmPrintfDbg("TSC frequency: %llu Hz (%llu MHz raw=%llu, %llu Hz)\n", TscFrequency, roundMhz, rawMhz, rawHz);
+    // The edge happened somewhere between the last read that saw the old level and the first that saw the new one
+    uint64_t before, after = rdtsc();
+    bool current;
+    do
+    {
+        before = after;
+        current = PitChannel2ReadOut();
+        after = rdtsc();
+    } while (current == *level);
+    *level = current;
+    *uncertainty += after - before;
+    return before + (after - before) / 2;
+}
+
+static void TscMeasurePit(uint32_t ms, TscWindow* window)
+{
+    window->reference = "PIT";
+    window->referenceFrequency = PIT_BASE_FREQUENCY;
+
+    // Channel 2 is a 16-bit counter, so longer windows span several half periods of the square wave
+    uint32_t total = PIT_BASE_FREQUENCY * ms / 1000;
+    uint32_t halfPeriods = 1;
+    while (total / halfPeriods > UINT16_MAX / 2)
+        halfPeriods++;
+    uint32_t halfPeriod = total / halfPeriods;
+
+    PitChannel2Start((uint16_t)(halfPeriod * 2));
+    bool level = PitChannel2ReadOut();
+    uint64_t ignored = 0;
+    TscWaitPitEdge(&level, &ignored); // the first half period starts with an unknown delay after the gate
+
+    uint64_t tscStart = TscWaitPitEdge(&level, &window->tscUncertainty);
+    ApicTimerStartCount();
+    uint64_t tscEnd = tscStart;
+    for (uint32_t i = 0; i < halfPeriods; i++)
+    {
+        uint64_t uncertainty = 0;
+        tscEnd = TscWaitPitEdge(&level, &uncertainty);
+        if (i == halfPeriods - 1)
+            window->tscUncertainty += uncertainty;
+    }
+    window->apicElapsed = ApicTimerReadCount();
+    PitChannel2Stop();
+
+    window->referenceElapsed = (uint64_t)halfPeriod * halfPeriods;
+    window->tscElapsed = tscEnd - tscStart;
+}
+
+static void TscCalibrateWindow(uint32_t ms)
+{
+    TscWindow window = {0};
+    if (HpetIsAvailable())
+        TscMeasureHpet(ms, &window);
+    else
+        TscMeasurePit(ms, &window);
+
+    TscFrequency = window.tscElapsed * window.referenceFrequency / window.referenceElapsed;
+    uint64_t errorPpm = window.tscUncertainty * 1000000 / window.tscElapsed + 1;
+    TmPrintfDbg("TSC frequency: %llu Hz (%llu cycles in %llu %s ticks, error < %llu ppm)\n",
+                TscFrequency, window.tscElapsed, window.referenceElapsed, window.reference, errorPpm);
+
+    if (ApicIsAvailable())
+    {
+        // One count of quantization on top of the window error
+        ApicFrequency = (uint32_t)((uint64_t)window.apicElapsed * window.referenceFrequency / window.referenceElapsed);
+        TmPrintfDbg("Local APIC timer frequency: %u Hz (%u counts, error < %llu ppm)\n",
+                    ApicFrequency, window.apicElapsed, errorPpm + 1000000 / window.apicElapsed + 1);
+    }
+}
+
+static void TscCalibrateApic()
+{
+    // The TSC is exact, so a short window against it is enough for the APIC timer
+    if (!ApicIsAvailable())
+        return;
+    uint64_t start = rdtsc();
+    ApicTimerStartCount();
+    SchStall(TSC_CALIBRATE_APIC_US);
+    uint32_t count = ApicTimerReadCount();
+    uint64_t cycles = rdtsc() - start;
+
+    ApicFrequency = (uint32_t)((uint64_t)count * TscFrequency / cycles);
+    TmPrintfDbg("Local APIC timer frequency: %u Hz (%u counts in %llu TSC cycles, error < %u ppm)\n",
+                ApicFrequency, count, cycles, 1000000 / count + 1);
+}
+
+void TscInitialize(bool precise)
+{
+    TscIsInvariant = TscCpuHasInvariantTsc();
+    if (!TscIsInvariant)
+        TmPrintfWrn("TSC is not invariant, time keeping may drift\n");
+
+    // Calibrates the TSC and, if the local APIC is initialized, its timer. The fast mode takes a 10ms window
+    // (or none at all if CPUID reports the frequency), the precise mode a 500ms one.
+    if (TscCalibrateCpuid(!precise))
+        TscCalibrateApic();
+    else
+        TscCalibrateWindow(precise ? TSC_CALIBRATE_PRECISE_MS : TSC_CALIBRATE_FAST_MS);
 }
@@ -1,10 +1,22 @@
 #ifndef KERNEL_TSC_H
 #define KERNEL_TSC_H
 
+#include <stdbool.h>
 #include "lowlevel.h"
 
 extern uint64_t TscFrequency;
+extern bool TscIsInvariant;
 
-void TscInitialize();
+void TscInitialize(bool precise);
+
+static inline uint64_t TscMsToTicks(uint64_t ms)
+{
+    return ms * (TscFrequency / 1000);
+}
+
+static inline uint64_t TscUsToTicks(uint64_t us)
+{
+    return us * (TscFrequency / 1000000);
+}
 
 #endif